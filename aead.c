@@ -0,0 +1,167 @@
+#include <string.h>
+#include "util.h"
+#include "buffered.h"
+
+#include "aead.h"
+
+/** Bytes encrypted and hashed at a time; fits in any L1 data cache. */
+#define AEAD_TILE_SIZE 4096
+
+#define AEAD_SPECIFICS_DEF(bits)					\
+  const estream_aead_attributes estream_aead_##bits##_attributes = {	\
+    .uhash_key_offset = offsetof(estream_aead_##bits##_ctx, key),	\
+    .uhash_state_offset = offsetof(estream_aead_##bits##_ctx, state)	\
+  };
+
+AEAD_SPECIFICS_DEF(32)
+AEAD_SPECIFICS_DEF(64)
+AEAD_SPECIFICS_DEF(96)
+AEAD_SPECIFICS_DEF(128)
+
+#undef AEAD_SPECIFICS_DEF
+
+static const estream_aead_attributes *const aead_attributes_array[4] = {
+    &estream_aead_32_attributes,
+    &estream_aead_64_attributes,
+    &estream_aead_96_attributes,
+    &estream_aead_128_attributes
+};
+
+static uhash_key *
+aead_key(estream_aead_ctx *ctx)
+{
+  return (uhash_key *)((uint8_t *)ctx + ctx->attribs->uhash_key_offset);
+}
+
+static uhash_state *
+aead_state(estream_aead_ctx *ctx)
+{
+  return (uhash_state *)((uint8_t *)ctx + ctx->attribs->uhash_state_offset);
+}
+
+void
+estream_aead_init(estream_aead_ctx *ctx, uhash_type type, const uint8_t *key)
+{
+  salsa20_buffered_state kdf = salsa20_static_initializer;
+  salsa20_master_state master;
+  /* Copies, so that the caller's buffers need no alignment. */
+  uint32_t key_copy[ESTREAM_AEAD_KEY_SIZE / 4];
+  uint32_t cipher_key[ESTREAM_AEAD_KEY_SIZE / 4];
+  const uint32_t kdf_iv[2] = {0, 0};
+
+  memcpy(key_copy, key, ESTREAM_AEAD_KEY_SIZE);
+  salsa20_init_key(&master, SALSA20_12, (uint8_t *)key_copy, SALSA20_256_BITS);
+  salsa20_init_iv(&kdf.state, &master, (const uint8_t *)kdf_iv);
+
+  /* The cipher key comes first in the expanded key, then the UHASH key. */
+  buffered_action(&kdf.header, (uint8_t *)cipher_key, ESTREAM_AEAD_KEY_SIZE, BUFFERED_EXTRACT);
+  salsa20_init_key(&ctx->cipher_key, SALSA20_12, (uint8_t *)cipher_key, SALSA20_256_BITS);
+
+  ctx->attribs = aead_attributes_array[type];
+  uhash_key_setup(type, aead_key(ctx), &kdf.header);
+}
+
+/** Sets up the message cipher, takes the tag pad from its first block, and
+ * hashes the associated data. */
+static void
+aead_begin(estream_aead_ctx *ctx, salsa20_buffered_state *cipher,
+	   const uint8_t *nonce, const uint8_t *ad, size_t adlen, uint8_t *pad)
+{
+  static const uint8_t zeros[32] = {0};
+  uhash_key *key = aead_key(ctx);
+  uint32_t iv[ESTREAM_AEAD_NONCE_SIZE / 4];
+
+  memcpy(iv, nonce, ESTREAM_AEAD_NONCE_SIZE);
+  buffered_init_header(&cipher->header, SALSA20);
+  salsa20_init_iv(&cipher->state, &ctx->cipher_key, (const uint8_t *)iv);
+  buffered_action(&cipher->header, pad, 64, BUFFERED_EXTRACT);
+
+  uhash_init(uhash_get_type_from_key(key), aead_state(ctx));
+  uhash_update(key, aead_state(ctx), ad, adlen);
+  if(adlen % 32)
+    uhash_update(key, aead_state(ctx), zeros, 32 - adlen % 32);
+}
+
+/** Hashes the lengths and computes the tag. */
+static void
+aead_finish(estream_aead_ctx *ctx, size_t adlen, size_t len,
+	    const uint8_t *pad, uint8_t *tag)
+{
+  uhash_key *key = aead_key(ctx);
+  uint8_t lengths[16];
+
+  unpack_littleendian((uint64_t)adlen, lengths);
+  unpack_littleendian((uint64_t)adlen >> 32, lengths + 4);
+  unpack_littleendian((uint64_t)len, lengths + 8);
+  unpack_littleendian((uint64_t)len >> 32, lengths + 12);
+  uhash_update(key, aead_state(ctx), lengths, 16);
+
+  uhash_finish(key, aead_state(ctx), tag);
+  memxor(tag, pad, key->attribs->iters * 4);
+}
+
+void
+estream_aead_seal(estream_aead_ctx *ctx, const uint8_t *nonce,
+		  const uint8_t *ad, size_t adlen,
+		  const uint8_t *in, uint8_t *out, size_t len,
+		  uint8_t *tag)
+{
+  salsa20_buffered_state cipher;
+  uint8_t pad[64];
+  size_t done;
+
+  aead_begin(ctx, &cipher, nonce, ad, adlen, pad);
+
+  for(done = 0; done < len; done += AEAD_TILE_SIZE)
+    {
+      const size_t tile = min(len - done, AEAD_TILE_SIZE);
+
+      if(out != in)
+	memcpy(out + done, in + done, tile);
+      buffered_action(&cipher.header, out + done, tile, BUFFERED_ENCDEC);
+      uhash_update(aead_key(ctx), aead_state(ctx), out + done, tile);
+    }
+
+  aead_finish(ctx, adlen, len, pad, tag);
+}
+
+estream_aead_status
+estream_aead_open(estream_aead_ctx *ctx, const uint8_t *nonce,
+		  const uint8_t *ad, size_t adlen,
+		  const uint8_t *in, uint8_t *out, size_t len,
+		  const uint8_t *tag)
+{
+  const int tag_size = aead_key(ctx)->attribs->iters * 4;
+  salsa20_buffered_state cipher;
+  uint8_t pad[64];
+  uint8_t expected[16];
+  uint8_t diff = 0;
+  size_t done;
+  int i;
+
+  aead_begin(ctx, &cipher, nonce, ad, adlen, pad);
+
+  for(done = 0; done < len; done += AEAD_TILE_SIZE)
+    {
+      const size_t tile = min(len - done, AEAD_TILE_SIZE);
+
+      uhash_update(aead_key(ctx), aead_state(ctx), in + done, tile);
+      if(out != in)
+	memcpy(out + done, in + done, tile);
+      buffered_action(&cipher.header, out + done, tile, BUFFERED_ENCDEC);
+    }
+
+  aead_finish(ctx, adlen, len, pad, expected);
+
+  /* Compared without branching on the data, to not leak how much matched. */
+  for(i = 0; i < tag_size; ++i)
+    diff |= expected[i] ^ tag[i];
+
+  if(diff)
+    {
+      memset(out, 0, len);
+      return ESTREAM_AEAD_VERIFY_FAILED;
+    }
+
+  return ESTREAM_AEAD_SUCCESS;
+}
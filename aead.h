@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stddef.h>
+#include <inttypes.h>
+#include "salsa20.h"
+#include "umac.h"
+
+/* Authenticated encryption with associated data, built from Salsa20/12 and
+ * UHASH.
+ *
+ * The key is expanded with Salsa20/12, like the UMAC key, into the cipher key
+ * and the UHASH key. Each message is encrypted with the cipher key and the
+ * nonce as IV: the first keystream block pads the tag, the following ones
+ * encrypt the message. The tag is UHASH of the associated data, zero padded
+ * to a multiple of 32 bytes, then the ciphertext, then the lengths of both,
+ * in bytes, as 64 bits little endian numbers.
+ *
+ * The message is processed in tiles small enough to stay in the L1 cache,
+ * each one encrypted and hashed (or hashed and decrypted) before the next, so
+ * the data is read from memory only once. */
+
+/** Size of the AEAD key, in bytes. */
+#define ESTREAM_AEAD_KEY_SIZE 32
+
+/** Size of the AEAD nonce, in bytes. */
+#define ESTREAM_AEAD_NONCE_SIZE 8
+
+typedef struct
+{
+  uint16_t uhash_key_offset;
+  uint16_t uhash_state_offset;
+} estream_aead_attributes;
+
+/** Header common to all the estream_aead_<bits>_ctx types. All fields are
+ * internal. */
+typedef struct
+{
+  const estream_aead_attributes *attribs;
+  salsa20_master_state cipher_key;
+} estream_aead_ctx;
+
+#define ESTREAM_AEAD_BITS(bits)						\
+  typedef struct							\
+  {									\
+    estream_aead_ctx header;						\
+    uhash_##bits##_key key;						\
+    uhash_##bits##_state state;						\
+  } estream_aead_##bits##_ctx;						\
+  extern const estream_aead_attributes estream_aead_##bits##_attributes;
+
+ESTREAM_AEAD_BITS(32)
+ESTREAM_AEAD_BITS(64)
+ESTREAM_AEAD_BITS(96)
+ESTREAM_AEAD_BITS(128)
+
+#undef ESTREAM_AEAD_BITS
+
+typedef enum
+{
+  ESTREAM_AEAD_SUCCESS,
+  ESTREAM_AEAD_VERIFY_FAILED
+} estream_aead_status;
+
+/** Initializes an AEAD context with a key.
+ *
+ * @param ctx The header of an estream_aead_<bits>_ctx, matching the type.
+ * @param type The tag size.
+ * @param key ESTREAM_AEAD_KEY_SIZE bytes of secret key.
+ */
+void estream_aead_init(estream_aead_ctx *ctx, uhash_type type, const uint8_t *key);
+
+/** Encrypts and authenticates a message.
+ *
+ * @param nonce ESTREAM_AEAD_NONCE_SIZE bytes, that must be different for
+ * every message sealed with the same key.
+ * @param ad Associated data, authenticated but not encrypted.
+ * @param in The message; may be the same as out, for in place encryption.
+ * @param out Where to store the ciphertext, of the same length.
+ * @param tag Where to store the tag, of 4, 8, 12 or 16 bytes, depending on
+ * the context type. It may be out + len, to have the tag appended.
+ */
+void estream_aead_seal(estream_aead_ctx *ctx, const uint8_t *nonce,
+		       const uint8_t *ad, size_t adlen,
+		       const uint8_t *in, uint8_t *out, size_t len,
+		       uint8_t *tag);
+
+/** Verifies and decrypts a message.
+ *
+ * @param in The ciphertext; may be the same as out, for in place decryption.
+ * @param out Where to store the message, of the same length. If the tag does
+ * not match, it is filled with zeros instead.
+ * @param tag The tag to be verified.
+ * @returns ESTREAM_AEAD_SUCCESS, or ESTREAM_AEAD_VERIFY_FAILED if the
+ * ciphertext, associated data or tag were modified.
+ */
+estream_aead_status estream_aead_open(estream_aead_ctx *ctx, const uint8_t *nonce,
+				      const uint8_t *ad, size_t adlen,
+				      const uint8_t *in, uint8_t *out, size_t len,
+				      const uint8_t *tag);
@@ -5,31 +5,6 @@
 
 #include "buffered.h"
 
-#define CIPHER_SPECIFICS_DEF(name,size)					\
-  const cipher_attributes name##_cipher = {				\
-    .extract_func = (extract_func_type)name##_extract,			\
-    .buffered_state_size = sizeof(name##_buffered_state),		\
-    .buffer_offset = offsetof(name##_buffered_state, buffer),		\
-    .chunk_size = size							\
-  };									\
-  const name##_buffered_state name##_static_initializer = {		\
-      .header = { .cipher = &name##_cipher, .available_count = 0 }	\
-  };
-
-CIPHER_SPECIFICS_DEF(hc128, 4)
-CIPHER_SPECIFICS_DEF(rabbit, 16)
-CIPHER_SPECIFICS_DEF(salsa20, 64)
-CIPHER_SPECIFICS_DEF(sosemanuk, 16)
-
-#undef CIPHER_SPECIFICS_DEF
-
-const cipher_attributes *cipher_attributes_map[LAST_CIPHER+1] = {
-    &hc128_cipher,
-    &rabbit_cipher,
-    &salsa20_cipher,
-    &sosemanuk_cipher
-};
-
 void *
 buffered_get_cipher_state(buffered_state *full_state)
 {
@@ -49,109 +24,551 @@ buffered_reset(buffered_state *state_header)
   state_header->available_count = 0;
 }
 
-static uint8_t *
-memxor(uint8_t *dest, const uint8_t *mask, size_t n)
+/** Applies the keystream in mask to the stream, according to op. */
+static ALWAYS_INLINE void
+apply_op(uint8_t *stream, const uint8_t *mask, size_t n, buffered_ops op)
 {
-  size_t i;
-  if(UNALIGNED_ACCESS || (is_aligned(dest) && is_aligned(mask)))
-    {
-      uint64_t *d64 = (uint64_t*)dest;
-      uint64_t *m64 = (uint64_t*)mask;
-      size_t wlen = n / 8;
-      for(i = 0; i < wlen; ++i)
-	d64[i] ^= m64[i];
-      dest += wlen * 8;
-      mask += wlen * 8;
-      n %= 8;
-    }
+  if(op == BUFFERED_EXTRACT)
+    memcpy(stream, mask, n);
+  else
+    memxor(stream, mask, n);
+}
 
-  for(i = 0; i < n; ++i)
-    dest[i] ^= mask[i];
+/** Refills the whole keystream buffer of the state. */
+static ALWAYS_INLINE void
+buffer_fill(void *cipher_state, uint8_t *cbuffer, extract_func_type extract,
+	    uint16_t chunk_size, uint32_t buffer_size)
+{
+  uint32_t i;
 
-  return NULL;
+  for(i = 0; i < buffer_size; i += chunk_size)
+    extract(cipher_state, cbuffer + i);
 }
 
-typedef void *(*memop_func)(void *dest, const void *src, size_t n);
-static const memop_func memops[] =
-  {
-    memcpy,
-    (memop_func)memxor
-  };
+/* The generic implementations of the buffered operations. They are always
+ * inlined into the per cipher functions below, where the extract function
+ * and sizes are compile time constants. */
 
-void
-buffered_action(buffered_state *full_state, uint8_t *stream, size_t len, buffered_ops op)
+static ALWAYS_INLINE void
+action_body(buffered_state *full_state, void *cipher_state, uint8_t *cbuffer,
+	    uint8_t *stream, size_t len, buffered_ops op,
+	    extract_func_type extract, uint16_t chunk_size, uint32_t buffer_size)
 {
-  const uint8_t chunk_size = full_state->cipher->chunk_size;
-
-  uint8_t *cbuffer = (uint8_t*)full_state + full_state->cipher->buffer_offset;
   assert(is_aligned(cbuffer) && "Unaligned buffered_state");
 
-  void *cipher_state = buffered_get_cipher_state(full_state);
-
-  uint8_t count = full_state->available_count;
+  uint32_t count = full_state->available_count;
 
   /* First, use up whatever is in the buffer */
   if(count > 0)
     {
       size_t to_copy = min(count, len);
-      memops[op](stream, cbuffer + chunk_size - count, to_copy);
+      apply_op(stream, cbuffer + buffer_size - count, to_copy, op);
       count -= to_copy;
       len -= to_copy;
       stream += to_copy;
     }
 
-  /* Then extract while len is multiple of the chunk_size */
-  int i = len / chunk_size;
-  uint8_t remainder = len % chunk_size;
-  /* If aligned correctly, can spare one extra copy. */
+  /* Then process the bulk of the stream. If aligned correctly, extraction
+   * can spare one extra copy by writing whole chunks directly to the
+   * output. Otherwise, the buffer is filled as a whole and applied at once. */
   if(op == BUFFERED_EXTRACT && is_aligned(stream))
-    for(; i > 0; --i)
-      {
-	full_state->cipher->extract_func(cipher_state, stream);
-	stream += chunk_size;
-      }
+    {
+      size_t i;
+      for(i = len / chunk_size; i > 0; --i)
+	{
+	  extract(cipher_state, stream);
+	  stream += chunk_size;
+	}
+      len %= chunk_size;
+    }
   else
-    for(; i > 0; --i)
+    for(; len >= buffer_size; len -= buffer_size)
       {
-	full_state->cipher->extract_func(cipher_state, cbuffer);
-	memops[op](stream, cbuffer, chunk_size);
-	stream += chunk_size;
+	buffer_fill(cipher_state, cbuffer, extract, chunk_size, buffer_size);
+	apply_op(stream, cbuffer, buffer_size, op);
+	stream += buffer_size;
       }
 
-  /* Finally, extract the next chunk to state buffer, and fill up the
-   * remaining non-multiple bytes. */
-  if(remainder)
+  /* Finally, refill the state buffer, and use it for the remaining bytes. */
+  if(len)
     {
-      full_state->cipher->extract_func(cipher_state, cbuffer);
-      memops[op](stream, cbuffer, remainder);
-      count = chunk_size - remainder;
+      buffer_fill(cipher_state, cbuffer, extract, chunk_size, buffer_size);
+      apply_op(stream, cbuffer, len, op);
+      count = buffer_size - len;
     }
 
   full_state->available_count = count;
 }
 
-void buffered_skip(buffered_state *full_state, size_t len)
+static ALWAYS_INLINE void
+skip_body(buffered_state *full_state, void *cipher_state, uint8_t *cbuffer,
+	  size_t len,
+	  extract_func_type extract, uint16_t chunk_size, uint32_t buffer_size)
 {
-  const uint8_t chunk_size = full_state->cipher->chunk_size;
-  uint8_t *cbuffer = (uint8_t*)full_state + full_state->cipher->buffer_offset;
-  void *cipher_state = buffered_get_cipher_state(full_state);
-
   if(len <= full_state->available_count)
     full_state->available_count -= len;
   else
     {
       len -= full_state->available_count;
       full_state->available_count = 0;
-      
-      int i;
-      uint8_t remainder = len % chunk_size;
+
+      size_t i;
+      uint16_t remainder = len % chunk_size;
       for(i = len / chunk_size; i > 0; --i)
-	full_state->cipher->extract_func(cipher_state, cbuffer);
+	extract(cipher_state, cbuffer);
 
       if(remainder)
 	{
-	  full_state->cipher->extract_func(cipher_state, cbuffer);
-	  full_state->available_count = chunk_size - remainder;
+	  buffer_fill(cipher_state, cbuffer, extract, chunk_size, buffer_size);
+	  full_state->available_count = buffer_size - remainder;
 	}
     }
 }
+
+#define CIPHER_SPECIFICS_DEF(name,type_id,size)				\
+  void									\
+  name##_buffered_action(name##_buffered_state *full_state,		\
+			 uint8_t *stream, size_t len, buffered_ops op)	\
+  {									\
+    action_body(&full_state->header, &full_state->state,		\
+		(uint8_t*)full_state->buffer, stream, len, op,		\
+		(extract_func_type)name##_extract,			\
+		size, BUFFERED_BUFFER_SIZE(size));			\
+  }									\
+									\
+  void									\
+  name##_buffered_skip(name##_buffered_state *full_state, size_t len)	\
+  {									\
+    skip_body(&full_state->header, &full_state->state,			\
+	      (uint8_t*)full_state->buffer, len,			\
+	      (extract_func_type)name##_extract,			\
+	      size, BUFFERED_BUFFER_SIZE(size));			\
+  }									\
+									\
+  const cipher_attributes name##_cipher = {				\
+    .type = type_id,							\
+    .extract_func = (extract_func_type)name##_extract,			\
+    .action_func = (action_func_type)name##_buffered_action,		\
+    .skip_func = (skip_func_type)name##_buffered_skip,			\
+    .buffered_state_size = sizeof(name##_buffered_state),		\
+    .buffer_offset = offsetof(name##_buffered_state, buffer),		\
+    .buffer_size = BUFFERED_BUFFER_SIZE(size),				\
+    .chunk_size = size							\
+  };									\
+  const name##_buffered_state name##_static_initializer = {		\
+      .header = { .cipher = &name##_cipher, .available_count = 0 }	\
+  };
+
+CIPHER_SPECIFICS_DEF(hc128, HC128, 4)
+CIPHER_SPECIFICS_DEF(rabbit, RABBIT, 16)
+CIPHER_SPECIFICS_DEF(salsa20, SALSA20, 64)
+CIPHER_SPECIFICS_DEF(sosemanuk, SOSEMANUK, 16)
+
+#undef CIPHER_SPECIFICS_DEF
+
+const cipher_attributes *cipher_attributes_map[LAST_CIPHER+1] = {
+    &hc128_cipher,
+    &rabbit_cipher,
+    &salsa20_cipher,
+    &sosemanuk_cipher
+};
+
+void
+buffered_action(buffered_state *full_state, uint8_t *stream, size_t len, buffered_ops op)
+{
+  full_state->cipher->action_func(full_state, stream, len, op);
+}
+
+void buffered_skip(buffered_state *full_state, size_t len)
+{
+  full_state->cipher->skip_func(full_state, len);
+}
+
+/* Batch processing. */
+
+/** How many jobs are interleaved together. */
+#define BATCH_GROUP 16
+
+/** How many bytes of each non-Salsa20 job are generated in turn. */
+#define BATCH_TURN 64
+
+static void
+batch_group(const buffered_job *jobs, size_t n)
+{
+  size_t done[BATCH_GROUP];
+  int pending;
+  size_t j;
+
+  /* First, use whatever is already buffered in each state. */
+  for(j = 0; j < n; ++j)
+    {
+      done[j] = min(jobs[j].state->available_count, jobs[j].len);
+      buffered_action(jobs[j].state, jobs[j].stream, done[j], jobs[j].op);
+    }
+
+  /* Then, Salsa20 whole chunks, in lanes of states of the same variant. */
+  do
+    {
+      salsa20_state *states[SALSA20_LANES];
+      uint8_t *outs[SALSA20_LANES];
+      uint32_t chunks[SALSA20_LANES][16];
+      size_t lane_job[SALSA20_LANES];
+      size_t count = 0;
+
+      for(j = 0; j < n && count < SALSA20_LANES; ++j)
+	{
+	  if(jobs[j].state->cipher->type != SALSA20
+	     || jobs[j].len - done[j] < 64)
+	    continue;
+
+	  salsa20_state *s = &((salsa20_buffered_state *)jobs[j].state)->state;
+	  if(count && s->variant != states[0]->variant)
+	    continue;
+
+	  lane_job[count] = j;
+	  states[count] = s;
+	  outs[count] = (uint8_t*)chunks[count];
+	  ++count;
+	}
+
+      pending = count > 0;
+      if(pending)
+	{
+	  size_t l;
+	  salsa20_extract_lanes(states, outs, count);
+	  for(l = 0; l < count; ++l)
+	    {
+	      const buffered_job *job = &jobs[lane_job[l]];
+	      apply_op(job->stream + done[lane_job[l]], outs[l], 64, job->op);
+	      done[lane_job[l]] += 64;
+	    }
+	}
+    }
+  while(pending);
+
+  /* The other ciphers have no multi-lane implementation, but alternating
+   * between independent states gives the processor independent instructions
+   * to overlap. */
+  do
+    {
+      pending = 0;
+      for(j = 0; j < n; ++j)
+	{
+	  const buffered_job *job = &jobs[j];
+	  const cipher_attributes *cipher = job->state->cipher;
+	  uint32_t chunk[BATCH_TURN / 4];
+	  size_t to_do, i;
+
+	  if(cipher->type == SALSA20)
+	    continue;
+
+	  to_do = min(job->len - done[j], BATCH_TURN);
+	  to_do -= to_do % cipher->chunk_size;
+	  if(!to_do)
+	    continue;
+
+	  for(i = 0; i < to_do; i += cipher->chunk_size)
+	    cipher->extract_func(buffered_get_cipher_state(job->state),
+				 (uint8_t*)chunk + i);
+	  apply_op(job->stream + done[j], (uint8_t*)chunk, to_do, job->op);
+	  done[j] += to_do;
+	  pending = 1;
+	}
+    }
+  while(pending);
+
+  /* Finally, whatever is smaller than a chunk goes through the buffer. */
+  for(j = 0; j < n; ++j)
+    if(done[j] < jobs[j].len)
+      buffered_action(jobs[j].state, jobs[j].stream + done[j],
+		      jobs[j].len - done[j], jobs[j].op);
+}
+
+void
+buffered_action_batch(const buffered_job *jobs, size_t n)
+{
+  size_t i;
+  for(i = 0; i < n; i += BATCH_GROUP)
+    batch_group(jobs + i, min(n - i, BATCH_GROUP));
+}
+
+uint64_t
+salsa20_buffered_tell(const salsa20_buffered_state *full_state)
+{
+  return salsa20_get_counter(&full_state->state) * 64
+    - full_state->header.available_count;
+}
+
+void
+salsa20_buffered_seek(salsa20_buffered_state *full_state, uint64_t position)
+{
+  const uint32_t offset = position % 64;
+
+  salsa20_set_counter(&full_state->state, position / 64);
+  full_state->header.available_count = 0;
+
+  if(offset)
+    {
+      buffer_fill(&full_state->state, (uint8_t*)full_state->buffer,
+		  (extract_func_type)salsa20_extract,
+		  64, BUFFERED_BUFFER_SIZE(64));
+      full_state->header.available_count = BUFFERED_BUFFER_SIZE(64) - offset;
+    }
+}
+
+/* Snapshot serialization. Everything is stored in little endian, byte by
+ * byte, so that the format is independent of the machine. */
+
+static uint8_t *
+put_u32(uint8_t *out, uint32_t value)
+{
+  out[0] = value;
+  out[1] = value >> 8;
+  out[2] = value >> 16;
+  out[3] = value >> 24;
+  return out + 4;
+}
+
+static const uint8_t *
+get_u32(const uint8_t *in, uint32_t *value)
+{
+  *value = (uint32_t)in[3] << 24
+    | (uint32_t)in[2] << 16
+    | (uint32_t)in[1] << 8
+    | (uint32_t)in[0];
+  return in + 4;
+}
+
+static uint8_t *
+put_u64(uint8_t *out, uint64_t value)
+{
+  out = put_u32(out, value);
+  return put_u32(out, value >> 32);
+}
+
+static const uint8_t *
+get_u64(const uint8_t *in, uint64_t *value)
+{
+  uint32_t low, high;
+  in = get_u32(in, &low);
+  in = get_u32(in, &high);
+  *value = (uint64_t)high << 32 | low;
+  return in;
+}
+
+static uint8_t *
+put_words(uint8_t *out, const uint32_t *words, size_t count)
+{
+  size_t i;
+  for(i = 0; i < count; ++i)
+    out = put_u32(out, words[i]);
+  return out;
+}
+
+static const uint8_t *
+get_words(const uint8_t *in, uint32_t *words, size_t count)
+{
+  size_t i;
+  for(i = 0; i < count; ++i)
+    in = get_u32(in, &words[i]);
+  return in;
+}
+
+/* Per cipher state (de)serialization, used by full snapshots of the ciphers
+ * that can not seek. Salsa20 is handled apart. */
+
+typedef uint8_t *(*state_save_func)(const void *state, uint8_t *out);
+typedef const uint8_t *(*state_load_func)(void *state, const uint8_t *in);
+
+static uint8_t *
+hc128_save(const hc128_state *state, uint8_t *out)
+{
+  out = put_words(out, state->p, 512);
+  out = put_words(out, state->q, 512);
+  out[0] = state->i;
+  out[1] = state->i >> 8;
+  return out + 2;
+}
+
+static const uint8_t *
+hc128_load(hc128_state *state, const uint8_t *in)
+{
+  in = get_words(in, state->p, 512);
+  in = get_words(in, state->q, 512);
+  state->i = ((uint16_t)in[1] << 8 | in[0]) & 1023u;
+  return in + 2;
+}
+
+static uint8_t *
+rabbit_save(const rabbit_state *state, uint8_t *out)
+{
+  out = put_words(out, state->x, 8);
+  out = put_words(out, state->c, 8);
+  *out = state->carry;
+  return out + 1;
+}
+
+static const uint8_t *
+rabbit_load(rabbit_state *state, const uint8_t *in)
+{
+  in = get_words(in, state->x, 8);
+  in = get_words(in, state->c, 8);
+  state->carry = *in & 1u;
+  return in + 1;
+}
+
+static uint8_t *
+sosemanuk_save(const sosemanuk_state *state, uint8_t *out)
+{
+  out = put_words(out, state->r, 2);
+  out = put_words(out, state->s, 10);
+  *out = state->t;
+  return out + 1;
+}
+
+static const uint8_t *
+sosemanuk_load(sosemanuk_state *state, const uint8_t *in)
+{
+  in = get_words(in, state->r, 2);
+  in = get_words(in, state->s, 10);
+  state->t = *in % 10u;
+  return in + 1;
+}
+
+static const struct
+{
+  state_save_func save;
+  state_load_func load;
+  size_t size;
+} state_serializers[LAST_CIPHER+1] = {
+  {(state_save_func)hc128_save, (state_load_func)hc128_load, 1024 * 4 + 2},
+  {(state_save_func)rabbit_save, (state_load_func)rabbit_load, 16 * 4 + 1},
+  {NULL, NULL, 0}, /* Salsa20 */
+  {(state_save_func)sosemanuk_save, (state_load_func)sosemanuk_load, 12 * 4 + 1}
+};
+
+/* Sizes of the fixed parts of the format. */
+enum {
+  SNAPSHOT_HEADER_SIZE = 3, /* Version, cipher and mode. */
+  SALSA20_FULL_SIZE = 1 + 16 * 4 /* Variant and hash input. */
+};
+
+size_t
+buffered_snapshot(const buffered_state *full_state, buffered_snapshot_mode mode,
+		  uint8_t *out, size_t out_len)
+{
+  const cipher_type type = full_state->cipher->type;
+  const void *cipher_state =
+    buffered_get_cipher_state((buffered_state *)full_state);
+  size_t size = SNAPSHOT_HEADER_SIZE;
+
+  /* Calculates the snapshot size. */
+  if(type == SALSA20)
+    {
+      if(mode == BUFFERED_SNAPSHOT_FULL)
+	size += SALSA20_FULL_SIZE;
+      size += 8; /* Stream position. */
+    }
+  else if(mode == BUFFERED_SNAPSHOT_FULL)
+    size += 4 + state_serializers[type].size + full_state->available_count;
+  else
+    /* Can not seek to position in this cipher. */
+    return 0;
+
+  if(!out)
+    return size;
+  if(out_len < size)
+    return 0;
+
+  out[0] = BUFFERED_SNAPSHOT_VERSION;
+  out[1] = type;
+  out[2] = mode;
+  out += SNAPSHOT_HEADER_SIZE;
+
+  if(type == SALSA20)
+    {
+      const salsa20_buffered_state *salsa =
+	(const salsa20_buffered_state *)full_state;
+
+      if(mode == BUFFERED_SNAPSHOT_FULL)
+	{
+	  *out++ = salsa->state.variant;
+	  out = put_words(out, salsa->state.hash_input.bit32, 16);
+	}
+      put_u64(out, salsa20_buffered_tell(salsa));
+    }
+  else
+    {
+      const uint32_t count = full_state->available_count;
+      const uint8_t *cbuffer = (const uint8_t*)full_state
+	+ full_state->cipher->buffer_offset;
+
+      out = put_u32(out, count);
+      out = state_serializers[type].save(cipher_state, out);
+      memcpy(out, cbuffer + full_state->cipher->buffer_size - count, count);
+    }
+
+  return size;
+}
+
+buffered_restore_status
+buffered_restore(buffered_state *full_state, const uint8_t *in, size_t len)
+{
+  const cipher_type type = full_state->cipher->type;
+  buffered_snapshot_mode mode;
+  size_t expected = SNAPSHOT_HEADER_SIZE;
+
+  if(len < SNAPSHOT_HEADER_SIZE || in[0] != BUFFERED_SNAPSHOT_VERSION
+     || in[2] > BUFFERED_SNAPSHOT_POSITION)
+    return BUFFERED_RESTORE_BAD_FORMAT;
+
+  if(in[1] != type)
+    return BUFFERED_RESTORE_WRONG_CIPHER;
+
+  mode = (buffered_snapshot_mode)in[2];
+  in += SNAPSHOT_HEADER_SIZE;
+
+  if(type == SALSA20)
+    {
+      salsa20_buffered_state *salsa = (salsa20_buffered_state *)full_state;
+      uint64_t position;
+
+      expected += 8;
+      if(mode == BUFFERED_SNAPSHOT_FULL)
+	expected += SALSA20_FULL_SIZE;
+      if(len != expected)
+	return BUFFERED_RESTORE_BAD_FORMAT;
+
+      if(mode == BUFFERED_SNAPSHOT_FULL)
+	{
+	  if(*in != SALSA20_8 && *in != SALSA20_12 && *in != SALSA20_20)
+	    return BUFFERED_RESTORE_BAD_FORMAT;
+
+	  salsa->state.variant = *in++;
+	  in = get_words(in, salsa->state.hash_input.bit32, 16);
+	}
+      get_u64(in, &position);
+      salsa20_buffered_seek(salsa, position);
+    }
+  else
+    {
+      uint32_t count;
+      uint8_t *cbuffer = (uint8_t*)full_state + full_state->cipher->buffer_offset;
+
+      expected += 4 + state_serializers[type].size;
+      if(mode != BUFFERED_SNAPSHOT_FULL || len < expected)
+	return BUFFERED_RESTORE_BAD_FORMAT;
+
+      in = get_u32(in, &count);
+      if(len != expected + count)
+	return BUFFERED_RESTORE_BAD_FORMAT;
+      if(count > full_state->cipher->buffer_size)
+	return BUFFERED_RESTORE_TOO_BIG;
+
+      in = state_serializers[type].load(buffered_get_cipher_state(full_state), in);
+      memcpy(cbuffer + full_state->cipher->buffer_size - count, in, count);
+      full_state->available_count = count;
+    }
+
+  return BUFFERED_RESTORE_SUCCESS;
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stddef.h>
 #include <inttypes.h>
 #include "algorithms.h"
 #include "hc-128.h"
@@ -7,20 +8,52 @@
 #include "salsa20.h"
 #include "sosemanuk.h"
 
+/** How many bytes of keystream each buffered state generates ahead.
+ *
+ * Every time the buffer of a buffered state runs out, it is refilled with
+ * this many bytes of keystream at once (rounded up to a multiple of the
+ * cipher's chunk size), so that many small operations in sequence are
+ * served from memory instead of calling the cipher each time. Bigger values
+ * use more memory per state. Can be overridden at compile time, any value
+ * from 0 (just one chunk, as small as possible) to some KB is reasonable.
+ */
+#ifndef BUFFERED_LOOKAHEAD
+#define BUFFERED_LOOKAHEAD 256
+#endif
+
+/** Size of the keystream buffer of a cipher whose chunk is chunk_size bytes. */
+#define BUFFERED_BUFFER_SIZE(chunk_size)				\
+  ((BUFFERED_LOOKAHEAD > (chunk_size))					\
+   ? ((BUFFERED_LOOKAHEAD + (chunk_size) - 1) / (chunk_size)) * (chunk_size) \
+   : (chunk_size))
+
+typedef enum
+{
+  BUFFERED_EXTRACT,
+  BUFFERED_ENCDEC
+} buffered_ops;
+
 typedef void (*extract_func_type)(void *state, uint8_t *stream);
+typedef void (*action_func_type)(void *full_state, uint8_t *stream,
+				 size_t len, buffered_ops op);
+typedef void (*skip_func_type)(void *full_state, size_t len);
 
 typedef struct
 {
+  cipher_type type;
   extract_func_type extract_func;
-  uint16_t buffered_state_size;
-  uint16_t buffer_offset;
-  uint8_t chunk_size;
+  action_func_type action_func;
+  skip_func_type skip_func;
+  uint32_t buffered_state_size;
+  uint32_t buffer_offset;
+  uint32_t buffer_size;
+  uint16_t chunk_size;
 } cipher_attributes;
 
 typedef struct
 {
   const cipher_attributes *cipher;
-  uint8_t available_count;
+  uint32_t available_count;
 } buffered_state;
 
 #define CIPHER_SPECIFICS_DECL(name,size)			\
@@ -28,10 +61,15 @@ typedef struct
     buffered_state header;					\
     name##_state state;						\
     /* Using uint32_t to ensure alignment: */			\
-    uint32_t buffer[(size)/4];					\
+    uint32_t buffer[BUFFERED_BUFFER_SIZE(size)/4];		\
   } name##_buffered_state;					\
   extern const cipher_attributes name##_cipher;			\
-  extern const name##_buffered_state name##_static_initializer;
+  extern const name##_buffered_state name##_static_initializer;	\
+									\
+  void name##_buffered_action(name##_buffered_state *full_state,	\
+			      uint8_t *stream, size_t len,		\
+			      buffered_ops op);				\
+  void name##_buffered_skip(name##_buffered_state *full_state, size_t len);
 
 CIPHER_SPECIFICS_DECL(hc128, 4)
 CIPHER_SPECIFICS_DECL(rabbit, 16)
@@ -40,12 +78,6 @@ CIPHER_SPECIFICS_DECL(sosemanuk, 16)
 
 #undef CIPHER_SPECIFICS_DECL
 
-typedef enum
-{
-  BUFFERED_EXTRACT,
-  BUFFERED_ENCDEC
-} buffered_ops;
-
 extern const cipher_attributes *cipher_attributes_map[LAST_CIPHER+1];
 
 /** Gets the address of the cipher state contained in the buffered state.
@@ -94,6 +126,10 @@ void buffered_reset(buffered_state *state_header);
  * This function allows encryption or decryption of buffers of any size, independent of the
  * chunk size of the specific algorithm being used.
  *
+ * It dispatches to the cipher specific <cipher>_buffered_action(), which takes the
+ * <cipher>_buffered_state directly and has the chunk size and extraction function
+ * fixed at compile time. If the cipher is known in advance, prefer calling it instead.
+ *
  * @param full_state A properly initialized and valid buffered encryption state. One of the
  * <cipher>_buffered_state types. The full state (i.e. both the header and the cipher itself)
  * must be properly initialized before usage.
@@ -110,9 +146,118 @@ void buffered_action(buffered_state *full_state, uint8_t *stream, size_t len, bu
 /** Discard an amount of bytes from the stream cipher output.
  *
  * This function is equivalent to calling buffered_action() with op BUFFERED_EXTRACT,
- * and discarding the output stream.
+ * and discarding the output stream. Dispatches to <cipher>_buffered_skip().
  *
  * @param full_state The properly initialized and valid buffered encryption state.
  * @param len How many bytes to skip from the current state of the buffered cipher.
  */
 void buffered_skip(buffered_state *full_state, size_t len);
+
+/** One operation of a batch, see buffered_action_batch(). */
+typedef struct
+{
+  buffered_state *state;
+  uint8_t *stream;
+  size_t len;
+  buffered_ops op;
+} buffered_job;
+
+/** Performs many buffered operations on independent states at once.
+ *
+ * The result is exactly the same as calling buffered_action() for each job
+ * in sequence, but the cipher work of different states is interleaved: Salsa20
+ * states of the same variant are processed in parallel lanes, and the other
+ * ciphers alternate between states, so that the processor has independent
+ * instructions to execute. Useful to process many small messages of different
+ * sessions at once.
+ *
+ * Notice: every job must have a different state.
+ *
+ * @param jobs The operations to perform.
+ * @param n How many jobs there are.
+ */
+void buffered_action_batch(const buffered_job *jobs, size_t n);
+
+/** Gets the position of a Salsa20 buffered state in the stream.
+ *
+ * @returns How many bytes of the stream were used since it started.
+ */
+uint64_t salsa20_buffered_tell(const salsa20_buffered_state *full_state);
+
+/** Moves a Salsa20 buffered state to any position in the stream.
+ *
+ * Salsa20 can generate any part of its stream in constant time, so,
+ * different from buffered_skip(), this takes the same time no matter how far
+ * the position is. The position may also be behind the current one.
+ *
+ * @param full_state The properly initialized and valid buffered state.
+ * @param position The byte offset in the stream from where the next
+ * operation will start.
+ */
+void salsa20_buffered_seek(salsa20_buffered_state *full_state, uint64_t position);
+
+/** Version of the format written by buffered_snapshot(). */
+#define BUFFERED_SNAPSHOT_VERSION 1
+
+typedef enum
+{
+  /** Everything needed to continue the stream, given a buffered state
+   * initialized for the same cipher. */
+  BUFFERED_SNAPSHOT_FULL,
+  /** Just the position in the stream. Only for seekable ciphers (Salsa20),
+   * given a state initialized with the same key and IV. */
+  BUFFERED_SNAPSHOT_POSITION
+} buffered_snapshot_mode;
+
+typedef enum
+{
+  BUFFERED_RESTORE_SUCCESS,
+  /** Snapshot is truncated, corrupted or from an unknown version. */
+  BUFFERED_RESTORE_BAD_FORMAT,
+  /** Snapshot was taken from a state using another cipher. */
+  BUFFERED_RESTORE_WRONG_CIPHER,
+  /** Snapshot has more buffered bytes than this state can hold (it was
+   * built with bigger BUFFERED_LOOKAHEAD). */
+  BUFFERED_RESTORE_TOO_BIG
+} buffered_restore_status;
+
+/** Serializes a buffered state, so that the stream can be continued elsewhere.
+ *
+ * The output is a stable byte sequence, independent of the machine and of the
+ * build options, that can be stored or sent to another process and given to
+ * buffered_restore(). It has a version byte, the cipher, the mode, and then
+ * the cipher specific data. For Salsa20, only the stream position (and, in
+ * full mode, the hash input) is stored, and the buffered bytes are generated
+ * again on restore; for the other ciphers, the full cipher state and the
+ * unused buffered bytes are stored.
+ *
+ * Notice: the snapshot contains the cipher state, that is as secret as the
+ * key. Also, continuing the same stream from more than one place amounts to
+ * reusing an IV.
+ *
+ * @param full_state The properly initialized and valid buffered state.
+ * @param mode Either BUFFERED_SNAPSHOT_FULL or BUFFERED_SNAPSHOT_POSITION.
+ * @param out Where to write the snapshot. If NULL, nothing is written, and
+ * the needed size is returned.
+ * @param out_len Size of the out buffer.
+ * @returns The snapshot size, or 0 if out_len is too small or the mode is not
+ * supported by the cipher.
+ */
+size_t buffered_snapshot(const buffered_state *full_state, buffered_snapshot_mode mode,
+			 uint8_t *out, size_t out_len);
+
+/** Restores a buffered state from a snapshot made by buffered_snapshot().
+ *
+ * The header must have already been initialized for the same cipher (see
+ * buffered_init_header()). If the snapshot is in BUFFERED_SNAPSHOT_POSITION
+ * mode, the cipher state must also have been initialized with the same key
+ * and IV, and only the position is restored.
+ *
+ * @param full_state The buffered state to be restored.
+ * @param in The snapshot.
+ * @param len The exact size of the snapshot.
+ * @returns BUFFERED_RESTORE_SUCCESS, or the reason the snapshot could not be
+ * used, in which case the state is left unchanged.
+ */
+buffered_restore_status buffered_restore(buffered_state *full_state,
+					 const uint8_t *in, size_t len);
@@ -0,0 +1,131 @@
+#include <string.h>
+#include "util.h"
+
+#include "kdf.h"
+
+#define BLOCK_SIZE 16
+
+static const uint8_t label[8] = {'e', 's', 't', 'r', '-', 'k', 'd', 'f'};
+
+/** How many cores a context needs: the length block, then the context. */
+static size_t
+block_count(size_t ctx_len)
+{
+  return 1 + (ctx_len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/** Gets the input of a core. */
+static void
+get_block(const uint8_t *context, size_t ctx_len, size_t index, uint8_t *block)
+{
+  if(!index)
+    {
+      unpack_littleendian(ctx_len, block);
+      unpack_littleendian((uint64_t)ctx_len >> 32, block + 4);
+      memcpy(block + 8, label, sizeof label);
+    }
+  else
+    {
+      const size_t offset = (index - 1) * BLOCK_SIZE;
+      const size_t len = min(ctx_len - offset, BLOCK_SIZE);
+
+      memcpy(block, context + offset, len);
+      memset(block + len, 0, BLOCK_SIZE - len);
+    }
+}
+
+/** Sets the key for the next core from the output of the previous. */
+static void
+next_key(salsa20_master_state *key, salsa20_variant variant, const uint8_t *out)
+{
+  /* Copy, for alignment. */
+  uint32_t aligned[ESTREAM_KDF_KEY_SIZE / 4];
+
+  memcpy(aligned, out, ESTREAM_KDF_KEY_SIZE);
+  salsa20_init_key(key, variant, (uint8_t *)aligned, SALSA20_256_BITS);
+}
+
+void
+estream_kdf(const salsa20_master_state *root, const uint8_t *context,
+	    size_t ctx_len, uint8_t *out_key)
+{
+  const salsa20_variant variant = root->incomplete_state.variant;
+  const size_t blocks = block_count(ctx_len);
+  salsa20_master_state key = *root;
+  uint8_t block[BLOCK_SIZE];
+  uint8_t out[ESTREAM_KDF_KEY_SIZE];
+  size_t i;
+
+  for(i = 0; i < blocks; ++i)
+    {
+      get_block(context, ctx_len, i, block);
+      salsa20_hsalsa(&key, block, i + 1 < blocks ? out : out_key);
+      if(i + 1 < blocks)
+	next_key(&key, variant, out);
+    }
+
+  memset(&key, 0, sizeof key);
+  memset(out, 0, sizeof out);
+}
+
+void
+estream_kdf_batch(const salsa20_master_state *root,
+		  const estream_kdf_request *requests, size_t count)
+{
+  const salsa20_variant variant = root->incomplete_state.variant;
+  const estream_kdf_request *lane_req[SALSA20_LANES] = {NULL};
+  size_t lane_block[SALSA20_LANES];
+  salsa20_master_state keys[SALSA20_LANES];
+  uint8_t blocks[SALSA20_LANES][BLOCK_SIZE];
+  uint8_t outs[SALSA20_LANES][ESTREAM_KDF_KEY_SIZE];
+  size_t next = 0, l;
+
+  /* Every lane that finishes a derivation takes the next request, so the
+   * lanes are kept busy even when the contexts have different lengths. */
+  for(;;)
+    {
+      const salsa20_master_state *masters[SALSA20_LANES];
+      const uint8_t *inputs[SALSA20_LANES];
+      uint8_t *lane_outs[SALSA20_LANES];
+      size_t active[SALSA20_LANES];
+      size_t n = 0;
+
+      for(l = 0; l < SALSA20_LANES; ++l)
+	{
+	  if(!lane_req[l] && next < count)
+	    {
+	      lane_req[l] = &requests[next++];
+	      lane_block[l] = 0;
+	      keys[l] = *root;
+	    }
+	  if(!lane_req[l])
+	    continue;
+
+	  get_block(lane_req[l]->context, lane_req[l]->ctx_len, lane_block[l], blocks[l]);
+	  masters[n] = &keys[l];
+	  inputs[n] = blocks[l];
+	  lane_outs[n] = outs[l];
+	  active[n++] = l;
+	}
+
+      if(!n)
+	break;
+
+      salsa20_hsalsa_lanes(masters, inputs, lane_outs, n);
+
+      while(n--)
+	{
+	  l = active[n];
+	  if(++lane_block[l] == block_count(lane_req[l]->ctx_len))
+	    {
+	      memcpy(lane_req[l]->out_key, outs[l], ESTREAM_KDF_KEY_SIZE);
+	      lane_req[l] = NULL;
+	    }
+	  else
+	    next_key(&keys[l], variant, outs[l]);
+	}
+    }
+
+  memset(keys, 0, sizeof keys);
+  memset(outs, 0, sizeof outs);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <inttypes.h>
+#include "salsa20.h"
+
+/* Key derivation function built on HSalsa20.
+ *
+ * Derives subkeys from a root key and a context, like a tenant or session
+ * identifier, of any length. It is a cascade of HSalsa20: starting with the
+ * root key, each 16 bytes block of input is hashed with the current key, and
+ * the 32 bytes output is the key for the next block. The first block holds
+ * the length of the context, as a 64 bits little endian number, followed by
+ * the 8 bytes "estr-kdf"; the following ones hold the context, the last one
+ * zero padded. Since the length comes first, no input is a prefix of
+ * another, as a cascade requires. The output of the last block is the
+ * subkey.
+ *
+ * The rounds are those of the root master state, so with SALSA20_20 the
+ * core is the standard HSalsa20. A context of up to 16 bytes costs two
+ * cores, which takes about as long as generating 128 bytes of keystream. */
+
+/** Size of a derived key, in bytes. */
+#define ESTREAM_KDF_KEY_SIZE 32
+
+/** Derives a subkey.
+ *
+ * @param root The root key, as a Salsa20 master state of any variant.
+ * @param context The context; needs no alignment.
+ * @param ctx_len The length of the context, in bytes.
+ * @param out_key Where to store the ESTREAM_KDF_KEY_SIZE bytes of subkey.
+ */
+void estream_kdf(const salsa20_master_state *root, const uint8_t *context,
+		 size_t ctx_len, uint8_t *out_key);
+
+/** One subkey to be derived by estream_kdf_batch(). */
+typedef struct
+{
+  const uint8_t *context;
+  size_t ctx_len;
+  uint8_t *out_key;
+} estream_kdf_request;
+
+/** Derives many subkeys from the same root key.
+ *
+ * Has the same result as calling estream_kdf() for each request, but
+ * SALSA20_LANES derivations are computed at once, in parallel lanes. The
+ * contexts may have different lengths.
+ */
+void estream_kdf_batch(const salsa20_master_state *root,
+		       const estream_kdf_request *requests, size_t count);
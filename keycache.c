@@ -0,0 +1,401 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "salsa20.h"
+#include "sosemanuk.h"
+#include "rabbit.h"
+#include "umac.h"
+
+#include "keycache.h"
+
+/** Alignment of the states, enough for any SIMD load. */
+#define STATE_ALIGNMENT 64
+
+typedef struct keycache_entry
+{
+  struct keycache_entry *bucket_next;
+  struct keycache_entry *lru_prev;
+  struct keycache_entry *lru_next;
+  uint64_t hash;
+  /** Acquired and not yet released. */
+  size_t refs;
+  /** Whether still in the cache, or already evicted but referenced. */
+  int cached;
+  keycache_kind kind;
+  uint8_t key_len;
+  uint8_t key[KEYCACHE_MAX_KEY_SIZE];
+} keycache_entry;
+
+/** Offset of the state in the entry allocation. */
+#define STATE_OFFSET \
+  ((sizeof(keycache_entry) + STATE_ALIGNMENT - 1) & ~(size_t)(STATE_ALIGNMENT - 1))
+
+static void *
+entry_state(keycache_entry *entry)
+{
+  return (uint8_t *)entry + STATE_OFFSET;
+}
+
+static keycache_entry *
+state_entry(const void *state)
+{
+  return (keycache_entry *)((uint8_t *)state - STATE_OFFSET);
+}
+
+static size_t
+state_size(keycache_kind kind)
+{
+  switch(kind)
+    {
+    case KEYCACHE_SOSEMANUK:
+      return sizeof(sosemanuk_master_state);
+    case KEYCACHE_RABBIT:
+      return sizeof(rabbit_state);
+    case KEYCACHE_UHASH_32:
+      return sizeof(uhash_32_key);
+    case KEYCACHE_UHASH_64:
+      return sizeof(uhash_64_key);
+    case KEYCACHE_UHASH_96:
+      return sizeof(uhash_96_key);
+    default:
+      return sizeof(uhash_128_key);
+    }
+}
+
+static int
+valid_key_len(keycache_kind kind, size_t key_len)
+{
+  switch(kind)
+    {
+    case KEYCACHE_SOSEMANUK:
+      return key_len <= 32;
+    case KEYCACHE_RABBIT:
+      return key_len == 16;
+    default:
+      return key_len == 32;
+    }
+}
+
+/** The expensive part, done without holding any lock. */
+static void
+expand_key(keycache_kind kind, const uint8_t *key, size_t key_len, void *state)
+{
+  /* Copy, for alignment. */
+  uint32_t aligned[KEYCACHE_MAX_KEY_SIZE / 4];
+
+  memcpy(aligned, key, key_len);
+
+  switch(kind)
+    {
+    case KEYCACHE_SOSEMANUK:
+      sosemanuk_init_key(state, (uint8_t *)aligned, key_len * 8);
+      break;
+    case KEYCACHE_RABBIT:
+      rabbit_init_key(state, (uint8_t *)aligned);
+      break;
+    default:
+      {
+	salsa20_buffered_state kdf = salsa20_static_initializer;
+	salsa20_master_state master;
+	const uint32_t iv[2] = {0, 0};
+
+	salsa20_init_key(&master, SALSA20_12, (uint8_t *)aligned, SALSA20_256_BITS);
+	salsa20_init_iv(&kdf.state, &master, (const uint8_t *)iv);
+	uhash_key_setup(kind - KEYCACHE_UHASH_32, state, &kdf.header);
+      }
+    }
+}
+
+static uint64_t
+key_hash(const keycache *cache, keycache_kind kind, const uint8_t *key, size_t key_len)
+{
+  uint8_t input[1 + KEYCACHE_MAX_KEY_SIZE];
+  uint8_t tag[SIPHASH_TAG_SIZE];
+  uint64_t hash = 0;
+  int i;
+
+  input[0] = kind;
+  memcpy(input + 1, key, key_len);
+  siphash(&cache->digest_key, input, 1 + key_len, tag);
+
+  for(i = 0; i < SIPHASH_TAG_SIZE; ++i)
+    hash |= (uint64_t)tag[i] << (i * 8);
+  return hash;
+}
+
+/* The low bits of the hash pick the shard, the high ones the bucket. */
+
+static keycache_shard *
+hash_shard(const keycache *cache, uint64_t hash)
+{
+  return &cache->shards[hash & cache->shard_mask];
+}
+
+static keycache_entry **
+hash_bucket(const keycache_shard *shard, uint64_t hash)
+{
+  return &shard->buckets[(hash >> 32) & shard->bucket_mask];
+}
+
+/* All the following functions must be called with the shard locked. */
+
+static void
+lru_unlink(keycache_shard *shard, keycache_entry *entry)
+{
+  if(entry->lru_prev)
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    shard->lru_head = entry->lru_next;
+
+  if(entry->lru_next)
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    shard->lru_tail = entry->lru_prev;
+}
+
+static void
+lru_push_front(keycache_shard *shard, keycache_entry *entry)
+{
+  entry->lru_prev = NULL;
+  entry->lru_next = shard->lru_head;
+  if(shard->lru_head)
+    shard->lru_head->lru_prev = entry;
+  else
+    shard->lru_tail = entry;
+  shard->lru_head = entry;
+}
+
+static keycache_entry *
+lookup(keycache_shard *shard, uint64_t hash, keycache_kind kind,
+       const uint8_t *key, size_t key_len)
+{
+  keycache_entry *entry;
+
+  for(entry = *hash_bucket(shard, hash); entry; entry = entry->bucket_next)
+    if(entry->hash == hash && entry->kind == kind && entry->key_len == key_len
+       && !memcmp(entry->key, key, key_len))
+      return entry;
+
+  return NULL;
+}
+
+static void
+remove_entry(keycache_shard *shard, keycache_entry *entry)
+{
+  keycache_entry **link = hash_bucket(shard, entry->hash);
+
+  while(*link != entry)
+    link = &(*link)->bucket_next;
+  *link = entry->bucket_next;
+
+  lru_unlink(shard, entry);
+  entry->cached = 0;
+  --shard->size;
+}
+
+static void
+free_entry(keycache_entry *entry)
+{
+  memset(entry, 0, STATE_OFFSET + state_size(entry->kind));
+  free(entry);
+}
+
+/** Evicts the least recently used entries until there is room for one more.
+ * Entries still referenced are freed when released. */
+static void
+make_room(keycache_shard *shard)
+{
+  while(shard->size >= shard->capacity)
+    {
+      keycache_entry *victim = shard->lru_tail;
+
+      remove_entry(shard, victim);
+      ++shard->stats.evictions;
+      if(!victim->refs)
+	free_entry(victim);
+    }
+}
+
+int
+keycache_init(keycache *cache, size_t capacity, size_t shards)
+{
+  uint8_t digest_key[SIPHASH_KEY_SIZE];
+  size_t i, per_shard, buckets;
+  ssize_t got = -1;
+  int fd;
+
+  assert(shards && !(shards & (shards - 1)) && "Shard count must be a power of 2");
+
+  /* The hash key only needs to be unpredictable, so that clients can not
+   * choose keys that all fall in the same bucket. */
+  fd = open("/dev/urandom", O_RDONLY);
+  if(fd >= 0)
+    {
+      got = read(fd, digest_key, sizeof digest_key);
+      close(fd);
+    }
+  if(got != sizeof digest_key)
+    return EIO;
+  siphash_key_init(&cache->digest_key, SIPHASH_2_4, digest_key);
+
+  per_shard = (capacity + shards - 1) / shards;
+  if(!per_shard)
+    per_shard = 1;
+  for(buckets = 1; buckets < per_shard * 2; buckets *= 2);
+
+  cache->shards = calloc(shards, sizeof(keycache_shard));
+  if(!cache->shards)
+    return ENOMEM;
+  cache->shard_mask = shards - 1;
+
+  for(i = 0; i < shards; ++i)
+    {
+      keycache_shard *shard = &cache->shards[i];
+
+      shard->buckets = calloc(buckets, sizeof(keycache_entry *));
+      if(!shard->buckets)
+	{
+	  while(i--)
+	    {
+	      pthread_mutex_destroy(&cache->shards[i].lock);
+	      free(cache->shards[i].buckets);
+	    }
+	  free(cache->shards);
+	  return ENOMEM;
+	}
+      shard->bucket_mask = buckets - 1;
+      shard->capacity = per_shard;
+      pthread_mutex_init(&shard->lock, NULL);
+    }
+
+  return 0;
+}
+
+void
+keycache_destroy(keycache *cache)
+{
+  size_t i;
+
+  for(i = 0; i <= cache->shard_mask; ++i)
+    {
+      keycache_shard *shard = &cache->shards[i];
+
+      while(shard->lru_head)
+	{
+	  keycache_entry *entry = shard->lru_head;
+
+	  assert(!entry->refs && "State acquired and not released");
+	  remove_entry(shard, entry);
+	  free_entry(entry);
+	}
+
+      pthread_mutex_destroy(&shard->lock);
+      free(shard->buckets);
+    }
+
+  free(cache->shards);
+  cache->shards = NULL;
+}
+
+const void *
+keycache_acquire(keycache *cache, keycache_kind kind,
+		 const uint8_t *key, size_t key_len)
+{
+  uint64_t hash;
+  keycache_shard *shard;
+  keycache_entry *entry, *found;
+
+  /* Checked before hashing, that copies the key in a buffer of 32 bytes. */
+  if(kind >= KEYCACHE_KIND_COUNT || !valid_key_len(kind, key_len))
+    return NULL;
+
+  hash = key_hash(cache, kind, key, key_len);
+  shard = hash_shard(cache, hash);
+
+  pthread_mutex_lock(&shard->lock);
+  entry = lookup(shard, hash, kind, key, key_len);
+  if(entry)
+    {
+      ++shard->stats.hits;
+      ++entry->refs;
+      lru_unlink(shard, entry);
+      lru_push_front(shard, entry);
+      pthread_mutex_unlock(&shard->lock);
+      return entry_state(entry);
+    }
+  ++shard->stats.misses;
+  pthread_mutex_unlock(&shard->lock);
+
+  /* Expand the key without the lock, so the shard is not blocked meanwhile. */
+  if(posix_memalign((void **)&entry, STATE_ALIGNMENT, STATE_OFFSET + state_size(kind)))
+    return NULL;
+  entry->hash = hash;
+  entry->refs = 1;
+  entry->cached = 1;
+  entry->kind = kind;
+  entry->key_len = key_len;
+  memcpy(entry->key, key, key_len);
+  expand_key(kind, key, key_len, entry_state(entry));
+
+  pthread_mutex_lock(&shard->lock);
+
+  /* Another thread may have inserted the same key meanwhile. */
+  found = lookup(shard, hash, kind, key, key_len);
+  if(found)
+    {
+      ++found->refs;
+      lru_unlink(shard, found);
+      lru_push_front(shard, found);
+      pthread_mutex_unlock(&shard->lock);
+      free_entry(entry);
+      return entry_state(found);
+    }
+
+  make_room(shard);
+  entry->bucket_next = *hash_bucket(shard, hash);
+  *hash_bucket(shard, hash) = entry;
+  lru_push_front(shard, entry);
+  ++shard->size;
+
+  pthread_mutex_unlock(&shard->lock);
+
+  return entry_state(entry);
+}
+
+void
+keycache_release(keycache *cache, const void *state)
+{
+  keycache_entry *entry = state_entry(state);
+  keycache_shard *shard = hash_shard(cache, entry->hash);
+  int evicted;
+
+  pthread_mutex_lock(&shard->lock);
+  assert(entry->refs);
+  evicted = !--entry->refs && !entry->cached;
+  pthread_mutex_unlock(&shard->lock);
+
+  if(evicted)
+    free_entry(entry);
+}
+
+void
+keycache_get_stats(keycache *cache, keycache_stats *stats)
+{
+  size_t i;
+
+  memset(stats, 0, sizeof *stats);
+  for(i = 0; i <= cache->shard_mask; ++i)
+    {
+      keycache_shard *shard = &cache->shards[i];
+
+      pthread_mutex_lock(&shard->lock);
+      stats->hits += shard->stats.hits;
+      stats->misses += shard->stats.misses;
+      stats->evictions += shard->stats.evictions;
+      stats->size += shard->size;
+      pthread_mutex_unlock(&shard->lock);
+    }
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <stddef.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "siphash.h"
+
+/* Cache of expanded keys, for servers where many connections share a few
+ * keys.
+ *
+ * Instead of expanding the key of each connection, acquire the master state
+ * from the cache, initialize the IV state from it, and release it. The key is
+ * expanded only the first time it is seen, or after being evicted. The
+ * states are never modified once in the cache, so any number of threads may
+ * read the same state at once, like in sosemanuk_init_iv().
+ *
+ * The cache is split in shards, each with its own lock, least recently used
+ * list and hash table, so threads using different keys seldom contend. Keys
+ * are hashed with SipHash, under a random key, to pick the shard and bucket;
+ * the whole key is compared on lookup.
+ *
+ * Salsa20 is not cached: its key setup only copies the key, which is faster
+ * than a lookup. */
+
+typedef enum
+{
+  /** sosemanuk_master_state, from 0 to 32 bytes of key. */
+  KEYCACHE_SOSEMANUK,
+  /** rabbit_state, from 16 bytes of key. */
+  KEYCACHE_RABBIT,
+  /** uhash_<bits>_key, from 32 bytes of key, expanded from the Salsa20/12
+   * keystream of the key with a zero IV, like the keys of keystore_build. */
+  KEYCACHE_UHASH_32,
+  KEYCACHE_UHASH_64,
+  KEYCACHE_UHASH_96,
+  KEYCACHE_UHASH_128,
+  KEYCACHE_KIND_COUNT
+} keycache_kind;
+
+/** Maximum size of a key in the cache, in bytes. */
+#define KEYCACHE_MAX_KEY_SIZE 32
+
+typedef struct
+{
+  uint64_t hits;
+  uint64_t misses;
+  /** Entries dropped to make room for others. */
+  uint64_t evictions;
+  /** Entries in the cache now. */
+  size_t size;
+} keycache_stats;
+
+struct keycache_entry;
+
+/** A shard of the cache. All fields are internal. */
+typedef struct
+{
+  pthread_mutex_t lock;
+  struct keycache_entry **buckets;
+  size_t bucket_mask;
+  /** Most recently used first. */
+  struct keycache_entry *lru_head;
+  struct keycache_entry *lru_tail;
+  size_t size;
+  size_t capacity;
+  keycache_stats stats;
+} keycache_shard;
+
+/** The cache. All fields are internal. */
+typedef struct
+{
+  keycache_shard *shards;
+  size_t shard_mask;
+  siphash_key digest_key;
+} keycache;
+
+/** Initializes a cache.
+ *
+ * @param cache The uninitialized cache.
+ * @param capacity How many expanded keys it holds, at most. It is split among
+ * the shards.
+ * @param shards Number of shards, a power of 2; about the number of threads
+ * using the cache is good.
+ * @returns 0 on success, or an errno value.
+ */
+int keycache_init(keycache *cache, size_t capacity, size_t shards);
+
+/** Releases all memory of the cache.
+ *
+ * All the states acquired must have been released.
+ */
+void keycache_destroy(keycache *cache);
+
+/** Gets the expanded key, from the cache or by expanding it.
+ *
+ * The state remains valid, even if evicted from the cache, until released
+ * with keycache_release().
+ *
+ * @param kind The type of the state, see keycache_kind.
+ * @param key The raw key; needs no alignment.
+ * @param key_len Length of key: 16 for Rabbit, up to 32 for Sosemanuk, and 32
+ * for the UHASH kinds.
+ * @returns The state, that must not be modified, or NULL if out of memory, kind
+ * is not a keycache_kind or key_len is not valid for kind.
+ */
+const void *keycache_acquire(keycache *cache, keycache_kind kind,
+			     const uint8_t *key, size_t key_len);
+
+/** Releases a state returned by keycache_acquire(). */
+void keycache_release(keycache *cache, const void *state);
+
+/** Sums the statistics of all the shards. */
+void keycache_get_stats(keycache *cache, keycache_stats *stats);
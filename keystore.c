@@ -0,0 +1,499 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "aead.h"
+#include "util.h"
+
+#include "keystore.h"
+
+#define KEYSTORE_FLAG_SEALED 1u
+
+/** Alignment of each key inside the file, enough for any SIMD load. */
+#define KEY_ALIGNMENT 64
+
+/** Alignment of the data region, so that it starts at a page of the mapping. */
+#define DATA_ALIGNMENT 4096
+
+/** Size of the tag appended to a sealed store, from the 128 bits AEAD. */
+#define SEAL_TAG_SIZE 16
+
+static const char magic[4] = {'e', 'S', 'K', 'S'};
+
+/** The header is the first thing in the file. The header and the table, up to
+ * data_offset, are the associated data of the seal, so everything here is
+ * authenticated in a sealed store. */
+typedef struct
+{
+  char magic[4];
+  uint32_t version;
+  /** KEYSTORE_BYTE_ORDER, as written by the native byte order. */
+  uint32_t byte_order;
+  uint32_t flags;
+  uint32_t count;
+  /** sizeof of each kind of key, to detect a different layout. */
+  uint32_t key_sizes[KEYSTORE_KIND_COUNT];
+  /** CRC-32 of the table. */
+  uint32_t table_crc;
+  uint64_t data_offset;
+  uint64_t data_size;
+  uint8_t nonce[KEYSTORE_NONCE_SIZE];
+} file_header;
+
+#define KEYSTORE_BYTE_ORDER 0x01020304u
+
+typedef struct
+{
+  uint32_t id;
+  uint32_t kind;
+  uint64_t offset;
+  uint32_t size;
+  /** CRC-32 of the plain key, with the attribs pointer of UHASH keys zeroed. */
+  uint32_t crc;
+} file_entry;
+
+static size_t
+key_size(keystore_kind kind)
+{
+  switch(kind)
+    {
+    case KEYSTORE_SOSEMANUK_MASTER:
+      return sizeof(sosemanuk_master_state);
+    case KEYSTORE_SALSA20_MASTER:
+      return sizeof(salsa20_master_state);
+    case KEYSTORE_UHASH_32:
+      return sizeof(uhash_32_key);
+    case KEYSTORE_UHASH_64:
+      return sizeof(uhash_64_key);
+    case KEYSTORE_UHASH_96:
+      return sizeof(uhash_96_key);
+    case KEYSTORE_UHASH_128:
+      return sizeof(uhash_128_key);
+    default:
+      return 0;
+    }
+}
+
+static int
+is_uhash(uint32_t kind)
+{
+  return kind >= KEYSTORE_UHASH_32 && kind <= KEYSTORE_UHASH_128;
+}
+
+static size_t
+align_up(size_t value, size_t alignment)
+{
+  return (value + alignment - 1) & ~(alignment - 1);
+}
+
+/* CRC-32, as in zlib, with tables computed on first use. Eight bytes are
+ * processed at once, each through its own table ("slicing-by-8"). */
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void
+crc_table_init(void)
+{
+  uint32_t i, j, c;
+
+  for(i = 0; i < 256; ++i)
+    {
+      c = i;
+      for(j = 0; j < 8; ++j)
+	c = (c >> 1) ^ (0xedb88320u & -(c & 1));
+      crc_table[0][i] = c;
+    }
+
+  for(i = 0; i < 256; ++i)
+    for(j = 1; j < 8; ++j)
+      crc_table[j][i] = (crc_table[j - 1][i] >> 8)
+	^ crc_table[0][crc_table[j - 1][i] & 0xff];
+}
+
+/** Continues the CRC of the data before, given as the crc. */
+static uint32_t
+crc32_continue(uint32_t crc, const uint8_t *data, size_t len)
+{
+  uint32_t c = ~crc;
+
+  pthread_once(&crc_table_once, crc_table_init);
+
+  for(; len >= 8; len -= 8, data += 8)
+    {
+      const uint32_t lo = c ^ pack_littleendian(data);
+      const uint32_t hi = pack_littleendian(data + 4);
+
+      c = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff]
+	^ crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24]
+	^ crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff]
+	^ crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+    }
+
+  while(len--)
+    c = crc_table[0][(c ^ *data++) & 0xff] ^ (c >> 8);
+
+  return ~c;
+}
+
+static uint32_t
+crc32(const uint8_t *data, size_t len)
+{
+  return crc32_continue(0, data, len);
+}
+
+/* Sealing, with the key and AD as in the header comment. */
+
+static void
+seal_init(estream_aead_128_ctx *ctx, const uint8_t *seal_key)
+{
+  estream_aead_init(&ctx->header, UHASH_128, seal_key);
+}
+
+static int
+compare_items(const void *a, const void *b)
+{
+  const keystore_item *x = *(const keystore_item *const *)a;
+  const keystore_item *y = *(const keystore_item *const *)b;
+
+  if(x->id != y->id)
+    return x->id < y->id ? -1 : 1;
+  if(x->kind != y->kind)
+    return x->kind < y->kind ? -1 : 1;
+  return 0;
+}
+
+static int
+write_all(int fd, const uint8_t *buf, size_t len)
+{
+  while(len)
+    {
+      ssize_t ret = write(fd, buf, len);
+      if(ret < 0)
+	{
+	  if(errno == EINTR)
+	    continue;
+	  return errno;
+	}
+      buf += ret;
+      len -= ret;
+    }
+  return 0;
+}
+
+int
+keystore_write(const char *path, const keystore_item *items, size_t count,
+	       const uint8_t *seal_key, const uint8_t *nonce)
+{
+  const keystore_item **sorted;
+  file_header *header;
+  file_entry *table;
+  uint8_t *file;
+  size_t i, data_offset, offset, file_size;
+  char *tmp_path;
+  int fd, ret;
+
+  if(count > UINT32_MAX)
+    return EINVAL;
+
+  /* Sort the items, to be found with a binary search, and check them. */
+  sorted = malloc((count + 1) * sizeof *sorted);
+  if(!sorted)
+    return ENOMEM;
+  for(i = 0; i < count; ++i)
+    sorted[i] = &items[i];
+  qsort(sorted, count, sizeof *sorted, compare_items);
+
+  data_offset = align_up(sizeof(file_header) + count * sizeof(file_entry),
+			 DATA_ALIGNMENT);
+  offset = data_offset;
+  for(i = 0; i < count; ++i)
+    {
+      if(!key_size(sorted[i]->kind)
+	 || (i && !compare_items(&sorted[i - 1], &sorted[i])))
+	{
+	  free(sorted);
+	  return EINVAL;
+	}
+      offset = align_up(offset, KEY_ALIGNMENT) + key_size(sorted[i]->kind);
+    }
+  file_size = offset + (seal_key ? SEAL_TAG_SIZE : 0);
+
+  /* Lay out the whole file in memory. */
+  file = calloc(1, file_size);
+  if(!file)
+    {
+      free(sorted);
+      return ENOMEM;
+    }
+  header = (file_header *)file;
+  table = (file_entry *)(file + sizeof(file_header));
+
+  memcpy(header->magic, magic, sizeof magic);
+  header->version = KEYSTORE_VERSION;
+  header->byte_order = KEYSTORE_BYTE_ORDER;
+  header->flags = seal_key ? KEYSTORE_FLAG_SEALED : 0;
+  header->count = count;
+  for(i = 0; i < KEYSTORE_KIND_COUNT; ++i)
+    header->key_sizes[i] = key_size(i);
+  header->data_offset = data_offset;
+  header->data_size = offset - data_offset;
+  if(seal_key)
+    memcpy(header->nonce, nonce, KEYSTORE_NONCE_SIZE);
+
+  offset = data_offset;
+  for(i = 0; i < count; ++i)
+    {
+      const size_t size = key_size(sorted[i]->kind);
+      uint8_t *key;
+
+      offset = align_up(offset, KEY_ALIGNMENT);
+      key = file + offset;
+      memcpy(key, sorted[i]->key, size);
+      /* The pointer is meaningless in another process; fixed up on load. */
+      if(is_uhash(sorted[i]->kind))
+	((uhash_key *)key)->attribs = NULL;
+
+      table[i].id = sorted[i]->id;
+      table[i].kind = sorted[i]->kind;
+      table[i].offset = offset;
+      table[i].size = size;
+      table[i].crc = crc32(key, size);
+      offset += size;
+    }
+  header->table_crc = crc32((const uint8_t *)table, count * sizeof(file_entry));
+  free(sorted);
+
+  if(seal_key)
+    {
+      estream_aead_128_ctx ctx;
+
+      seal_init(&ctx, seal_key);
+      estream_aead_seal(&ctx.header, header->nonce, file, data_offset,
+			file + data_offset, file + data_offset,
+			header->data_size, file + offset);
+      memset(&ctx, 0, sizeof ctx);
+    }
+
+  /* Write under a temporary name, then replace the old store at once. */
+  tmp_path = malloc(strlen(path) + sizeof ".tmp");
+  if(!tmp_path)
+    {
+      free(file);
+      return ENOMEM;
+    }
+  strcpy(tmp_path, path);
+  strcat(tmp_path, ".tmp");
+
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if(fd < 0)
+    ret = errno;
+  else
+    {
+      ret = write_all(fd, file, file_size);
+      if(!ret && fsync(fd))
+	ret = errno;
+      if(close(fd) && !ret)
+	ret = errno;
+      if(!ret && rename(tmp_path, path))
+	ret = errno;
+      if(ret)
+	unlink(tmp_path);
+    }
+
+  memset(file, 0, file_size);
+  free(file);
+  free(tmp_path);
+
+  return ret;
+}
+
+/** Checks everything in the header and table that does not depend on the
+ * keys themselves. */
+static keystore_status
+check_layout(const uint8_t *map, size_t size)
+{
+  const file_header *header = (const file_header *)map;
+  const file_entry *table = (const file_entry *)(map + sizeof(file_header));
+  uint64_t data_end, table_end;
+  uint32_t i;
+
+  if(size < sizeof(file_header) || memcmp(header->magic, magic, sizeof magic))
+    return KEYSTORE_BAD_FORMAT;
+  if(header->byte_order != KEYSTORE_BYTE_ORDER)
+    return KEYSTORE_BAD_LAYOUT;
+  if(header->version != KEYSTORE_VERSION)
+    return KEYSTORE_BAD_VERSION;
+  for(i = 0; i < KEYSTORE_KIND_COUNT; ++i)
+    if(header->key_sizes[i] != key_size(i))
+      return KEYSTORE_BAD_LAYOUT;
+
+  table_end = sizeof(file_header) + (uint64_t)header->count * sizeof(file_entry);
+  data_end = header->data_offset + header->data_size;
+  if(header->data_offset % DATA_ALIGNMENT || header->data_offset < table_end
+     || data_end < header->data_offset
+     || data_end + (header->flags & KEYSTORE_FLAG_SEALED
+		    ? SEAL_TAG_SIZE : 0) != size)
+    return KEYSTORE_BAD_FORMAT;
+
+  if(crc32((const uint8_t *)table, header->count * sizeof(file_entry))
+     != header->table_crc)
+    return KEYSTORE_BAD_CHECKSUM;
+
+  for(i = 0; i < header->count; ++i)
+    {
+      const file_entry *e = &table[i];
+
+      if(e->kind >= KEYSTORE_KIND_COUNT || e->size != key_size(e->kind)
+	 || e->offset % KEY_ALIGNMENT || e->offset < header->data_offset
+	 || e->offset + e->size > data_end)
+	return KEYSTORE_BAD_FORMAT;
+
+      /* Must be sorted for keystore_find(). */
+      if(i && (table[i - 1].id > e->id
+	       || (table[i - 1].id == e->id && table[i - 1].kind >= e->kind)))
+	return KEYSTORE_BAD_FORMAT;
+    }
+
+  return KEYSTORE_OK;
+}
+
+keystore_status
+keystore_open(keystore *ks, const char *path, const uint8_t *seal_key)
+{
+  const file_header *header;
+  const file_entry *table;
+  keystore_status status;
+  struct stat st;
+  uint8_t *map;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if(fd < 0)
+    return KEYSTORE_IO_ERROR;
+  if(fstat(fd, &st))
+    {
+      close(fd);
+      return KEYSTORE_IO_ERROR;
+    }
+  if((size_t)st.st_size < sizeof(file_header))
+    {
+      close(fd);
+      return KEYSTORE_BAD_FORMAT;
+    }
+
+  /* Private and writable, so the keys can be decrypted and the pointers fixed
+   * up in place, without touching the file. Only the pages written to are
+   * copied. */
+  map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED)
+    return KEYSTORE_IO_ERROR;
+
+  header = (const file_header *)map;
+  table = (const file_entry *)(map + sizeof(file_header));
+
+  status = check_layout(map, st.st_size);
+  if(status != KEYSTORE_OK)
+    goto fail;
+
+  /* A store must be opened the same way it was written: accepting an unsealed
+   * store when a key is given would let anyone replace it. */
+  if(!(header->flags & KEYSTORE_FLAG_SEALED) != !seal_key)
+    {
+      status = KEYSTORE_BAD_SEAL;
+      goto fail;
+    }
+
+  if(seal_key)
+    {
+      estream_aead_128_ctx ctx;
+      estream_aead_status ret;
+
+      seal_init(&ctx, seal_key);
+      ret = estream_aead_open(&ctx.header, header->nonce, map, header->data_offset,
+			      map + header->data_offset, map + header->data_offset,
+			      header->data_size,
+			      map + header->data_offset + header->data_size);
+      memset(&ctx, 0, sizeof ctx);
+      if(ret != ESTREAM_AEAD_SUCCESS)
+	{
+	  status = KEYSTORE_BAD_SEAL;
+	  goto fail;
+	}
+    }
+
+  ks->map = map;
+  ks->size = st.st_size;
+  ks->count = header->count;
+  ks->table = table;
+  return KEYSTORE_OK;
+
+ fail:
+  munmap(map, st.st_size);
+  return status;
+}
+
+keystore_status
+keystore_find(const keystore *ks, uint32_t id, keystore_kind kind, const void **key)
+{
+  const file_entry *table = ks->table;
+  const file_entry *e;
+  size_t low = 0, high = ks->count;
+  uint8_t *found;
+
+  while(low < high)
+    {
+      const size_t mid = low + (high - low) / 2;
+
+      if(table[mid].id < id || (table[mid].id == id && table[mid].kind < kind))
+	low = mid + 1;
+      else
+	high = mid;
+    }
+
+  if(low == ks->count || table[low].id != id || table[low].kind != kind)
+    return KEYSTORE_NOT_FOUND;
+  e = &table[low];
+  found = ks->map + e->offset;
+
+  /* The pointer is set to the same value by every call, so it may have been
+   * fixed up already; zero it to compute the checksum. */
+  if(is_uhash(kind))
+    {
+      const uhash_key_attributes *const attribs =
+	uhash_attributes_array[kind - KEYSTORE_UHASH_32];
+      /* Another thread may be storing it meanwhile. */
+      const uhash_key_attributes *const stored =
+	__atomic_load_n(&((const uhash_key *)found)->attribs, __ATOMIC_RELAXED);
+      uhash_key header;
+      uint32_t crc;
+
+      if(stored && stored != attribs)
+	return KEYSTORE_BAD_CHECKSUM;
+      memset(&header, 0, sizeof header);
+      crc = crc32((const uint8_t *)&header, sizeof header);
+      crc = crc32_continue(crc, found + sizeof header, e->size - sizeof header);
+      if(crc != e->crc)
+	return KEYSTORE_BAD_CHECKSUM;
+
+      __atomic_store_n(&((uhash_key *)found)->attribs, attribs, __ATOMIC_RELAXED);
+    }
+  else if(crc32(found, e->size) != e->crc)
+    return KEYSTORE_BAD_CHECKSUM;
+
+  *key = found;
+  return KEYSTORE_OK;
+}
+
+void
+keystore_close(keystore *ks)
+{
+  munmap(ks->map, ks->size);
+  ks->map = NULL;
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <stddef.h>
+#include <inttypes.h>
+#include "salsa20.h"
+#include "sosemanuk.h"
+#include "umac.h"
+
+/* Persistent store of expanded keys.
+ *
+ * The file keeps the master states and UHASH keys in the same layout as in
+ * memory, so that it can be mapped and the keys used in place, without
+ * expanding them again. Thus, it is specific to the machine and build that
+ * wrote it, what is checked when loading.
+ *
+ * The file has a header, a table of entries sorted by id, then the keys,
+ * starting at a page boundary. The table and each key have a CRC-32. Opening
+ * a store only checks the header and the table; each key is checked, and the
+ * pointer in the UHASH keys fixed up, when it is looked up, so a process
+ * reads and copies only the pages of the keys it uses.
+ *
+ * If sealed, the keys are encrypted with the AEAD of "aead.h", whose tag is
+ * appended to the file, and the header and table are its associated data. A
+ * sealed store is decrypted whole when opened, in a private copy-on-write
+ * mapping, so the plain keys are never written back to the file. That costs
+ * about as much as expanding keys derived from Salsa20, like the UHASH keys,
+ * so sealing is for protecting the keys at rest, not for speed. */
+
+/** Version of the file format written by keystore_write(). */
+#define KEYSTORE_VERSION 1
+
+/** Size of the key that seals a store, in bytes. */
+#define KEYSTORE_SEAL_KEY_SIZE 32
+
+/** Size of the nonce of a sealed store, in bytes. */
+#define KEYSTORE_NONCE_SIZE 8
+
+typedef enum
+{
+  KEYSTORE_SOSEMANUK_MASTER,
+  KEYSTORE_SALSA20_MASTER,
+  KEYSTORE_UHASH_32,
+  KEYSTORE_UHASH_64,
+  KEYSTORE_UHASH_96,
+  KEYSTORE_UHASH_128,
+  KEYSTORE_KIND_COUNT
+} keystore_kind;
+
+/** A key to be stored. */
+typedef struct
+{
+  uint32_t id;
+  keystore_kind kind;
+  /** The expanded key: a sosemanuk_master_state, a salsa20_master_state or
+   * one of the uhash_<bits>_key types, according to kind. */
+  const void *key;
+} keystore_item;
+
+typedef enum
+{
+  KEYSTORE_OK,
+  KEYSTORE_IO_ERROR,
+  /** Not a key store, or truncated. */
+  KEYSTORE_BAD_FORMAT,
+  KEYSTORE_BAD_VERSION,
+  /** Written by a machine or build with a different layout of the keys. */
+  KEYSTORE_BAD_LAYOUT,
+  KEYSTORE_BAD_CHECKSUM,
+  KEYSTORE_NOT_FOUND,
+  /** Tampered with, sealed with another key, or sealed when a key was not
+   * given or the other way around. */
+  KEYSTORE_BAD_SEAL
+} keystore_status;
+
+/** A loaded store. All fields are internal. */
+typedef struct
+{
+  uint8_t *map;
+  size_t size;
+  uint32_t count;
+  const void *table;
+} keystore;
+
+/** Writes a key store.
+ *
+ * The file is written under a temporary name and renamed over path, so
+ * readers see either the old or the new store.
+ *
+ * @param items The keys; no two may have the same id and kind.
+ * @param seal_key KEYSTORE_SEAL_KEY_SIZE bytes of key to seal the store with,
+ * or NULL to leave it only checksummed.
+ * @param nonce KEYSTORE_NONCE_SIZE bytes, that must be different for every
+ * store sealed with the same key; ignored if not sealed.
+ * @returns 0 on success, or an errno value.
+ */
+int keystore_write(const char *path, const keystore_item *items, size_t count,
+		   const uint8_t *seal_key, const uint8_t *nonce);
+
+/** Maps and validates a key store.
+ *
+ * Checks the header, the layout of the keys, the checksum of the table and,
+ * if sealed, the seal.
+ *
+ * @param ks The uninitialized store, valid only if KEYSTORE_OK is returned.
+ * @param seal_key The key the store was sealed with, or NULL if not sealed.
+ */
+keystore_status keystore_open(keystore *ks, const char *path, const uint8_t *seal_key);
+
+/** Finds and checks a key.
+ *
+ * The checksum of the key is computed on every call, so look each key up
+ * once and keep the pointer. May be called concurrently.
+ *
+ * @param key Where to store the pointer to the key inside the mapping, usable
+ * directly as the type given by kind, valid until keystore_close().
+ * @returns KEYSTORE_OK, KEYSTORE_NOT_FOUND or KEYSTORE_BAD_CHECKSUM.
+ */
+keystore_status keystore_find(const keystore *ks, uint32_t id, keystore_kind kind,
+			      const void **key);
+
+/** Unmaps the store. */
+void keystore_close(keystore *ks);
@@ -0,0 +1,311 @@
+#include <string.h>
+#include "util.h"
+
+#include "poly1305.h"
+
+#define MASK26 0x3ffffffu
+
+/** Multiplies h by r, modulo 2^130 - 5.
+ *
+ * The result limbs are carried to 26 bits, except h[1], that may have a few
+ * bits more, what is fine as input to the next multiplication.
+ */
+static void
+mul_r(uint32_t *h, const uint32_t *r)
+{
+  const uint32_t s1 = r[1] * 5, s2 = r[2] * 5, s3 = r[3] * 5, s4 = r[4] * 5;
+  uint64_t d0, d1, d2, d3, d4;
+  uint32_t c;
+
+  /* 2^130 = 5 (mod p), so the products above 2^130 wrap multiplied by 5. */
+  d0 = (uint64_t)h[0] * r[0] + (uint64_t)h[1] * s4 + (uint64_t)h[2] * s3
+    + (uint64_t)h[3] * s2 + (uint64_t)h[4] * s1;
+  d1 = (uint64_t)h[0] * r[1] + (uint64_t)h[1] * r[0] + (uint64_t)h[2] * s4
+    + (uint64_t)h[3] * s3 + (uint64_t)h[4] * s2;
+  d2 = (uint64_t)h[0] * r[2] + (uint64_t)h[1] * r[1] + (uint64_t)h[2] * r[0]
+    + (uint64_t)h[3] * s4 + (uint64_t)h[4] * s3;
+  d3 = (uint64_t)h[0] * r[3] + (uint64_t)h[1] * r[2] + (uint64_t)h[2] * r[1]
+    + (uint64_t)h[3] * r[0] + (uint64_t)h[4] * s4;
+  d4 = (uint64_t)h[0] * r[4] + (uint64_t)h[1] * r[3] + (uint64_t)h[2] * r[2]
+    + (uint64_t)h[3] * r[1] + (uint64_t)h[4] * r[0];
+
+  c = d0 >> 26; h[0] = d0 & MASK26;
+  d1 += c; c = d1 >> 26; h[1] = d1 & MASK26;
+  d2 += c; c = d2 >> 26; h[2] = d2 & MASK26;
+  d3 += c; c = d3 >> 26; h[3] = d3 & MASK26;
+  d4 += c; c = d4 >> 26; h[4] = d4 & MASK26;
+  h[0] += c * 5; c = h[0] >> 26; h[0] &= MASK26;
+  h[1] += c;
+}
+
+/** Adds a 16 bytes block, plus hibit at bit 128, to h. */
+static inline void
+add_block(uint32_t *h, const uint8_t *m, uint32_t hibit)
+{
+  const uint32_t t0 = pack_littleendian(m), t1 = pack_littleendian(m + 4),
+    t2 = pack_littleendian(m + 8), t3 = pack_littleendian(m + 12);
+
+  h[0] += t0 & MASK26;
+  h[1] += ((t0 >> 26) | (t1 << 6)) & MASK26;
+  h[2] += ((t1 >> 20) | (t2 << 12)) & MASK26;
+  h[3] += ((t2 >> 14) | (t3 << 18)) & MASK26;
+  h[4] += (t3 >> 8) | hibit;
+}
+
+static void
+blocks_scalar(poly1305_state *state, const uint8_t *m, size_t blocks, uint32_t hibit)
+{
+  for(; blocks; --blocks, m += 16) {
+    add_block(state->h, m, hibit);
+    mul_r(state->h, state->r);
+  }
+}
+
+#ifdef __AVX2__
+#include <immintrin.h>
+
+/** Minimum number of blocks for the 4 lanes kernel to pay off. */
+#define AVX2_MIN_BLOCKS 16
+
+/** Multiplies each lane of h by the same lane of r, modulo 2^130 - 5,
+ * with s = 5 * r. */
+static inline void
+mul_lanes(__m256i *h, const __m256i *r, const __m256i *s)
+{
+  const __m256i mask = _mm256_set1_epi64x(MASK26);
+  __m256i d[5], c;
+
+#define MUL(a, b) _mm256_mul_epu32(a, b)
+  d[0] = _mm256_add_epi64(_mm256_add_epi64(MUL(h[0], r[0]), MUL(h[1], s[4])),
+      _mm256_add_epi64(_mm256_add_epi64(MUL(h[2], s[3]), MUL(h[3], s[2])), MUL(h[4], s[1])));
+  d[1] = _mm256_add_epi64(_mm256_add_epi64(MUL(h[0], r[1]), MUL(h[1], r[0])),
+      _mm256_add_epi64(_mm256_add_epi64(MUL(h[2], s[4]), MUL(h[3], s[3])), MUL(h[4], s[2])));
+  d[2] = _mm256_add_epi64(_mm256_add_epi64(MUL(h[0], r[2]), MUL(h[1], r[1])),
+      _mm256_add_epi64(_mm256_add_epi64(MUL(h[2], r[0]), MUL(h[3], s[4])), MUL(h[4], s[3])));
+  d[3] = _mm256_add_epi64(_mm256_add_epi64(MUL(h[0], r[3]), MUL(h[1], r[2])),
+      _mm256_add_epi64(_mm256_add_epi64(MUL(h[2], r[1]), MUL(h[3], r[0])), MUL(h[4], s[4])));
+  d[4] = _mm256_add_epi64(_mm256_add_epi64(MUL(h[0], r[4]), MUL(h[1], r[3])),
+      _mm256_add_epi64(_mm256_add_epi64(MUL(h[2], r[2]), MUL(h[3], r[1])), MUL(h[4], r[0])));
+#undef MUL
+
+  c = _mm256_srli_epi64(d[0], 26); h[0] = _mm256_and_si256(d[0], mask);
+  d[1] = _mm256_add_epi64(d[1], c);
+  c = _mm256_srli_epi64(d[1], 26); h[1] = _mm256_and_si256(d[1], mask);
+  d[2] = _mm256_add_epi64(d[2], c);
+  c = _mm256_srli_epi64(d[2], 26); h[2] = _mm256_and_si256(d[2], mask);
+  d[3] = _mm256_add_epi64(d[3], c);
+  c = _mm256_srli_epi64(d[3], 26); h[3] = _mm256_and_si256(d[3], mask);
+  d[4] = _mm256_add_epi64(d[4], c);
+  c = _mm256_srli_epi64(d[4], 26); h[4] = _mm256_and_si256(d[4], mask);
+  h[0] = _mm256_add_epi64(h[0], _mm256_add_epi64(c, _mm256_slli_epi64(c, 2)));
+  c = _mm256_srli_epi64(h[0], 26); h[0] = _mm256_and_si256(h[0], mask);
+  h[1] = _mm256_add_epi64(h[1], c);
+}
+
+/** Loads a power of r in each lane, and its multiples by 5. */
+static inline void
+load_powers(__m256i *r, __m256i *s, const uint32_t *p0, const uint32_t *p1,
+	    const uint32_t *p2, const uint32_t *p3)
+{
+  int i;
+
+  for(i = 0; i < 5; ++i) {
+    r[i] = _mm256_set_epi64x(p3[i], p2[i], p1[i], p0[i]);
+    s[i] = _mm256_add_epi64(r[i], _mm256_slli_epi64(r[i], 2));
+  }
+}
+
+/** Hashes a multiple of 4 full blocks.
+ *
+ * Each of the 4 lanes takes every 4th block, hashed with r^4, and the last
+ * ones are multiplied by r^4, r^3, r^2 and r, so that the sum of the lanes is
+ * the same as hashing the blocks in sequence.
+ */
+static void
+blocks_avx2(poly1305_state *state, const uint8_t *m, size_t blocks)
+{
+  const __m256i mask = _mm256_set1_epi64x(MASK26);
+  const __m256i hibit = _mm256_set1_epi64x(1u << 24);
+  const uint32_t *r = state->r;
+  const uint32_t (*pow)[5] = state->r_powers;
+  __m256i h[5], r4[5], s4[5], rf[5], sf[5];
+  uint64_t lanes[4], d[5], c;
+  int i;
+
+  /* Loaded blocks are in lanes 0, 2, 1, 3, so are their final powers. */
+  load_powers(r4, s4, pow[2], pow[2], pow[2], pow[2]);
+  load_powers(rf, sf, pow[2], pow[0], pow[1], r);
+
+  /* Hash so far goes into the first block. */
+  for(i = 0; i < 5; ++i)
+    h[i] = _mm256_set_epi64x(0, 0, 0, state->h[i]);
+
+  for(; blocks; blocks -= 4, m += 64) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)m);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(m + 32));
+    __m256i lo = _mm256_unpacklo_epi64(a, b);
+    __m256i hi = _mm256_unpackhi_epi64(a, b);
+
+    h[0] = _mm256_add_epi64(h[0], _mm256_and_si256(lo, mask));
+    h[1] = _mm256_add_epi64(h[1], _mm256_and_si256(_mm256_srli_epi64(lo, 26), mask));
+    h[2] = _mm256_add_epi64(h[2], _mm256_and_si256(
+	_mm256_or_si256(_mm256_srli_epi64(lo, 52), _mm256_slli_epi64(hi, 12)), mask));
+    h[3] = _mm256_add_epi64(h[3], _mm256_and_si256(_mm256_srli_epi64(hi, 14), mask));
+    h[4] = _mm256_add_epi64(h[4], _mm256_or_si256(_mm256_srli_epi64(hi, 40), hibit));
+
+    if(blocks > 4)
+      mul_lanes(h, r4, s4);
+    else
+      mul_lanes(h, rf, sf);
+  }
+
+  /* Sum the lanes. Each limb of the sum may have up to 28 bits, too many as
+   * input to the scalar mul_r(), so they are carried back to 26 bits, as
+   * mul_r() does with its result. */
+  for(i = 0; i < 5; ++i) {
+    _mm256_storeu_si256((__m256i *)lanes, h[i]);
+    d[i] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  }
+
+  c = d[0] >> 26; state->h[0] = d[0] & MASK26;
+  for(i = 1; i < 5; ++i) {
+    d[i] += c; c = d[i] >> 26; state->h[i] = d[i] & MASK26;
+  }
+  state->h[0] += c * 5; c = state->h[0] >> 26; state->h[0] &= MASK26;
+  state->h[1] += c;
+}
+#endif
+
+/** Hashes full blocks. */
+static void
+blocks_full(poly1305_state *state, const uint8_t *m, size_t blocks)
+{
+#ifdef __AVX2__
+  if(blocks >= AVX2_MIN_BLOCKS) {
+    size_t lanes_blocks = blocks & ~(size_t)3;
+    blocks_avx2(state, m, lanes_blocks);
+    m += lanes_blocks * 16;
+    blocks -= lanes_blocks;
+  }
+#endif
+  blocks_scalar(state, m, blocks, 1u << 24);
+}
+
+void
+poly1305_init(poly1305_state *state, const uint8_t *key)
+{
+  const uint32_t t0 = pack_littleendian(key), t1 = pack_littleendian(key + 4),
+    t2 = pack_littleendian(key + 8), t3 = pack_littleendian(key + 12);
+  int i;
+
+  /* r is clamped as the specification demands. */
+  state->r[0] = t0 & 0x3ffffff;
+  state->r[1] = ((t0 >> 26) | (t1 << 6)) & 0x3ffff03;
+  state->r[2] = ((t1 >> 20) | (t2 << 12)) & 0x3ffc0ff;
+  state->r[3] = ((t2 >> 14) | (t3 << 18)) & 0x3f03fff;
+  state->r[4] = (t3 >> 8) & 0x00fffff;
+
+  memcpy(state->r_powers[0], state->r, sizeof(state->r));
+  mul_r(state->r_powers[0], state->r);
+  for(i = 1; i < 3; ++i) {
+    memcpy(state->r_powers[i], state->r_powers[i - 1], sizeof(state->r));
+    mul_r(state->r_powers[i], state->r);
+  }
+
+  for(i = 0; i < 4; ++i)
+    state->s[i] = pack_littleendian(key + 16 + i * 4);
+
+  memset(state->h, 0, sizeof(state->h));
+  state->buffer_len = 0;
+}
+
+void
+poly1305_update(poly1305_state *state, const uint8_t *input, size_t len)
+{
+  size_t blocks;
+
+  /* Complete the buffered block, if any. */
+  if(state->buffer_len) {
+    size_t to_copy = min(16 - state->buffer_len, len);
+
+    memcpy(state->buffer + state->buffer_len, input, to_copy);
+    state->buffer_len += to_copy;
+    input += to_copy;
+    len -= to_copy;
+
+    if(state->buffer_len < 16)
+      return;
+
+    blocks_scalar(state, state->buffer, 1, 1u << 24);
+    state->buffer_len = 0;
+  }
+
+  blocks = len / 16;
+  blocks_full(state, input, blocks);
+  input += blocks * 16;
+  len -= blocks * 16;
+
+  memcpy(state->buffer, input, len);
+  state->buffer_len = len;
+}
+
+void
+poly1305_finish(poly1305_state *state, uint8_t *tag)
+{
+  uint32_t *h = state->h;
+  uint32_t g[5], c, select;
+  uint64_t f;
+  int i;
+
+  /* The last partial block is padded with 1, without the bit 128. */
+  if(state->buffer_len) {
+    memset(state->buffer + state->buffer_len, 0, 16 - state->buffer_len);
+    state->buffer[state->buffer_len] = 1;
+    blocks_scalar(state, state->buffer, 1, 0);
+  }
+
+  /* Fully carry h. The limbs may be a few bits over 26 bits, so after the
+   * first pass, h[1] may still overflow by one, in which case h[0] is small
+   * and the second pass can't overflow it. */
+  c = 0;
+  for(i = 0; i < 5; ++i) {
+    h[i] += c; c = h[i] >> 26; h[i] &= MASK26;
+  }
+  h[0] += c * 5; c = h[0] >> 26; h[0] &= MASK26;
+  for(i = 1; i < 5; ++i) {
+    h[i] += c; c = h[i] >> 26; h[i] &= MASK26;
+  }
+  h[0] += c * 5;
+
+  /* Compute g = h - p = h + 5 - 2^130, and select it if it doesn't borrow,
+   * without branches. */
+  g[0] = h[0] + 5; c = g[0] >> 26; g[0] &= MASK26;
+  for(i = 1; i < 4; ++i) {
+    g[i] = h[i] + c; c = g[i] >> 26; g[i] &= MASK26;
+  }
+  g[4] = h[4] + c - (1u << 26);
+
+  select = (g[4] >> 31) - 1; /* All ones if g is not negative. */
+  for(i = 0; i < 5; ++i)
+    h[i] = (h[i] & ~select) | (g[i] & select);
+
+  /* h = (h + s) mod 2^128 */
+  f = (uint64_t)(h[0] | (h[1] << 26)) + state->s[0];
+  unpack_littleendian((uint32_t)f, tag);
+  f = (uint64_t)((h[1] >> 6) | (h[2] << 20)) + state->s[1] + (f >> 32);
+  unpack_littleendian((uint32_t)f, tag + 4);
+  f = (uint64_t)((h[2] >> 12) | (h[3] << 14)) + state->s[2] + (f >> 32);
+  unpack_littleendian((uint32_t)f, tag + 8);
+  f = (uint64_t)((h[3] >> 18) | (h[4] << 8)) + state->s[3] + (f >> 32);
+  unpack_littleendian((uint32_t)f, tag + 12);
+}
+
+void
+poly1305_auth(const uint8_t *key, const uint8_t *input, size_t len, uint8_t *tag)
+{
+  poly1305_state state;
+
+  poly1305_init(&state, key);
+  poly1305_update(&state, input, len);
+  poly1305_finish(&state, tag);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <inttypes.h>
+
+/** Size of a Poly1305 key, in bytes. */
+#define POLY1305_KEY_SIZE 32
+
+/** Size of a Poly1305 tag, in bytes. */
+#define POLY1305_TAG_SIZE 16
+
+/** Poly1305 state.
+ *
+ * The numbers modulo 2^130 - 5 are kept in 26 bits limbs, least significant
+ * first. All fields are internal.
+ */
+typedef struct
+{
+  uint32_t h[5];
+  uint32_t r[5];
+  /** r^2, r^3 and r^4, used to hash 4 blocks at once. */
+  uint32_t r_powers[3][5];
+  uint32_t s[4];
+
+  uint8_t buffer[16];
+  uint8_t buffer_len;
+} poly1305_state;
+
+/** Initializes a Poly1305 state with a one-time key.
+ *
+ * Notice: as the name says, the key must be used for a single message, like
+ * one extracted from a cipher stream that is never reused.
+ *
+ * @param state The uninitialized state.
+ * @param key POLY1305_KEY_SIZE bytes of key, r followed by s, as in RFC 8439.
+ */
+void poly1305_init(poly1305_state *state, const uint8_t *key);
+
+/** Adds data to the message being authenticated. */
+void poly1305_update(poly1305_state *state, const uint8_t *input, size_t len);
+
+/** Finishes the message and computes its tag.
+ *
+ * @param tag Where to store the POLY1305_TAG_SIZE bytes tag.
+ */
+void poly1305_finish(poly1305_state *state, uint8_t *tag);
+
+/** Computes the tag of a whole message at once. */
+void poly1305_auth(const uint8_t *key, const uint8_t *input, size_t len, uint8_t *tag);
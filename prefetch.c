@@ -0,0 +1,169 @@
+#include <assert.h>
+#include <string.h>
+#include <sched.h>
+#include "util.h"
+
+#include "prefetch.h"
+
+/** Maximum amount of keystream generated by the producer at once. The source
+ * lock is held meanwhile, so it bounds how long a consumer falling back to the
+ * source may wait for it. */
+#define PREFETCH_MAX_BATCH 256
+
+static size_t
+free_space(const prefetch_state *pf, size_t head)
+{
+  return pf->ring_size - (head - __atomic_load_n(&pf->tail, __ATOMIC_SEQ_CST));
+}
+
+static void *
+producer_loop(prefetch_state *pf)
+{
+  for(;;)
+    {
+      size_t head;
+
+      /* The lock was just released; let a consumer waiting for it take it,
+       * instead of taking it again before the consumer wakes up. */
+      while(__atomic_load_n(&pf->consumer_waiting, __ATOMIC_ACQUIRE))
+	sched_yield();
+
+      pthread_mutex_lock(&pf->source_lock);
+
+      /* Wait until there is room for a batch. The flag is set before checking
+       * the free space again, so the consumer either sees it or the space it
+       * released is seen here. */
+      head = pf->head;
+      while(__atomic_load_n(&pf->running, __ATOMIC_RELAXED)
+	    && free_space(pf, head) < pf->batch)
+	{
+	  __atomic_store_n(&pf->producer_waiting, 1, __ATOMIC_SEQ_CST);
+	  if(free_space(pf, head) < pf->batch)
+	    pthread_cond_wait(&pf->space_available, &pf->source_lock);
+	  __atomic_store_n(&pf->producer_waiting, 0, __ATOMIC_RELAXED);
+	}
+
+      if(!__atomic_load_n(&pf->running, __ATOMIC_RELAXED))
+	{
+	  pthread_mutex_unlock(&pf->source_lock);
+	  break;
+	}
+
+      /* Batch divides the ring size, so it never wraps around. */
+      buffered_action(pf->source, pf->ring + (head & (pf->ring_size - 1)),
+		      pf->batch, BUFFERED_EXTRACT);
+      __atomic_store_n(&pf->head, head + pf->batch, __ATOMIC_RELEASE);
+
+      pthread_mutex_unlock(&pf->source_lock);
+    }
+
+  return NULL;
+}
+
+int
+prefetch_start(prefetch_state *pf, buffered_state *source,
+	       uint8_t *ring, size_t ring_size)
+{
+  int ret;
+
+  assert(ring_size >= 64 && !(ring_size & (ring_size - 1))
+	 && "Ring size must be a power of 2");
+
+  pf->source = source;
+  pf->ring = ring;
+  pf->ring_size = ring_size;
+  pf->batch = min(ring_size / 2, PREFETCH_MAX_BATCH);
+  pf->head = pf->tail = 0;
+  pf->running = 1;
+  pf->producer_waiting = 0;
+  pf->consumer_waiting = 0;
+
+  pthread_mutex_init(&pf->source_lock, NULL);
+  pthread_cond_init(&pf->space_available, NULL);
+
+  ret = pthread_create(&pf->producer, NULL,
+		       (void *(*)(void *))producer_loop, pf);
+  if(ret)
+    {
+      pthread_cond_destroy(&pf->space_available);
+      pthread_mutex_destroy(&pf->source_lock);
+    }
+
+  return ret;
+}
+
+/** Uses up to len bytes of the ring, returns how many were used. */
+static size_t
+consume_ring(prefetch_state *pf, uint8_t *stream, size_t len, buffered_ops op)
+{
+  const size_t tail = pf->tail;
+  const size_t head = __atomic_load_n(&pf->head, __ATOMIC_ACQUIRE);
+  const size_t offset = tail & (pf->ring_size - 1);
+  size_t count, first;
+
+  count = min(head - tail, len);
+  if(!count)
+    return 0;
+
+  /* The available bytes may wrap around the end of the ring. */
+  first = min(count, pf->ring_size - offset);
+  if(op == BUFFERED_EXTRACT)
+    {
+      memcpy(stream, pf->ring + offset, first);
+      memcpy(stream + first, pf->ring, count - first);
+    }
+  else
+    {
+      memxor(stream, pf->ring + offset, first);
+      memxor(stream + first, pf->ring, count - first);
+    }
+
+  __atomic_store_n(&pf->tail, tail + count, __ATOMIC_SEQ_CST);
+
+  return count;
+}
+
+void
+prefetch_action(prefetch_state *pf, uint8_t *stream, size_t len,
+		buffered_ops op)
+{
+  size_t used = consume_ring(pf, stream, len, op);
+
+  if(used < len)
+    {
+      /* Fall back to inline generation. With the lock, the producer is not
+       * running, so everything it has put in the ring, which precedes the
+       * source stream, can be used before the source itself. The producer
+       * holds the lock for at most one batch, and yields it while the flag is
+       * set. */
+      __atomic_store_n(&pf->consumer_waiting, 1, __ATOMIC_RELAXED);
+      pthread_mutex_lock(&pf->source_lock);
+      __atomic_store_n(&pf->consumer_waiting, 0, __ATOMIC_RELEASE);
+      used += consume_ring(pf, stream + used, len - used, op);
+      if(used < len)
+	buffered_action(pf->source, stream + used, len - used, op);
+      pthread_mutex_unlock(&pf->source_lock);
+    }
+
+  /* Wake up the producer if it was waiting for room. */
+  if(__atomic_load_n(&pf->producer_waiting, __ATOMIC_SEQ_CST))
+    {
+      pthread_mutex_lock(&pf->source_lock);
+      pthread_cond_signal(&pf->space_available);
+      pthread_mutex_unlock(&pf->source_lock);
+    }
+}
+
+void
+prefetch_stop(prefetch_state *pf)
+{
+  pthread_mutex_lock(&pf->source_lock);
+  __atomic_store_n(&pf->running, 0, __ATOMIC_RELAXED);
+  pthread_cond_signal(&pf->space_available);
+  pthread_mutex_unlock(&pf->source_lock);
+
+  pthread_join(pf->producer, NULL);
+
+  pthread_cond_destroy(&pf->space_available);
+  pthread_mutex_destroy(&pf->source_lock);
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stddef.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "buffered.h"
+
+/** Keystream prefetching state.
+ *
+ * Wraps a buffered state, whose keystream is generated ahead by a background
+ * thread into a single-producer/single-consumer ring buffer, so that the
+ * encryption/decryption only has to XOR the already available keystream.
+ * All fields are internal.
+ */
+typedef struct
+{
+  buffered_state *source;
+  uint8_t *ring;
+  size_t ring_size;
+  size_t batch;
+
+  /** Total bytes produced into the ring; written only by the producer. */
+  size_t head;
+  /* Keeps head and tail in different cache lines. */
+  uint8_t padding[64];
+  /** Total bytes consumed from the ring; written only by the consumer. */
+  size_t tail;
+
+  int running;
+  int producer_waiting;
+  /** Set while the consumer waits for the source lock. */
+  int consumer_waiting;
+
+  /** Held while using the source state. */
+  pthread_mutex_t source_lock;
+  pthread_cond_t space_available;
+  pthread_t producer;
+} prefetch_state;
+
+/** Starts prefetching the keystream of a buffered state.
+ *
+ * Starts a thread that keeps the ring filled with keystream from source.
+ * From this point until prefetch_stop(), the source state must only be used
+ * through prefetch_action().
+ *
+ * @param pf The uninitialized prefetch state.
+ * @param source A properly initialized and valid buffered state.
+ * @param ring Memory used as ring buffer, must be 4 byte aligned and remain
+ * valid until prefetch_stop().
+ * @param ring_size Size of the ring buffer; must be a power of 2, at least 64.
+ * The bigger it is, the longer bursts of traffic it can absorb without
+ * falling back to generating keystream inline.
+ * @returns 0 on success, or the error number from the thread creation.
+ */
+int prefetch_start(prefetch_state *pf, buffered_state *source,
+		   uint8_t *ring, size_t ring_size);
+
+/** Performs a buffered operation using the prefetched keystream.
+ *
+ * Has exactly the same result as calling buffered_action() on the source
+ * state. If the ring does not have enough keystream available, the missing
+ * part is generated inline from the source. Must not be called concurrently
+ * on the same prefetch state.
+ *
+ * @param pf The running prefetch state.
+ * @param stream The buffer to be encrypted or decrypted in place, or to store
+ * the extraction output.
+ * @param len The length of the stream.
+ * @param op Either BUFFERED_ENCDEC or BUFFERED_EXTRACT.
+ */
+void prefetch_action(prefetch_state *pf, uint8_t *stream, size_t len,
+		     buffered_ops op);
+
+/** Stops the prefetching thread.
+ *
+ * Notice: the keystream already in the ring and not consumed is discarded, so
+ * the source state is left ahead of where the last prefetch_action() stopped,
+ * and should not be used to continue the same stream.
+ *
+ * @param pf The running prefetch state.
+ */
+void prefetch_stop(prefetch_state *pf);
@@ -5,18 +5,83 @@
 /* TODO: deal with systems that do not have le32toh and htole32. */
 #include <endian.h>
 
+#include "util.h"
+
 #include "protocol.h"
 
 #define WORK_BUFFER_SIZE (4096)
 
-void
-signed_send(signer_context *ctx, void *send_param, const uint8_t *msg_buff, uint32_t len)
+/** Size of the one-time keys taken from the stream for each Poly1305 message. */
+#define POLY1305_KEYS_SIZE (2 * POLY1305_KEY_SIZE)
+
+static uint8_t
+mac_tag_size(const signer_context *ctx)
+{
+  if(ctx->mac_type == SIGNER_MAC_POLY1305)
+    return POLY1305_TAG_SIZE;
+  if(ctx->mac_type == SIGNER_MAC_SIPHASH)
+    return SIPHASH_TAG_SIZE;
+  return ctx->mac_key->attribs->iters * 4;
+}
+
+/** Starts the MAC of a new message, with the header key. */
+static void
+mac_begin(signer_context *ctx, uint8_t *keys)
+{
+  if(ctx->mac_type == SIGNER_MAC_POLY1305) {
+    buffered_action(ctx->cipher_state, keys, POLY1305_KEYS_SIZE, BUFFERED_EXTRACT);
+    poly1305_init(ctx->poly1305, keys);
+  } else if(ctx->mac_type == SIGNER_MAC_SIPHASH) {
+    siphash_init(ctx->sip_key, ctx->sip_state);
+  } else {
+    uhash_init(uhash_get_type_from_key(ctx->mac_key), ctx->mac_state);
+  }
+}
+
+/** Starts the MAC of the message body, after the size was signed. */
+static void
+mac_restart(signer_context *ctx, const uint8_t *keys)
+{
+  if(ctx->mac_type == SIGNER_MAC_POLY1305)
+    poly1305_init(ctx->poly1305, keys + POLY1305_KEY_SIZE);
+  else if(ctx->mac_type == SIGNER_MAC_SIPHASH)
+    siphash_init(ctx->sip_key, ctx->sip_state);
+  else
+    uhash_init(uhash_get_type_from_key(ctx->mac_key), ctx->mac_state);
+}
+
+static void
+mac_update(signer_context *ctx, const uint8_t *data, size_t len)
+{
+  if(ctx->mac_type == SIGNER_MAC_POLY1305)
+    poly1305_update(ctx->poly1305, data, len);
+  else if(ctx->mac_type == SIGNER_MAC_SIPHASH)
+    siphash_update(ctx->sip_state, data, len);
+  else
+    uhash_update(ctx->mac_key, ctx->mac_state, data, len);
+}
+
+static void
+mac_finish(signer_context *ctx, uint8_t *tag)
+{
+  if(ctx->mac_type == SIGNER_MAC_POLY1305)
+    poly1305_finish(ctx->poly1305, tag);
+  else if(ctx->mac_type == SIGNER_MAC_SIPHASH)
+    siphash_finish(ctx->sip_state, tag);
+  else
+    uhash_finish(ctx->mac_key, ctx->mac_state, tag);
+}
+
+/** MAC-then-encrypt version of signed_send(). */
+static void
+mte_send(signer_context *ctx, void *send_param, const uint8_t *msg_buff, uint32_t len)
 {
   uint32_t processed_count = 0;
   uint32_t sent_msg_bytes = 0;
   uint8_t buffer[WORK_BUFFER_SIZE];
   uint16_t buff_used;
-  const uint8_t tag_size = ctx->mac_key->attribs->iters * 4;
+  uint8_t keys[POLY1305_KEYS_SIZE];
+  const uint8_t tag_size = mac_tag_size(ctx);
 
   {
     uint32_t ordered_len = htole32(len);
@@ -24,17 +89,17 @@ signed_send(signer_context *ctx, void *send_param, const uint8_t *msg_buff, uint
     buff_used = 4;
   }
 
-  uhash_init(uhash_get_type_from_key(ctx->mac_key), ctx->mac_state);
-  uhash_update(ctx->mac_key, ctx->mac_state, buffer, buff_used);
+  mac_begin(ctx, keys);
+  mac_update(ctx, buffer, buff_used);
 
   /* If message is greater than 1024 bytes, a MAC just for the size is generated, to
    * avoid DoS by an attacker flipping higher order bits of the size, and leaving
    * the receiver waiting indefinitely. */
   if(len > 1024) {
-    uhash_finish(ctx->mac_key, ctx->mac_state, &buffer[buff_used]);
-    uhash_init(uhash_get_type_from_key(ctx->mac_key), ctx->mac_state);
+    mac_finish(ctx, &buffer[buff_used]);
+    mac_restart(ctx, keys);
 
-    /* The maximum possible value of "used" is 10. */
+    /* The maximum possible value of "used" is 20. */
     buff_used += tag_size;
   }
 
@@ -43,7 +108,7 @@ signed_send(signer_context *ctx, void *send_param, const uint8_t *msg_buff, uint
     uint16_t to_copy = min(len, WORK_BUFFER_SIZE - buff_used);
 
     memcpy(&buffer[buff_used], msg_buff, to_copy);
-    uhash_update(ctx->mac_key, ctx->mac_state, msg_buff, to_copy);
+    mac_update(ctx, msg_buff, to_copy);
 
     processed_count += to_copy;
     buff_used += to_copy;
@@ -56,7 +121,7 @@ signed_send(signer_context *ctx, void *send_param, const uint8_t *msg_buff, uint
 
       buff_used = min(len - processed_count, WORK_BUFFER_SIZE);
       memcpy(buffer, msg_buff + processed_count, buff_used);
-      uhash_update(ctx->mac_key, ctx->mac_state, buffer, buff_used);
+      mac_update(ctx, buffer, buff_used);
 
       processed_count += buff_used;
   }
@@ -66,7 +131,7 @@ signed_send(signer_context *ctx, void *send_param, const uint8_t *msg_buff, uint
     uint16_t space_left = WORK_BUFFER_SIZE - buff_used;
     if(space_left >= tag_size) {
 	/* Take the MAC into the same buffer. */
-	uhash_finish(ctx->mac_key, ctx->mac_state, &buffer[buff_used]);
+	mac_finish(ctx, &buffer[buff_used]);
 	buff_used += tag_size;
 
 	/* Encrypt everything and send. */
@@ -79,7 +144,7 @@ signed_send(signer_context *ctx, void *send_param, const uint8_t *msg_buff, uint
 	ctx->io_callback(send_param, buffer, buff_used);
 
 	/* ...then the MAC. */
-	uhash_finish(ctx->mac_key, ctx->mac_state, buffer);
+	mac_finish(ctx, buffer);
 	buffered_action(ctx->cipher_state, buffer, tag_size, BUFFERED_ENCDEC);
 	ctx->io_callback(send_param, buffer, tag_size);
     }
@@ -89,36 +154,39 @@ signed_send(signer_context *ctx, void *send_param, const uint8_t *msg_buff, uint
 static int
 mac_verify(signer_context *ctx, void *recv_param)
 {
-  uint8_t mac_recv[16]; /* 16 bytes (128 bits) is the greatest UMAC tag possible */
+  /* 16 bytes (128 bits) is the greatest tag possible, both for UMAC and Poly1305. */
+  uint8_t mac_recv[16];
   uint8_t mac_calc[16];
-  const uint8_t size = ctx->mac_key->attribs->iters * 4;
+  const uint8_t size = mac_tag_size(ctx);
 
   ctx->io_callback(recv_param, mac_recv, size);
   buffered_action(ctx->cipher_state, mac_recv, size, BUFFERED_ENCDEC);
 
-  uhash_finish(ctx->mac_key, ctx->mac_state, mac_calc);
+  mac_finish(ctx, mac_calc);
 
   return memcmp(mac_recv, mac_calc, size) == 0;
 }
 
-SignerReceiveStatus
-signed_recv(signer_context *ctx, void *recv_param, uint8_t **buffer, uint32_t *size)
+/** MAC-then-encrypt version of signed_recv(). */
+static SignerReceiveStatus
+mte_recv(signer_context *ctx, void *recv_param, uint8_t **buffer, uint32_t *size)
 {
-  const uint8_t tag_size = ctx->mac_key->attribs->iters * 4;
+  uint8_t keys[POLY1305_KEYS_SIZE];
   *buffer = NULL;
 
+  /* Keys are taken from the stream before the header is decrypted. */
+  mac_begin(ctx, keys);
+
   ctx->io_callback(recv_param, (uint8_t*)size, 4);
   buffered_action(ctx->cipher_state, (uint8_t*)size, 4, BUFFERED_ENCDEC);
-
-  uhash_init(uhash_get_type_from_key(ctx->mac_key), ctx->mac_state);
-  uhash_update(ctx->mac_key, ctx->mac_state, (uint8_t*)size, 4);
+  mac_update(ctx, (uint8_t*)size, 4);
 
   *size = le32toh(*size);
   if(*size > 1024) {
       if(!mac_verify(ctx, recv_param))
 	return SIGNER_RECV_VERIFY_FAILED;
 
-      uhash_init(uhash_get_type_from_key(ctx->mac_key), ctx->mac_state);
+      mac_restart(ctx, keys);
   }
 
   /* Size was properly signed, we can malloc. */
@@ -138,7 +206,7 @@ signed_recv(signer_context *ctx, void *recv_param, uint8_t **buffer, uint32_t *s
 	  received += to_recv;
 
 	  buffered_action(ctx->cipher_state, ptr, to_recv, BUFFERED_ENCDEC);
-	  uhash_update(ctx->mac_key, ctx->mac_state, ptr, to_recv);
+	  mac_update(ctx, ptr, to_recv);
       }
   }
 
@@ -150,3 +218,159 @@ signed_recv(signer_context *ctx, void *recv_param, uint8_t **buffer, uint32_t *s
 
   return SIGNER_RECV_SUCCESS;
 }
+
+/** Encrypt-then-MAC version of signed_send(). */
+static void
+etm_send(signer_context *ctx, void *send_param, const uint8_t *msg_buff, uint32_t len)
+{
+  uint32_t processed_count = 0;
+  uint8_t buffer[WORK_BUFFER_SIZE];
+  uint16_t buff_used;
+  uint8_t keys[POLY1305_KEYS_SIZE];
+  uint8_t pad[16];
+  const uint8_t tag_size = mac_tag_size(ctx);
+
+  mac_begin(ctx, keys);
+
+  {
+    uint32_t ordered_len = htole32(len);
+    memcpy(buffer, &ordered_len, 4);
+    buff_used = 4;
+  }
+  buffered_action(ctx->cipher_state, buffer, buff_used, BUFFERED_ENCDEC);
+  mac_update(ctx, buffer, buff_used);
+
+  /* Size tag, as in signed_send(). */
+  if(len > 1024) {
+    mac_finish(ctx, &buffer[buff_used]);
+    buffered_action(ctx->cipher_state, &buffer[buff_used], tag_size, BUFFERED_ENCDEC);
+    mac_restart(ctx, keys);
+    buff_used += tag_size;
+  }
+
+  /* The pad of the final tag precedes the message in the stream, so that the
+   * receiver can take it before knowing whether the message is genuine. */
+  buffered_action(ctx->cipher_state, pad, tag_size, BUFFERED_EXTRACT);
+
+  /* Encrypt, sign and send in chunks. */
+  for(;;) {
+    uint16_t to_copy = min(len - processed_count, WORK_BUFFER_SIZE - buff_used);
+
+    memcpy(&buffer[buff_used], msg_buff + processed_count, to_copy);
+    buffered_action(ctx->cipher_state, &buffer[buff_used], to_copy, BUFFERED_ENCDEC);
+    mac_update(ctx, &buffer[buff_used], to_copy);
+
+    processed_count += to_copy;
+    buff_used += to_copy;
+
+    if(processed_count == len)
+      break;
+
+    ctx->io_callback(send_param, buffer, buff_used);
+    buff_used = 0;
+  }
+
+  /* Then the tag, in the same buffer if it fits. */
+  if(WORK_BUFFER_SIZE - buff_used < tag_size) {
+    ctx->io_callback(send_param, buffer, buff_used);
+    buff_used = 0;
+  }
+  mac_finish(ctx, &buffer[buff_used]);
+  memxor(&buffer[buff_used], pad, tag_size);
+  buff_used += tag_size;
+
+  ctx->io_callback(send_param, buffer, buff_used);
+}
+
+/** Receives a tag and compares it to the MAC masked with pad. */
+static int
+etm_verify(signer_context *ctx, void *recv_param, const uint8_t *pad)
+{
+  uint8_t mac_recv[16];
+  uint8_t mac_calc[16];
+  uint8_t diff = 0;
+  const uint8_t size = mac_tag_size(ctx);
+  int i;
+
+  ctx->io_callback(recv_param, mac_recv, size);
+  mac_finish(ctx, mac_calc);
+
+  for(i = 0; i < size; ++i)
+    diff |= mac_recv[i] ^ mac_calc[i] ^ pad[i];
+
+  return diff == 0;
+}
+
+/** Encrypt-then-MAC version of signed_recv(). */
+static SignerReceiveStatus
+etm_recv(signer_context *ctx, void *recv_param, uint8_t **buffer, uint32_t *size)
+{
+  uint8_t keys[POLY1305_KEYS_SIZE];
+  uint8_t pad[16];
+  const uint8_t tag_size = mac_tag_size(ctx);
+  *buffer = NULL;
+
+  mac_begin(ctx, keys);
+
+  ctx->io_callback(recv_param, (uint8_t*)size, 4);
+  mac_update(ctx, (uint8_t*)size, 4);
+  buffered_action(ctx->cipher_state, (uint8_t*)size, 4, BUFFERED_ENCDEC);
+
+  *size = le32toh(*size);
+  if(*size > 1024) {
+      buffered_action(ctx->cipher_state, pad, tag_size, BUFFERED_EXTRACT);
+      if(!etm_verify(ctx, recv_param, pad))
+	return SIGNER_RECV_VERIFY_FAILED;
+
+      mac_restart(ctx, keys);
+  }
+
+  buffered_action(ctx->cipher_state, pad, tag_size, BUFFERED_EXTRACT);
+
+  *buffer = malloc(*size);
+  if(!*buffer)
+    return SIGNER_ALLOC_FAILED;
+
+  {
+      uint32_t received = 0;
+
+      /* The ciphertext is hashed as it arrives, while the next chunk is
+       * still in transit. */
+      while(received < *size) {
+	  uint8_t *ptr = *buffer + received;
+	  uint16_t to_recv = min(WORK_BUFFER_SIZE, *size - received);
+	  ctx->io_callback(recv_param, ptr, to_recv);
+	  received += to_recv;
+
+	  mac_update(ctx, ptr, to_recv);
+      }
+  }
+
+  /* Forgeries are rejected without spending time decrypting them. */
+  if(!etm_verify(ctx, recv_param, pad)) {
+      free(*buffer);
+      *buffer = NULL;
+      return SIGNER_RECV_VERIFY_FAILED;
+  }
+
+  buffered_action(ctx->cipher_state, *buffer, *size, BUFFERED_ENCDEC);
+
+  return SIGNER_RECV_SUCCESS;
+}
+
+void
+signed_send(signer_context *ctx, void *send_param, const uint8_t *msg_buff, uint32_t len)
+{
+  if(ctx->mode == SIGNER_ENCRYPT_THEN_MAC)
+    etm_send(ctx, send_param, msg_buff, len);
+  else
+    mte_send(ctx, send_param, msg_buff, len);
+}
+
+SignerReceiveStatus
+signed_recv(signer_context *ctx, void *recv_param, uint8_t **buffer, uint32_t *size)
+{
+  if(ctx->mode == SIGNER_ENCRYPT_THEN_MAC)
+    return etm_recv(ctx, recv_param, buffer, size);
+  return mte_recv(ctx, recv_param, buffer, size);
+}
@@ -2,9 +2,36 @@
 
 #include "buffered.h"
 #include "umac.h"
+#include "poly1305.h"
+#include "siphash.h"
 
 typedef void (*io_callback_func)(void *parameter, uint8_t *buffer, uint16_t len);
 
+/** How the cipher and the authenticator are combined. Both peers must use the
+ * same mode. */
+typedef enum
+{
+  /** The plaintext is signed, then plaintext and tag are encrypted. */
+  SIGNER_MAC_THEN_ENCRYPT = 0,
+  /** The ciphertext is signed, and the tag is masked with a pad from the
+   * cipher stream, so the receiver verifies a message before decrypting it.
+   * The stream is used in this order: the one-time keys of the authenticator,
+   * if any, the header, the pad of the size tag, if any, the pad of the final
+   * tag, then the message. */
+  SIGNER_ENCRYPT_THEN_MAC
+} signer_mode;
+
+/** Authenticator used by a signer. */
+typedef enum
+{
+  /** UHASH with a key set up once, as UMAC without the nonce pad. */
+  SIGNER_MAC_UHASH = 0,
+  /** Poly1305 with one-time keys extracted from the cipher stream. */
+  SIGNER_MAC_POLY1305,
+  /** SipHash with a key set up once; the cheapest for short messages. */
+  SIGNER_MAC_SIPHASH
+} signer_mac_type;
+
 typedef struct
 {
   buffered_state *cipher_state;
@@ -12,8 +39,22 @@ typedef struct
   /** Either low-level sending or receiving function. */
   io_callback_func io_callback;
 
+  signer_mode mode;
+  signer_mac_type mac_type;
+
+  /** Used if mac_type is SIGNER_MAC_UHASH. */
   uhash_key *mac_key;
   uhash_state *mac_state;
+
+  /** Used if mac_type is SIGNER_MAC_POLY1305. The keys are taken from the
+   * cipher stream at the start of each message, 2 * POLY1305_KEY_SIZE bytes,
+   * before the message header: the first key signs the header, and the second
+   * the message body. */
+  poly1305_state *poly1305;
+
+  /** Used if mac_type is SIGNER_MAC_SIPHASH. */
+  siphash_key *sip_key;
+  siphash_state *sip_state;
 } signer_context;
 
 typedef enum
@@ -29,6 +70,13 @@ typedef enum
 void signed_send(signer_context *ctx, void *send_param, const uint8_t *buffer, uint32_t len);
 
 /** Receive, decrypt and verify a buffer sent via socket.
+ *
+ * In SIGNER_ENCRYPT_THEN_MAC mode, the message is only decrypted after its tag
+ * is verified. The ciphertext is hashed chunk by chunk as it arrives, but the
+ * decryption is not overlapped with that: it is a single pass over the whole
+ * message once the tag is checked, so that forgeries cost no decryption.
+ * After a verification failure, the context is out of sync with the sender and
+ * must not be used again.
  *
  * @param buffer A pointer to where to store the address of the newly allocated buffer
  * containing the received message. Must be freed with free().
@@ -0,0 +1,240 @@
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include "util.h"
+#include "buffered.h"
+
+#include "random.h"
+
+/** Size of the keystream buffer of each thread. */
+#define RANDOM_BUFFER_SIZE 4096
+
+#define KEY_SIZE 32
+
+/* The keystream is made of SALSA20_LANES streams of the same key, with IVs
+ * 0, 1..., generated together by buffered_action_batch(), that computes them
+ * in parallel lanes. */
+
+typedef struct
+{
+  salsa20_buffered_state streams[SALSA20_LANES];
+  /** Keystream, of which the last available bytes are not yet used; the
+   * used ones are zeroed. */
+  uint8_t buffer[RANDOM_BUFFER_SIZE];
+  size_t available;
+  /** Bytes generated since the last reseed. */
+  uint64_t generated;
+  /** Value of fork_generation when seeded. */
+  unsigned fork_generation;
+  int seeded;
+} random_state;
+
+static __thread random_state tls_state;
+
+/** Incremented in the child of every fork(). */
+static unsigned fork_generation;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+static void
+child_after_fork(void)
+{
+  __atomic_add_fetch(&fork_generation, 1, __ATOMIC_RELAXED);
+}
+
+static void
+register_atfork(void)
+{
+  pthread_atfork(NULL, NULL, child_after_fork);
+}
+
+/** Reads bytes from the operating system's generator. */
+static int
+os_random(uint8_t *buf, size_t len)
+{
+  while(len)
+    {
+      ssize_t ret = getrandom(buf, len, 0);
+      if(ret < 0)
+	{
+	  if(errno == EINTR)
+	    continue;
+	  if(errno == ENOSYS)
+	    break;
+	  return errno;
+	}
+      buf += ret;
+      len -= ret;
+    }
+
+  /* Kernels older than 3.17. */
+  if(len)
+    {
+      int fd = open("/dev/urandom", O_RDONLY);
+      if(fd < 0)
+	return errno;
+      while(len)
+	{
+	  ssize_t ret = read(fd, buf, len);
+	  if(ret <= 0)
+	    {
+	      int err = ret < 0 ? errno : EIO;
+	      if(err == EINTR)
+		continue;
+	      close(fd);
+	      return err;
+	    }
+	  buf += ret;
+	  len -= ret;
+	}
+      close(fd);
+    }
+
+  return 0;
+}
+
+/** Splits a buffer among the streams. */
+static void
+split_jobs(random_state *rs, uint8_t *stream, size_t len, buffered_job *jobs)
+{
+  const size_t part = len / SALSA20_LANES;
+  size_t l;
+
+  for(l = 0; l < SALSA20_LANES; ++l)
+    {
+      jobs[l].state = &rs->streams[l].header;
+      jobs[l].stream = stream + l * part;
+      jobs[l].len = l + 1 < SALSA20_LANES ? part : len - l * part;
+      jobs[l].op = BUFFERED_EXTRACT;
+    }
+}
+
+/** Generates keystream from a key: first out_len bytes into out, then the
+ * buffer, whose first bytes are kept as the next key. The cipher states are
+ * erased, so only the next key remains. */
+static void
+generate(random_state *rs, const uint8_t *key, uint8_t *out, size_t out_len)
+{
+  buffered_job jobs[SALSA20_LANES];
+  salsa20_master_state master;
+  /* Copy, for alignment. */
+  uint32_t aligned[KEY_SIZE / 4];
+  uint32_t iv[2] = {0, 0};
+  size_t l;
+
+  memcpy(aligned, key, KEY_SIZE);
+  salsa20_init_key(&master, SALSA20_12, (uint8_t *)aligned, SALSA20_256_BITS);
+  for(l = 0; l < SALSA20_LANES; ++l)
+    {
+      buffered_init_header(&rs->streams[l].header, SALSA20);
+      iv[0] = l;
+      salsa20_init_iv(&rs->streams[l].state, &master, (const uint8_t *)iv);
+    }
+
+  if(out_len)
+    {
+      split_jobs(rs, out, out_len, jobs);
+      buffered_action_batch(jobs, SALSA20_LANES);
+    }
+  split_jobs(rs, rs->buffer, RANDOM_BUFFER_SIZE, jobs);
+  buffered_action_batch(jobs, SALSA20_LANES);
+  rs->available = RANDOM_BUFFER_SIZE - KEY_SIZE;
+
+  memset(rs->streams, 0, sizeof rs->streams);
+  memset(&master, 0, sizeof master);
+  memset(aligned, 0, sizeof aligned);
+}
+
+/** Rekeys with the key at the start of the buffer. */
+static void
+refill(random_state *rs, uint8_t *out, size_t out_len)
+{
+  uint8_t key[KEY_SIZE];
+
+  memcpy(key, rs->buffer, KEY_SIZE);
+  generate(rs, key, out, out_len);
+  memset(key, 0, KEY_SIZE);
+}
+
+/** Rekeys with fresh bytes from the operating system, mixed with the current
+ * key, if any. */
+static int
+reseed(random_state *rs)
+{
+  uint8_t key[KEY_SIZE];
+  int ret;
+
+  pthread_once(&atfork_once, register_atfork);
+
+  ret = os_random(key, KEY_SIZE);
+  if(ret)
+    return ret;
+  if(rs->seeded)
+    memxor(key, rs->buffer, KEY_SIZE);
+
+  generate(rs, key, NULL, 0);
+  memset(key, 0, KEY_SIZE);
+
+  rs->generated = 0;
+  rs->fork_generation = __atomic_load_n(&fork_generation, __ATOMIC_RELAXED);
+  rs->seeded = 1;
+
+  return 0;
+}
+
+/** Hands out bytes from the buffer, erasing them. */
+static size_t
+take(random_state *rs, uint8_t *buf, size_t len)
+{
+  uint8_t *src = rs->buffer + RANDOM_BUFFER_SIZE - rs->available;
+
+  len = min(len, rs->available);
+  memcpy(buf, src, len);
+  memset(src, 0, len);
+  rs->available -= len;
+
+  return len;
+}
+
+int
+estream_random(uint8_t *buf, size_t len)
+{
+  random_state *rs = &tls_state;
+
+  if(!rs->seeded || rs->generated >= RANDOM_RESEED_INTERVAL
+     || rs->fork_generation != __atomic_load_n(&fork_generation, __ATOMIC_RELAXED))
+    {
+      int ret = reseed(rs);
+      if(ret)
+	return ret;
+    }
+  rs->generated += len;
+
+  /* Big requests are generated straight into buf. */
+  if(len >= RANDOM_BUFFER_SIZE)
+    {
+      refill(rs, buf, len);
+      return 0;
+    }
+
+  while(len)
+    {
+      size_t done;
+
+      if(!rs->available)
+	refill(rs, NULL, 0);
+      done = take(rs, buf, len);
+      buf += done;
+      len -= done;
+    }
+
+  return 0;
+}
+
+void
+estream_random_wipe(void)
+{
+  memset(&tls_state, 0, sizeof tls_state);
+}
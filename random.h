@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <inttypes.h>
+
+/* Cryptographically secure pseudo-random generator.
+ *
+ * Each thread has its own Salsa20/12 keystream, seeded from getrandom(),
+ * so no lock is taken and a call is little more than a memcpy() from a
+ * keystream buffer. Every time the buffer is refilled, its first 32 bytes
+ * become the next key, and the bytes handed out are erased from it, so the
+ * state of a thread never reveals what it generated before ("fast key
+ * erasure"). The key is mixed with fresh bytes from getrandom() after every
+ * RANDOM_RESEED_INTERVAL bytes generated, and in the child of every fork(),
+ * so parent and child never share output. */
+
+/** How many bytes are generated between reseeds. */
+#define RANDOM_RESEED_INTERVAL (16u << 20)
+
+/** Fills a buffer with random bytes.
+ *
+ * Suitable for keys, nonces, IVs and padding. May be called from any thread
+ * without locking.
+ *
+ * @returns 0 on success, or the errno value of the failure to read the seed
+ * from the operating system, in which case buf is left unfilled.
+ */
+int estream_random(uint8_t *buf, size_t len);
+
+/** Erases the generator state of the calling thread.
+ *
+ * Call it before the thread exits, so that its state does not linger in
+ * memory. The thread may still use estream_random() later, which seeds it
+ * again.
+ */
+void estream_random_wipe(void);
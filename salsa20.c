@@ -105,6 +105,115 @@ salsa20_hash(char drounds, const uint32_t *in, uint32_t *out)
     out[i] += in[i];
 }
 
+/* Multi-lane version of the hash, computing SALSA20_LANES independent
+ * inputs at once. Lanes are the innermost index, so that each word of the
+ * state of all lanes fits a vector register. */
+
+#if defined(__SSE2__) && SALSA20_LANES == 4
+#include <emmintrin.h>
+
+#define ROTL_V(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+
+#define QUARTERROUND_V(a, b, c, d) do {				\
+    b = _mm_xor_si128(b, ROTL_V(_mm_add_epi32(a, d), 7));	\
+    c = _mm_xor_si128(c, ROTL_V(_mm_add_epi32(b, a), 9));	\
+    d = _mm_xor_si128(d, ROTL_V(_mm_add_epi32(c, b), 13));	\
+    a = _mm_xor_si128(a, ROTL_V(_mm_add_epi32(d, c), 18));	\
+  } while(0)
+
+/* The words are kept in local variables, so that the compiler can keep most
+ * of them in registers, which it does not for an array. */
+static void
+salsa20_hash_lanes(char drounds, uint32_t x[16][SALSA20_LANES])
+{
+  __m128i x0 = _mm_loadu_si128((__m128i *)x[0]), x1 = _mm_loadu_si128((__m128i *)x[1]);
+  __m128i x2 = _mm_loadu_si128((__m128i *)x[2]), x3 = _mm_loadu_si128((__m128i *)x[3]);
+  __m128i x4 = _mm_loadu_si128((__m128i *)x[4]), x5 = _mm_loadu_si128((__m128i *)x[5]);
+  __m128i x6 = _mm_loadu_si128((__m128i *)x[6]), x7 = _mm_loadu_si128((__m128i *)x[7]);
+  __m128i x8 = _mm_loadu_si128((__m128i *)x[8]), x9 = _mm_loadu_si128((__m128i *)x[9]);
+  __m128i x10 = _mm_loadu_si128((__m128i *)x[10]), x11 = _mm_loadu_si128((__m128i *)x[11]);
+  __m128i x12 = _mm_loadu_si128((__m128i *)x[12]), x13 = _mm_loadu_si128((__m128i *)x[13]);
+  __m128i x14 = _mm_loadu_si128((__m128i *)x[14]), x15 = _mm_loadu_si128((__m128i *)x[15]);
+  int i;
+
+  for(i = 0; i < drounds; ++i)
+    {
+      /* Column round. */
+      QUARTERROUND_V(x0, x4, x8, x12);
+      QUARTERROUND_V(x5, x9, x13, x1);
+      QUARTERROUND_V(x10, x14, x2, x6);
+      QUARTERROUND_V(x15, x3, x7, x11);
+
+      /* Row round. */
+      QUARTERROUND_V(x0, x1, x2, x3);
+      QUARTERROUND_V(x5, x6, x7, x4);
+      QUARTERROUND_V(x10, x11, x8, x9);
+      QUARTERROUND_V(x15, x12, x13, x14);
+    }
+
+#define ADD_STORE(n) \
+  _mm_storeu_si128((__m128i *)x[n], _mm_add_epi32(x##n, _mm_loadu_si128((__m128i *)x[n])))
+
+  ADD_STORE(0); ADD_STORE(1); ADD_STORE(2); ADD_STORE(3);
+  ADD_STORE(4); ADD_STORE(5); ADD_STORE(6); ADD_STORE(7);
+  ADD_STORE(8); ADD_STORE(9); ADD_STORE(10); ADD_STORE(11);
+  ADD_STORE(12); ADD_STORE(13); ADD_STORE(14); ADD_STORE(15);
+
+#undef ADD_STORE
+}
+
+#undef QUARTERROUND_V
+#undef ROTL_V
+
+#else
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static inline void
+quarterround_lanes(uint32_t x[16][SALSA20_LANES], int a, int b, int c, int d)
+{
+  int l;
+  for(l = 0; l < SALSA20_LANES; ++l)
+    {
+      x[b][l] ^= ROTL(x[a][l] + x[d][l], 7);
+      x[c][l] ^= ROTL(x[b][l] + x[a][l], 9);
+      x[d][l] ^= ROTL(x[c][l] + x[b][l], 13);
+      x[a][l] ^= ROTL(x[d][l] + x[c][l], 18);
+    }
+}
+
+#undef ROTL
+
+static void
+salsa20_hash_lanes(char drounds, uint32_t x[16][SALSA20_LANES])
+{
+  uint32_t in[16][SALSA20_LANES];
+  int i, l;
+
+  memcpy(in, x, sizeof(in));
+
+  for(i = 0; i < drounds; ++i)
+    {
+      /* Column round. */
+      quarterround_lanes(x, 0, 4, 8, 12);
+      quarterround_lanes(x, 5, 9, 13, 1);
+      quarterround_lanes(x, 10, 14, 2, 6);
+      quarterround_lanes(x, 15, 3, 7, 11);
+
+      /* Row round. */
+      quarterround_lanes(x, 0, 1, 2, 3);
+      quarterround_lanes(x, 5, 6, 7, 4);
+      quarterround_lanes(x, 10, 11, 8, 9);
+      quarterround_lanes(x, 15, 12, 13, 14);
+    }
+
+  for(i = 0; i < 16; ++i)
+    for(l = 0; l < SALSA20_LANES; ++l)
+      x[i][l] += in[i][l];
+}
+
+#endif
+
 void
 salsa20_init_key(salsa20_master_state *state, salsa20_variant variant,
 		 const uint8_t *key, salsa20_key_size key_size)
@@ -162,6 +271,17 @@ salsa20_set_counter(salsa20_state *state, uint64_t counter)
 #endif
 }
 
+uint64_t
+salsa20_get_counter(const salsa20_state *state)
+{
+#ifdef LITTLE_ENDIAN
+  return state->hash_input.bit64[4];
+#else
+  return (uint64_t)state->hash_input.bit32[9] << 32
+    | state->hash_input.bit32[8];
+#endif
+}
+
 void
 salsa20_extract(salsa20_state *state, uint8_t *stream)
 {
@@ -182,3 +302,83 @@ salsa20_extract(salsa20_state *state, uint8_t *stream)
     }
 #endif
 }
+
+void
+salsa20_extract_lanes(salsa20_state *const states[], uint8_t *const streams[],
+		      size_t count)
+{
+  uint32_t x[16][SALSA20_LANES];
+  size_t i, l;
+
+  /* Unused lanes just repeat the first one. */
+  for(i = 0; i < 16; ++i)
+    for(l = 0; l < SALSA20_LANES; ++l)
+      x[i][l] = states[l < count ? l : 0]->hash_input.bit32[i];
+
+  salsa20_hash_lanes(states[0]->variant, x);
+
+  for(l = 0; l < count; ++l)
+    {
+      for(i = 0; i < 16; ++i)
+	unpack_littleendian(x[i][l], &streams[l][i*4]);
+
+      salsa20_set_counter(states[l], salsa20_get_counter(states[l]) + 1);
+    }
+}
+
+/* HSalsa20 output positions. The hash adds the input to the state after the
+ * rounds, so the input is subtracted back. */
+static const uint8_t hsalsa_words[8] = {0, 5, 10, 15, 6, 7, 8, 9};
+
+static void
+hsalsa_input(const salsa20_master_state *master, const uint8_t *input, uint32_t *in)
+{
+  int i;
+
+  memcpy(in, master->incomplete_state.hash_input.bit32, 64);
+  for(i = 0; i < 4; ++i)
+    in[6 + i] = pack_littleendian(input + i*4);
+}
+
+void
+salsa20_hsalsa(const salsa20_master_state *master, const uint8_t *input,
+	       uint8_t *out)
+{
+  uint32_t in[16], x[16];
+  int i;
+
+  hsalsa_input(master, input, in);
+  salsa20_hash(master->incomplete_state.variant, in, x);
+
+  for(i = 0; i < 8; ++i)
+    {
+      const int w = hsalsa_words[i];
+      unpack_littleendian(x[w] - in[w], &out[i*4]);
+    }
+}
+
+void
+salsa20_hsalsa_lanes(const salsa20_master_state *const masters[],
+		     const uint8_t *const inputs[], uint8_t *const outs[],
+		     size_t count)
+{
+  uint32_t in[SALSA20_LANES][16];
+  uint32_t x[16][SALSA20_LANES];
+  size_t i, l;
+
+  /* Unused lanes just repeat the first one. */
+  for(l = 0; l < SALSA20_LANES; ++l)
+    hsalsa_input(masters[l < count ? l : 0], inputs[l < count ? l : 0], in[l]);
+  for(i = 0; i < 16; ++i)
+    for(l = 0; l < SALSA20_LANES; ++l)
+      x[i][l] = in[l][i];
+
+  salsa20_hash_lanes(masters[0]->incomplete_state.variant, x);
+
+  for(l = 0; l < count; ++l)
+    for(i = 0; i < 8; ++i)
+      {
+	const int w = hsalsa_words[i];
+	unpack_littleendian(x[w][l] - in[l][w], &outs[l][i*4]);
+      }
+}
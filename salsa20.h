@@ -3,6 +3,7 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <inttypes.h>
 
 typedef enum {
@@ -86,6 +87,16 @@ void salsa20_init_iv(salsa20_state *iv_state, const salsa20_master_state *master
  */
 void salsa20_set_counter(salsa20_state *state, uint64_t counter);
 
+/** Gets what chunk of the stream will be generated next.
+ *
+ * The inverse of salsa20_set_counter().
+ *
+ * @param state The state whose counter will be read.
+ * @returns The index of the 64-byte chunk to be generated by the next
+ * call to salsa20_extract().
+ */
+uint64_t salsa20_get_counter(const salsa20_state *state);
+
 /** Calculates the next hash output of the algorithm.
  *
  * Also increments the internal counter, so that successive calls generates
@@ -96,3 +107,47 @@ void salsa20_set_counter(salsa20_state *state, uint64_t counter);
  * Must be 4 byte aligned.
  */
 void salsa20_extract(salsa20_state *state, uint8_t *stream);
+
+/** How many states salsa20_extract_lanes() can process at once. */
+#define SALSA20_LANES 4
+
+/** Calculates the next hash output of many independent states at once.
+ *
+ * Equivalent to calling salsa20_extract() on each state, but the states are
+ * processed together, in parallel lanes.
+ *
+ * @param states Up to SALSA20_LANES states, all of the same variant.
+ * @param streams For each state, a 64 byte buffer where the generated stream
+ * will be stored. Must be 4 byte aligned.
+ * @param count How many states there are, from 1 to SALSA20_LANES.
+ */
+void salsa20_extract_lanes(salsa20_state *const states[], uint8_t *const streams[],
+			   size_t count);
+
+/** Computes HSalsa20, the core used to derive the subkeys of XSalsa20.
+ *
+ * The 16 bytes of input take the place of the IV and counter, and the output
+ * is taken from the words of the state after the rounds, without the final
+ * addition of the input, at positions 0, 5, 10, 15 and 6 to 9. With a
+ * SALSA20_20 master state, this is the standard HSalsa20; with the others, the
+ * same with fewer rounds.
+ *
+ * @param master The master state, initialized with the key.
+ * @param input 16 bytes of input; needs no alignment.
+ * @param out Where to store the 32 bytes of output; needs no alignment.
+ */
+void salsa20_hsalsa(const salsa20_master_state *master, const uint8_t *input,
+		    uint8_t *out);
+
+/** Computes HSalsa20 of many independent keys and inputs at once.
+ *
+ * Equivalent to calling salsa20_hsalsa() for each, in parallel lanes.
+ *
+ * @param masters Up to SALSA20_LANES master states, all of the same variant.
+ * @param inputs For each master state, 16 bytes of input.
+ * @param outs For each master state, where to store the 32 bytes of output.
+ * @param count How many there are, from 1 to SALSA20_LANES.
+ */
+void salsa20_hsalsa_lanes(const salsa20_master_state *const masters[],
+			  const uint8_t *const inputs[], uint8_t *const outs[],
+			  size_t count);
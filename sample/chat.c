@@ -5,7 +5,6 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
-#include <time.h>
 #include <errno.h>
 #include <pthread.h>
 #include <assert.h>
@@ -18,6 +17,7 @@
 #include <arpa/inet.h>
 
 #include "protocol.h"
+#include "random.h"
 
 int listening = 0;
 struct sockaddr_in addr;
@@ -137,16 +137,52 @@ typedef struct {
     signer_context signer;
 } full_context;
 
-static void signer_setup(full_context *ctx, io_callback_func func)
+static void signer_setup(full_context *ctx, io_callback_func func, signer_mode mode)
 {
   ctx->signer.cipher_state = (buffered_state *)&ctx->buffered;
   ctx->signer.io_callback = func;
+  ctx->signer.mode = mode;
+  ctx->signer.mac_type = SIGNER_MAC_UHASH;
+  ctx->signer.poly1305 = NULL;
+  ctx->signer.sip_key = NULL;
+  ctx->signer.sip_state = NULL;
   ctx->signer.mac_key = (uhash_key *)&ctx->uhash_key;
   ctx->signer.mac_state = (uhash_state *)&ctx->uhash_state;
 
   uhash_key_setup(UHASH_64, ctx->signer.mac_key, ctx->signer.cipher_state);
 }
 
+/** Capability bits exchanged by the peers. */
+#define CAPABILITY_ENCRYPT_THEN_MAC 1u
+
+/** Exchanges capabilities with the peer, and picks encrypt-then-MAC if both
+ * support it. The exchange is not authenticated, but tampering with it can
+ * only downgrade to MAC-then-encrypt, that is as secure, only slower to
+ * reject forgeries. */
+static signer_mode negotiate_mode()
+{
+  uint8_t ours = CAPABILITY_ENCRYPT_THEN_MAC;
+  uint8_t theirs;
+  ssize_t ret;
+
+  ret = write(sock, &ours, 1);
+  if(ret != 1) {
+    perror("Error sending capabilities");
+    exit(EXIT_FAILURE);
+  }
+  ret = read(sock, &theirs, 1);
+  if(ret != 1) {
+    if(ret < 0)
+      perror("Error receiving capabilities");
+    else
+      fputs("Connection closed before capabilities were received.\n", stderr);
+    exit(EXIT_FAILURE);
+  }
+
+  return (ours & theirs & CAPABILITY_ENCRYPT_THEN_MAC)
+    ? SIGNER_ENCRYPT_THEN_MAC : SIGNER_MAC_THEN_ENCRYPT;
+}
+
 static void *receiver_loop(full_context *inbound)
 {
   uint8_t *ptr;
@@ -186,31 +222,17 @@ static void run_communication()
     sosemanuk_master_state master_state;
     sosemanuk_init_key(&master_state, key, 128);
 
-    /* Generate an outbound IV based on remote peer address,
-     * then send and setup state. */
+    /* Generate a random outbound IV, then send and setup state. */
     {
-      unsigned int seed = time(NULL);
-      int i;
-      int size;
       uint32_t iv[4];
+      int err;
 
-      /* Dirty trick to read the address as unsigned ints. */
-      union {
-        struct sockaddr_in addr;
-        unsigned int ints[1];
-      } accessor;
-
-      accessor.addr = addr;
-
-      size = 1 + ((sizeof(struct sockaddr_in) - 1) / sizeof(unsigned int));
-      for(i = 0; i < size; ++i) {
-        seed += accessor.ints[i];
+      err = estream_random((uint8_t*)iv, 16);
+      if(err) {
+	fprintf(stderr, "Error generating IV: %s\n", strerror(err));
+	exit(EXIT_FAILURE);
       }
 
-      srand(seed);
-      for(i = 0; i < 4; ++i)
-	iv[i] = htole32(rand());
-
       ret = write(sock, iv, 16);
       assert(ret == 16);
       buffered_init_header(&outbound.buffered.header, SOSEMANUK);
@@ -228,8 +250,11 @@ static void run_communication()
   }
 
   /* Setup UHASH and the signers. */
-  signer_setup(&inbound, (io_callback_func)my_read);
-  signer_setup(&outbound, (io_callback_func)my_send);
+  {
+    signer_mode mode = negotiate_mode();
+    signer_setup(&inbound, (io_callback_func)my_read, mode);
+    signer_setup(&outbound, (io_callback_func)my_send, mode);
+  }
 
   /* Wait for messages in another thread. */
   pthread_create(&receiver_thread, NULL, (void *(*)(void *))receiver_loop, &inbound);
@@ -0,0 +1,184 @@
+/* Builds a key store from a list of keys.
+ *
+ * Reads from the standard input one key per line, as "<id> <kind> <hex key>",
+ * where kind is one of "sosemanuk" (16 to 32 bytes of key), "salsa20"
+ * (Salsa20/12, 16 or 32 bytes) or "uhash32" to "uhash128" (32 bytes, expanded
+ * from the Salsa20/12 keystream of the key with a zero IV). Empty lines and
+ * lines starting with '#' are ignored. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "keystore.h"
+
+typedef union
+{
+  sosemanuk_master_state sosemanuk;
+  salsa20_master_state salsa20;
+  uhash_32_key uhash_32;
+  uhash_64_key uhash_64;
+  uhash_96_key uhash_96;
+  uhash_128_key uhash_128;
+} any_key;
+
+static const char *const kind_names[KEYSTORE_KIND_COUNT] = {
+  "sosemanuk", "salsa20", "uhash32", "uhash64", "uhash96", "uhash128"
+};
+
+/** Parses up to max bytes of hex, returns how many, or -1 if invalid. */
+static int parse_hex(const char *str, uint8_t *out, size_t max)
+{
+  size_t i, len = strlen(str);
+
+  if(len % 2 || len / 2 > max)
+    return -1;
+
+  for(i = 0; i < len / 2; ++i) {
+    unsigned int val;
+    if(sscanf(str + 2*i, "%2x", &val) != 1
+       || !strchr("0123456789abcdefABCDEF", str[2*i])
+       || !strchr("0123456789abcdefABCDEF", str[2*i + 1]))
+      return -1;
+    out[i] = val;
+  }
+
+  return len / 2;
+}
+
+static int expand_key(keystore_kind kind, const uint8_t *raw, int len, any_key *key)
+{
+  /* Copy, for alignment. */
+  uint32_t aligned[8];
+
+  memcpy(aligned, raw, len);
+
+  switch(kind) {
+  case KEYSTORE_SOSEMANUK_MASTER:
+    if(len < 16)
+      return 0;
+    sosemanuk_init_key(&key->sosemanuk, (uint8_t *)aligned, len * 8);
+    break;
+  case KEYSTORE_SALSA20_MASTER:
+    if(len != 16 && len != 32)
+      return 0;
+    salsa20_init_key(&key->salsa20, SALSA20_12, (uint8_t *)aligned,
+		     len == 16 ? SALSA20_128_BITS : SALSA20_256_BITS);
+    break;
+  default:
+    {
+      salsa20_buffered_state kdf = salsa20_static_initializer;
+      salsa20_master_state master;
+      const uint32_t iv[2] = {0, 0};
+
+      if(len != 32)
+	return 0;
+      salsa20_init_key(&master, SALSA20_12, (uint8_t *)aligned, SALSA20_256_BITS);
+      salsa20_init_iv(&kdf.state, &master, (const uint8_t *)iv);
+      uhash_key_setup(kind - KEYSTORE_UHASH_32, (uhash_key *)key, &kdf.header);
+    }
+  }
+
+  return 1;
+}
+
+static int read_nonce(uint8_t *nonce)
+{
+  FILE *f = fopen("/dev/urandom", "rb");
+  int ok;
+
+  if(!f)
+    return 0;
+  ok = fread(nonce, KEYSTORE_NONCE_SIZE, 1, f) == 1;
+  fclose(f);
+
+  return ok;
+}
+
+int main(int argc, char *argv[])
+{
+  keystore_item *items = NULL;
+  any_key *keys = NULL;
+  size_t count = 0, capacity = 0;
+  uint8_t seal_key[KEYSTORE_SEAL_KEY_SIZE];
+  uint8_t nonce[KEYSTORE_NONCE_SIZE];
+  char line[256];
+  int line_no = 0;
+  int ret;
+
+  if(argc < 2 || argc > 3
+     || (argc == 3 && parse_hex(argv[2], seal_key, sizeof seal_key) != sizeof seal_key)) {
+    fprintf(stderr, "Usage:\n  %s <output file> [64 hex digits seal key] < key list\n", argv[0]);
+    return 1;
+  }
+
+  if(argc == 3 && !read_nonce(nonce)) {
+    perror("Error reading /dev/urandom");
+    return 1;
+  }
+
+  while(fgets(line, sizeof line, stdin)) {
+    char kind_name[16], hex[80];
+    unsigned long id;
+    uint8_t raw[32];
+    int kind, len;
+
+    ++line_no;
+    if(line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+      continue;
+
+    if(sscanf(line, "%lu %15s %79s", &id, kind_name, hex) != 3 || id > UINT32_MAX) {
+      fprintf(stderr, "Line %d: invalid format.\n", line_no);
+      return 1;
+    }
+    for(kind = 0; kind < KEYSTORE_KIND_COUNT; ++kind)
+      if(!strcmp(kind_name, kind_names[kind]))
+	break;
+    if(kind == KEYSTORE_KIND_COUNT) {
+      fprintf(stderr, "Line %d: unknown kind \"%s\".\n", line_no, kind_name);
+      return 1;
+    }
+
+    if(count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      items = realloc(items, capacity * sizeof *items);
+      keys = realloc(keys, capacity * sizeof *keys);
+      if(!items || !keys) {
+	fprintf(stderr, "Out of memory.\n");
+	return 1;
+      }
+    }
+
+    len = parse_hex(hex, raw, sizeof raw);
+    if(len < 0 || !expand_key(kind, raw, len, &keys[count])) {
+      fprintf(stderr, "Line %d: invalid key for %s.\n", line_no, kind_name);
+      return 1;
+    }
+    items[count].id = id;
+    items[count].kind = kind;
+    ++count;
+  }
+
+  /* Only now, as keys may have moved while growing. */
+  {
+    size_t i;
+    for(i = 0; i < count; ++i)
+      items[i].key = &keys[i];
+  }
+
+  ret = keystore_write(argv[1], items, count, argc == 3 ? seal_key : NULL, nonce);
+  if(ret) {
+    fprintf(stderr, "Error writing %s: %s\n", argv[1], strerror(ret));
+    return 1;
+  }
+
+  printf("%zu keys written to %s%s.\n", count, argv[1], argc == 3 ? ", sealed" : "");
+
+  memset(keys, 0, count * sizeof *keys);
+  memset(seal_key, 0, sizeof seal_key);
+  free(keys);
+  free(items);
+
+  return 0;
+}
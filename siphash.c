@@ -0,0 +1,182 @@
+#include <string.h>
+#include "util.h"
+
+#include "siphash.h"
+
+#define ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+/* Works on local variables v0 to v3, so that they are kept in registers. */
+#define SIPROUND do {							\
+    v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32);	\
+    v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;				\
+    v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;				\
+    v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32);	\
+  } while(0)
+
+static ALWAYS_INLINE uint64_t
+load64(const uint8_t *m)
+{
+  return pack_littleendian(m) | ((uint64_t)pack_littleendian(m + 4) << 32);
+}
+
+/** Compresses whole words of the message.
+ *
+ * The round counts are constants in each instance below, so the round loops
+ * are unrolled.
+ */
+static ALWAYS_INLINE void
+compress_words(uint64_t *v, const uint8_t *m, size_t words, int c_rounds)
+{
+  uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+  int i;
+
+  for(; words; --words, m += 8)
+    {
+      const uint64_t w = load64(m);
+
+      v3 ^= w;
+      for(i = 0; i < c_rounds; ++i)
+	SIPROUND;
+      v0 ^= w;
+    }
+
+  v[0] = v0; v[1] = v1; v[2] = v2; v[3] = v3;
+}
+
+/** Compresses the last word, with the length, and outputs the tag. */
+static ALWAYS_INLINE void
+finalize_rounds(uint64_t *v, uint64_t last, uint8_t len, uint8_t *tag,
+		int c_rounds, int d_rounds)
+{
+  uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+  const uint64_t w = last | ((uint64_t)len << 56);
+  int i;
+
+  v3 ^= w;
+  for(i = 0; i < c_rounds; ++i)
+    SIPROUND;
+  v0 ^= w;
+
+  v2 ^= 0xff;
+  for(i = 0; i < d_rounds; ++i)
+    SIPROUND;
+
+  v0 ^= v1 ^ v2 ^ v3;
+  unpack_littleendian(v0, tag);
+  unpack_littleendian(v0 >> 32, tag + 4);
+}
+
+static void
+compress_any(siphash_variant variant, uint64_t *v, const uint8_t *m, size_t words)
+{
+  if(variant == SIPHASH_1_3)
+    compress_words(v, m, words, 1);
+  else
+    compress_words(v, m, words, 2);
+}
+
+static void
+finalize(siphash_variant variant, uint64_t *v, uint64_t last, uint8_t len, uint8_t *tag)
+{
+  if(variant == SIPHASH_1_3)
+    finalize_rounds(v, last, len, tag, 1, 3);
+  else
+    finalize_rounds(v, last, len, tag, 2, 4);
+}
+
+/** Loads the last 0 to 7 bytes of a message. */
+static uint64_t
+load_partial(const uint8_t *m, size_t len)
+{
+  uint64_t ret = 0;
+
+  while(len--)
+    ret |= (uint64_t)m[len] << (len * 8);
+
+  return ret;
+}
+
+static void
+init_v(const siphash_key *key, uint64_t *v)
+{
+  v[0] = key->k[0] ^ 0x736f6d6570736575u;
+  v[1] = key->k[1] ^ 0x646f72616e646f6du;
+  v[2] = key->k[0] ^ 0x6c7967656e657261u;
+  v[3] = key->k[1] ^ 0x7465646279746573u;
+}
+
+void
+siphash_key_init(siphash_key *key, siphash_variant variant, const uint8_t *bytes)
+{
+  key->k[0] = load64(bytes);
+  key->k[1] = load64(bytes + 8);
+  key->variant = variant;
+}
+
+void
+siphash_key_setup(siphash_variant variant, siphash_key *key, buffered_state *full_state)
+{
+  uint8_t bytes[SIPHASH_KEY_SIZE];
+
+  buffered_action(full_state, bytes, SIPHASH_KEY_SIZE, BUFFERED_EXTRACT);
+  siphash_key_init(key, variant, bytes);
+}
+
+void
+siphash_init(const siphash_key *key, siphash_state *state)
+{
+  init_v(key, state->v);
+  state->buffer = 0;
+  state->buffer_len = 0;
+  state->total_len = 0;
+  state->variant = key->variant;
+}
+
+void
+siphash_update(siphash_state *state, const uint8_t *input, size_t len)
+{
+  state->total_len += len;
+
+  /* Complete the buffered word. */
+  if(state->buffer_len) {
+    while(len && state->buffer_len < 8) {
+      state->buffer |= (uint64_t)*input++ << (state->buffer_len++ * 8);
+      --len;
+    }
+    if(state->buffer_len < 8)
+      return;
+
+    {
+      uint8_t word[8];
+      unpack_littleendian(state->buffer, word);
+      unpack_littleendian(state->buffer >> 32, word + 4);
+      compress_any(state->variant, state->v, word, 1);
+    }
+    state->buffer = 0;
+    state->buffer_len = 0;
+  }
+
+  compress_any(state->variant, state->v, input, len / 8);
+  input += len & ~(size_t)7;
+  len &= 7;
+
+  state->buffer = load_partial(input, len);
+  state->buffer_len = len;
+}
+
+void
+siphash_finish(siphash_state *state, uint8_t *tag)
+{
+  finalize(state->variant, state->v, state->buffer, state->total_len, tag);
+}
+
+void
+siphash(const siphash_key *key, const uint8_t *input, size_t len, uint8_t *tag)
+{
+  uint64_t v[4];
+
+  init_v(key, v);
+  compress_any(key->variant, v, input, len / 8);
+  finalize(key->variant, v, load_partial(input + (len & ~(size_t)7), len & 7),
+	   len, tag);
+}
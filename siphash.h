@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stddef.h>
+#include <inttypes.h>
+#include "buffered.h"
+
+/** Size of a SipHash key, in bytes. */
+#define SIPHASH_KEY_SIZE 16
+
+/** Size of a SipHash tag, in bytes. */
+#define SIPHASH_TAG_SIZE 8
+
+typedef enum
+{
+  /** The standard SipHash, 2 compression and 4 finalization rounds. */
+  SIPHASH_2_4,
+  /** Faster variant, with 1 compression and 3 finalization rounds. */
+  SIPHASH_1_3
+} siphash_variant;
+
+typedef struct
+{
+  uint64_t k[2];
+  siphash_variant variant;
+} siphash_key;
+
+/** SipHash state. All fields are internal. */
+typedef struct
+{
+  uint64_t v[4];
+  /** Bytes not yet compressed, in little-endian order. */
+  uint64_t buffer;
+  uint8_t buffer_len;
+  /** Length of the message so far, modulo 256. */
+  uint8_t total_len;
+  siphash_variant variant;
+} siphash_state;
+
+/** Sets up a SipHash key from bytes.
+ *
+ * @param key The key to be initialized.
+ * @param variant Which SipHash variant the key will be used with.
+ * @param bytes SIPHASH_KEY_SIZE bytes of key.
+ */
+void siphash_key_init(siphash_key *key, siphash_variant variant, const uint8_t *bytes);
+
+/** Sets up a SipHash key with bytes extracted from a cipher stream. */
+void siphash_key_setup(siphash_variant variant, siphash_key *key, buffered_state *full_state);
+
+/** Starts a new message. The same key can be used for many messages. */
+void siphash_init(const siphash_key *key, siphash_state *state);
+
+/** Adds data to the message being hashed. */
+void siphash_update(siphash_state *state, const uint8_t *input, size_t len);
+
+/** Finishes the message and computes its tag.
+ *
+ * @param tag Where to store the SIPHASH_TAG_SIZE bytes tag, that is the
+ * 64 bits output in little-endian.
+ */
+void siphash_finish(siphash_state *state, uint8_t *tag);
+
+/** Computes the tag of a whole message at once.
+ *
+ * Faster than the streaming interface for the very short messages SipHash is
+ * good for.
+ */
+void siphash(const siphash_key *key, const uint8_t *input, size_t len, uint8_t *tag);
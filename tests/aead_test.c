@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buffered.h"
+#include "aead.h"
+
+static int failed = 0;
+
+static void
+report(const char *name, int errors)
+{
+  if(errors)
+    {
+      printf("%s: %d failed!\n", name, errors);
+      failed = 1;
+    }
+  else
+    printf("%s: ok\n", name);
+}
+
+/* Straightforward two pass implementation of the construction described in
+ * aead.h: encrypt everything, then hash everything. */
+static void
+reference_seal(const uint8_t *key, const uint8_t *nonce,
+	       const uint8_t *ad, size_t adlen,
+	       const uint8_t *in, uint8_t *out, size_t len, uint8_t *tag)
+{
+  static const uint8_t zeros[32] = {0};
+  static uhash_128_key mac_key;
+  uhash_128_state mac_state;
+  salsa20_buffered_state kdf = salsa20_static_initializer;
+  salsa20_buffered_state cipher = salsa20_static_initializer;
+  salsa20_master_state master;
+  uint32_t aligned[8];
+  const uint32_t zero_iv[2] = {0, 0};
+  uint8_t pad[64], lengths[16];
+  int i;
+
+  memcpy(aligned, key, 32);
+  salsa20_init_key(&master, SALSA20_12, (uint8_t *)aligned, SALSA20_256_BITS);
+  salsa20_init_iv(&kdf.state, &master, (const uint8_t *)zero_iv);
+  buffered_action(&kdf.header, (uint8_t *)aligned, 32, BUFFERED_EXTRACT);
+  salsa20_init_key(&master, SALSA20_12, (uint8_t *)aligned, SALSA20_256_BITS);
+  uhash_key_setup(UHASH_128, (uhash_key *)&mac_key, &kdf.header);
+
+  memcpy(aligned, nonce, 8);
+  salsa20_init_iv(&cipher.state, &master, (uint8_t *)aligned);
+  buffered_action(&cipher.header, pad, 64, BUFFERED_EXTRACT);
+  memcpy(out, in, len);
+  buffered_action(&cipher.header, out, len, BUFFERED_ENCDEC);
+
+  for(i = 0; i < 8; ++i)
+    {
+      lengths[i] = (uint64_t)adlen >> (i * 8);
+      lengths[i + 8] = (uint64_t)len >> (i * 8);
+    }
+
+  uhash_init(UHASH_128, (uhash_state *)&mac_state);
+  uhash_update((uhash_key *)&mac_key, (uhash_state *)&mac_state, ad, adlen);
+  uhash_update((uhash_key *)&mac_key, (uhash_state *)&mac_state, zeros, (32 - adlen % 32) % 32);
+  uhash_update((uhash_key *)&mac_key, (uhash_state *)&mac_state, out, len);
+  uhash_update((uhash_key *)&mac_key, (uhash_state *)&mac_state, lengths, 16);
+  uhash_finish((uhash_key *)&mac_key, (uhash_state *)&mac_state, tag);
+
+  for(i = 0; i < 16; ++i)
+    tag[i] ^= pad[i];
+}
+
+static const size_t lengths[] = {0, 1, 31, 32, 100, 4095, 4096, 4097, 10000, 20001};
+#define LENGTHS_COUNT (sizeof(lengths) / sizeof(lengths[0]))
+
+static void
+reference_test(estream_aead_ctx *ctx, const uint8_t *key)
+{
+  static uint8_t msg[20001], ad[100], out[20001], ref_out[20001];
+  uint8_t nonce[ESTREAM_AEAD_NONCE_SIZE];
+  uint8_t tag[16], ref_tag[16];
+  size_t i, j;
+  int errors = 0;
+
+  for(i = 0; i < sizeof(msg); ++i)
+    msg[i] = rand();
+  for(i = 0; i < sizeof(ad); ++i)
+    ad[i] = rand();
+
+  for(i = 0; i < LENGTHS_COUNT; ++i)
+    for(j = 0; j < sizeof(ad); j += 33)
+      {
+	nonce[0] = i;
+	nonce[1] = j;
+
+	estream_aead_seal(ctx, nonce, ad, j, msg, out, lengths[i], tag);
+	reference_seal(key, nonce, ad, j, msg, ref_out, lengths[i], ref_tag);
+
+	errors += memcmp(out, ref_out, lengths[i]) != 0;
+	errors += memcmp(tag, ref_tag, 16) != 0;
+      }
+
+  report("Reference", errors);
+}
+
+static void
+roundtrip_test(estream_aead_ctx *ctx)
+{
+  static uint8_t msg[20001 + 16], buffer[20001 + 16], out[20001];
+  static const uint8_t ad[] = "routing header";
+  const uint8_t nonce[ESTREAM_AEAD_NONCE_SIZE] = {1, 2, 3, 4, 5, 6, 7, 8};
+  uint8_t tag[16];
+  size_t i;
+  int errors = 0;
+
+  for(i = 0; i < sizeof(msg); ++i)
+    msg[i] = rand();
+
+  for(i = 0; i < LENGTHS_COUNT; ++i)
+    {
+      const size_t len = lengths[i];
+
+      /* Detached tag, out of place. */
+      estream_aead_seal(ctx, nonce, ad, sizeof(ad), msg, buffer, len, tag);
+      errors += estream_aead_open(ctx, nonce, ad, sizeof(ad), buffer, out, len, tag)
+	!= ESTREAM_AEAD_SUCCESS;
+      errors += memcmp(out, msg, len) != 0;
+
+      /* In place, with the tag appended. */
+      memcpy(buffer, msg, len);
+      estream_aead_seal(ctx, nonce, ad, sizeof(ad), buffer, buffer, len, buffer + len);
+      errors += memcmp(buffer + len, tag, 16) != 0;
+      errors += estream_aead_open(ctx, nonce, ad, sizeof(ad), buffer, buffer, len, buffer + len)
+	!= ESTREAM_AEAD_SUCCESS;
+      errors += memcmp(buffer, msg, len) != 0;
+    }
+
+  report("Round trip", errors);
+}
+
+static void
+tamper_test(estream_aead_ctx *ctx)
+{
+  static uint8_t msg[5000], sealed[5000], out[5000];
+  uint8_t ad[20] = "routing header";
+  uint8_t nonce[ESTREAM_AEAD_NONCE_SIZE] = {9};
+  uint8_t tag[16];
+  size_t i;
+  int errors = 0;
+
+  for(i = 0; i < sizeof(msg); ++i)
+    msg[i] = rand();
+
+  estream_aead_seal(ctx, nonce, ad, sizeof(ad), msg, sealed, sizeof(msg), tag);
+
+  sealed[4321] ^= 1;
+  errors += estream_aead_open(ctx, nonce, ad, sizeof(ad), sealed, out, sizeof(msg), tag)
+    != ESTREAM_AEAD_VERIFY_FAILED;
+  sealed[4321] ^= 1;
+
+  /* The output must not be released when verification fails. */
+  for(i = 0; i < sizeof(out); ++i)
+    errors += out[i] != 0;
+
+  ad[3] ^= 1;
+  errors += estream_aead_open(ctx, nonce, ad, sizeof(ad), sealed, out, sizeof(msg), tag)
+    != ESTREAM_AEAD_VERIFY_FAILED;
+  ad[3] ^= 1;
+
+  errors += estream_aead_open(ctx, nonce, ad, sizeof(ad) - 1, sealed, out, sizeof(msg), tag)
+    != ESTREAM_AEAD_VERIFY_FAILED;
+
+  tag[15] ^= 0x80;
+  errors += estream_aead_open(ctx, nonce, ad, sizeof(ad), sealed, out, sizeof(msg), tag)
+    != ESTREAM_AEAD_VERIFY_FAILED;
+  tag[15] ^= 0x80;
+
+  nonce[7] = 1;
+  errors += estream_aead_open(ctx, nonce, ad, sizeof(ad), sealed, out, sizeof(msg), tag)
+    != ESTREAM_AEAD_VERIFY_FAILED;
+  nonce[7] = 0;
+
+  errors += estream_aead_open(ctx, nonce, ad, sizeof(ad), sealed, out, sizeof(msg), tag)
+    != ESTREAM_AEAD_SUCCESS;
+
+  report("Tampering", errors);
+}
+
+int main()
+{
+  static estream_aead_128_ctx ctx;
+  uint8_t key[ESTREAM_AEAD_KEY_SIZE];
+  size_t i;
+
+  for(i = 0; i < sizeof(key); ++i)
+    key[i] = i * 3 + 1;
+
+  estream_aead_init(&ctx.header, UHASH_128, key);
+
+  reference_test(&ctx.header, key);
+  roundtrip_test(&ctx.header);
+  tamper_test(&ctx.header);
+
+  if(failed)
+    return 1;
+
+  puts("All tests passed!");
+  return 0;
+}
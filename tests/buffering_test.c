@@ -6,28 +6,257 @@
 #include <time.h>
 #include <string.h>
 #include "buffered.h"
+#include "prefetch.h"
 #include "util.h"
 
 uint8_t stream_a[20000000];
 uint8_t stream_b[20000000];
 
+typedef union
+{
+  buffered_state header;
+  hc128_buffered_state hc128;
+  rabbit_buffered_state rabbit;
+  salsa20_buffered_state salsa20;
+  sosemanuk_buffered_state sosemanuk;
+} any_buffered_state;
+
+static void
+init_any(any_buffered_state *s, cipher_type cipher, const uint8_t *key)
+{
+  buffered_init_header(&s->header, cipher);
+  switch(cipher)
+    {
+    case HC128:
+      hc128_init(&s->hc128.state, key, key + 16);
+      break;
+    case RABBIT:
+      {
+	rabbit_state master;
+	rabbit_init_key(&master, key);
+	rabbit_init_iv(&s->rabbit.state, &master, key + 16);
+      }
+      break;
+    case SALSA20:
+      {
+	salsa20_master_state master;
+	salsa20_init_key(&master, SALSA20_12, key, SALSA20_128_BITS);
+	salsa20_init_iv(&s->salsa20.state, &master, key + 16);
+      }
+      break;
+    case SOSEMANUK:
+      {
+	sosemanuk_master_state master;
+	sosemanuk_init_key(&master, key, 128);
+	sosemanuk_init_iv(&s->sosemanuk.state, &master, key + 16);
+      }
+      break;
+    }
+}
+
+static void
+snapshot_test(const uint8_t *key)
+{
+  static const char *names[] = {"HC-128", "Rabbit", "Salsa20", "Sosemanuk"};
+  static any_buffered_state orig, copy;
+  static uint8_t snap[8192];
+  uint8_t out_a[1000], out_b[1000];
+  int c, mode;
+
+  for(c = 0; c <= LAST_CIPHER; ++c)
+    for(mode = BUFFERED_SNAPSHOT_FULL; mode <= BUFFERED_SNAPSHOT_POSITION; ++mode)
+      {
+	size_t size;
+
+	init_any(&orig, (cipher_type)c, key);
+	buffered_action(&orig.header, out_a, 123 + c * 77, BUFFERED_EXTRACT);
+
+	size = buffered_snapshot(&orig.header, (buffered_snapshot_mode)mode, snap, sizeof(snap));
+	if(c != SALSA20 && mode == BUFFERED_SNAPSHOT_POSITION)
+	  {
+	    if(size)
+	      {
+		printf("%s: position snapshot should be unsupported!\n", names[c]);
+		exit(1);
+	      }
+	    continue;
+	  }
+
+	if(!size || size != buffered_snapshot(&orig.header, (buffered_snapshot_mode)mode, NULL, 0))
+	  {
+	    printf("%s: snapshot failed!\n", names[c]);
+	    exit(1);
+	  }
+
+	/* Restore must fail on a state of another cipher... */
+	buffered_init_header(&copy.header, (cipher_type)((c + 1) % (LAST_CIPHER + 1)));
+	if(buffered_restore(&copy.header, snap, size) != BUFFERED_RESTORE_WRONG_CIPHER
+	   || buffered_restore(&copy.header, snap, size - 1) == BUFFERED_RESTORE_SUCCESS)
+	  {
+	    printf("%s: invalid restore succeeded!\n", names[c]);
+	    exit(1);
+	  }
+
+	/* A full Salsa20 snapshot with an unknown variant, the byte after the
+	 * version, cipher and mode, is corrupted. */
+	if(c == SALSA20 && mode == BUFFERED_SNAPSHOT_FULL)
+	  {
+	    const uint8_t variant = snap[3];
+
+	    buffered_init_header(&copy.header, SALSA20);
+	    snap[3] = 5;
+	    if(buffered_restore(&copy.header, snap, size) != BUFFERED_RESTORE_BAD_FORMAT)
+	      {
+		printf("%s: restore of a corrupted variant succeeded!\n", names[c]);
+		exit(1);
+	      }
+	    snap[3] = variant;
+	  }
+
+	/* ...and work on a proper one. */
+	if(mode == BUFFERED_SNAPSHOT_POSITION)
+	  init_any(&copy, (cipher_type)c, key);
+	else
+	  buffered_init_header(&copy.header, (cipher_type)c);
+
+	if(buffered_restore(&copy.header, snap, size) != BUFFERED_RESTORE_SUCCESS)
+	  {
+	    printf("%s: restore failed!\n", names[c]);
+	    exit(1);
+	  }
+
+	buffered_action(&orig.header, out_a, sizeof(out_a), BUFFERED_EXTRACT);
+	buffered_action(&copy.header, out_b, sizeof(out_b), BUFFERED_EXTRACT);
+	if(memcmp(out_a, out_b, sizeof(out_a)))
+	  {
+	    printf("%s: restored stream differs!\n", names[c]);
+	    exit(1);
+	  }
+      }
+
+  /* Salsa20 seeking back and forth. */
+  init_any(&orig, SALSA20, key);
+  init_any(&copy, SALSA20, key);
+  buffered_skip(&orig.header, 100000 + 13);
+  salsa20_buffered_seek(&copy.salsa20, 5000);
+  salsa20_buffered_seek(&copy.salsa20, 100000 + 13);
+  buffered_action(&orig.header, out_a, sizeof(out_a), BUFFERED_EXTRACT);
+  buffered_action(&copy.header, out_b, sizeof(out_b), BUFFERED_EXTRACT);
+  if(memcmp(out_a, out_b, sizeof(out_a))
+     || salsa20_buffered_tell(&copy.salsa20) != 100000 + 13 + sizeof(out_b))
+    {
+      puts("Salsa20 seek failed!");
+      exit(1);
+    }
+
+  puts("buffered snapshot and restore successful!");
+}
+
+static void
+batch_test(const uint8_t *key)
+{
+  enum { JOBS = 40 };
+  static any_buffered_state batched[JOBS], sequential[JOBS];
+  buffered_job jobs[JOBS];
+  size_t offset = 0;
+  int round, j;
+
+  for(j = 0; j < JOBS; ++j)
+    {
+      init_any(&batched[j], (cipher_type)(j % (LAST_CIPHER + 1)), key + j % 16);
+      sequential[j] = batched[j];
+    }
+
+  memset(stream_a, 0, JOBS * 20 * 710);
+  memset(stream_b, 0, JOBS * 20 * 710);
+
+  for(round = 0; round < 20; ++round)
+    {
+      for(j = 0; j < JOBS; ++j)
+	{
+	  jobs[j].state = &batched[j].header;
+	  jobs[j].stream = &stream_b[offset];
+	  jobs[j].len = rand() % 700;
+	  jobs[j].op = (rand() & 1) ? BUFFERED_ENCDEC : BUFFERED_EXTRACT;
+
+	  memset(&stream_a[offset], round, jobs[j].len);
+	  memset(&stream_b[offset], round, jobs[j].len);
+	  buffered_action(&sequential[j].header, &stream_a[offset], jobs[j].len, jobs[j].op);
+
+	  offset += jobs[j].len + j % 3;
+	}
+
+      buffered_action_batch(jobs, JOBS);
+    }
+
+  if(memcmp(stream_a, stream_b, offset))
+    {
+      puts("batched stream differs from sequential!");
+      exit(1);
+    }
+
+  puts("batched stream matches sequential!");
+}
+
+static void
+prefetch_test(const uint8_t *key)
+{
+  static any_buffered_state plain, prefetched;
+  static uint8_t ring[4096];
+  prefetch_state pf;
+  size_t done = 0;
+  int i;
+
+  init_any(&plain, SOSEMANUK, key);
+  init_any(&prefetched, SOSEMANUK, key);
+
+  if(prefetch_start(&pf, &prefetched.header, ring, sizeof(ring)))
+    {
+      puts("could not start prefetching!");
+      exit(1);
+    }
+
+  memset(stream_a, 0, 2000000);
+  memset(stream_b, 0, 2000000);
+  while(done < 2000000)
+    for(i = 1; i < 9000 && done < 2000000; i = i * 3 + 1)
+      {
+	size_t len = min(i, 2000000 - done);
+	buffered_ops op = (i & 1) ? BUFFERED_ENCDEC : BUFFERED_EXTRACT;
+
+	buffered_action(&plain.header, &stream_a[done], len, op);
+	prefetch_action(&pf, &stream_b[done], len, op);
+	done += len;
+      }
+
+  prefetch_stop(&pf);
+
+  if(memcmp(stream_a, stream_b, 2000000))
+    {
+      puts("prefetched stream differs!");
+      exit(1);
+    }
+
+  puts("prefetched stream matches unbuffered reference!");
+}
+
 int main()
 {
   srand(time(NULL));
 
-  uint8_t key[16];
+  uint8_t key[48];
 
   int i;
-  for(i = 0; i < 16; ++i)
+  for(i = 0; i < 48; ++i)
     key[i] = rand() % 256;
 
   rabbit_state state1;
   rabbit_init_key(&state1, key);
 
-  rabbit_buffered_state state2, state3;
+  rabbit_buffered_state state2, state3, state4;
 
-  state2 = state3 = rabbit_static_initializer;
-  state3.state = state2.state = state1;
+  state2 = state3 = state4 = rabbit_static_initializer;
+  state4.state = state3.state = state2.state = state1;
 
   /* Reference extraction. */
   for(i = 0; i < 20000000; i+=16)
@@ -67,7 +296,7 @@ int main()
       for(i = 1; i < 512; ++i)
 	{
 	  size_t len = min(i, 20000000 - done);
-	  buffered_action((buffered_state *)&state3, &stream_a[done], len, BUFFERED_ENCDEC);
+	  rabbit_buffered_action(&state3, &stream_a[done], len, BUFFERED_ENCDEC);
 	  done += len;
 	}
     }
@@ -89,5 +318,31 @@ int main()
     puts("buffered enc/dec successful, all zero!");
 
 
+  /* Buffered skip. */
+  done = 0;
+  while(done < 20000000)
+    {
+      for(i = 1; i < 512 && done < 20000000; i += 7)
+	{
+	  size_t len = min(i, 20000000 - done);
+	  buffered_skip((buffered_state *)&state4, len);
+	  done += len;
+
+	  len = min(i / 2, 20000000 - done);
+	  buffered_action((buffered_state *)&state4, &stream_a[done], len, BUFFERED_EXTRACT);
+	  if(memcmp(&stream_a[done], &stream_b[done], len))
+	    {
+	      puts("buffered skip failed, differ!");
+	      exit(1);
+	    }
+	  done += len;
+	}
+    }
+  puts("buffered skip successful, matches unbuffered reference!");
+
+  snapshot_test(key);
+  batch_test(key);
+  prefetch_test(key);
+
   puts("success!");
 }
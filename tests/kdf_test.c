@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kdf.h"
+
+static int failed = 0;
+
+static void
+report(const char *name, int errors)
+{
+  if(errors)
+    {
+      printf("%s: %d failed!\n", name, errors);
+      failed = 1;
+    }
+  else
+    printf("%s: ok\n", name);
+}
+
+/* From the tests of NaCl: core1 derives the first key of XSalsa20 from a
+ * shared secret, core2 the second one, from the first and the nonce
+ * prefix. */
+static const uint8_t shared[32] = {
+  0x4a, 0x5d, 0x9d, 0x5b, 0xa4, 0xce, 0x2d, 0xe1, 0x72, 0x8e, 0x3b, 0xf4, 0x80, 0x35, 0x0f, 0x25,
+  0xe0, 0x7e, 0x21, 0xc9, 0x47, 0xd1, 0x9e, 0x33, 0x76, 0xf0, 0x9b, 0x3c, 0x1e, 0x16, 0x17, 0x42
+};
+static const uint8_t first_key[32] = {
+  0x1b, 0x27, 0x55, 0x64, 0x73, 0xe9, 0x85, 0xd4, 0x62, 0xcd, 0x51, 0x19, 0x7a, 0x9a, 0x46, 0xc7,
+  0x60, 0x09, 0x54, 0x9e, 0xac, 0x64, 0x74, 0xf2, 0x06, 0xc4, 0xee, 0x08, 0x44, 0xf6, 0x83, 0x89
+};
+static const uint8_t nonce_prefix[16] = {
+  0x69, 0x69, 0x6e, 0xe9, 0x55, 0xb6, 0x2b, 0x73, 0xcd, 0x62, 0xbd, 0xa8, 0x75, 0xfc, 0x73, 0xd6
+};
+static const uint8_t second_key[32] = {
+  0xdc, 0x90, 0x8d, 0xda, 0x0b, 0x93, 0x44, 0xa9, 0x53, 0x62, 0x9b, 0x73, 0x38, 0x20, 0x77, 0x88,
+  0x80, 0xf3, 0xce, 0xb4, 0x21, 0xbb, 0x61, 0xb9, 0x1c, 0xbd, 0x4c, 0x3e, 0x66, 0x25, 0x6c, 0xe4
+};
+
+static void
+init_root(salsa20_master_state *root, salsa20_variant variant, const uint8_t *key)
+{
+  uint32_t aligned[8];
+
+  memcpy(aligned, key, 32);
+  salsa20_init_key(root, variant, (uint8_t *)aligned, SALSA20_256_BITS);
+}
+
+static void
+hsalsa_test(void)
+{
+  static const uint8_t zeros[16] = {0};
+  salsa20_master_state masters[SALSA20_LANES];
+  const salsa20_master_state *mptrs[SALSA20_LANES];
+  const uint8_t *inputs[SALSA20_LANES];
+  uint8_t outs[SALSA20_LANES][32], expected[32];
+  uint8_t *optrs[SALSA20_LANES];
+  int errors = 0;
+  size_t l, count;
+
+  init_root(&masters[0], SALSA20_20, shared);
+  salsa20_hsalsa(&masters[0], zeros, outs[0]);
+  errors += memcmp(outs[0], first_key, 32) != 0;
+
+  init_root(&masters[1], SALSA20_20, first_key);
+  salsa20_hsalsa(&masters[1], nonce_prefix, outs[1]);
+  errors += memcmp(outs[1], second_key, 32) != 0;
+
+  /* Lanes, with all the counts. */
+  for(count = 1; count <= SALSA20_LANES; ++count)
+    {
+      for(l = 0; l < count; ++l)
+	{
+	  uint8_t key[32];
+	  memset(key, l * 17 + count, 32);
+	  init_root(&masters[l], SALSA20_20, key);
+	  mptrs[l] = &masters[l];
+	  inputs[l] = l % 2 ? nonce_prefix : zeros;
+	  optrs[l] = outs[l];
+	}
+      salsa20_hsalsa_lanes(mptrs, inputs, optrs, count);
+      for(l = 0; l < count; ++l)
+	{
+	  salsa20_hsalsa(&masters[l], inputs[l], expected);
+	  errors += memcmp(outs[l], expected, 32) != 0;
+	}
+    }
+
+  report("HSalsa20", errors);
+}
+
+static void
+kdf_test(void)
+{
+  static const size_t lengths[] = {0, 1, 15, 16, 17, 31, 32, 33, 100, 5, 16, 2, 64};
+  enum { COUNT = sizeof lengths / sizeof lengths[0] };
+  uint8_t context[128];
+  uint8_t keys[COUNT][ESTREAM_KDF_KEY_SIZE], key[ESTREAM_KDF_KEY_SIZE];
+  estream_kdf_request requests[COUNT];
+  salsa20_master_state root;
+  int errors = 0;
+  size_t i, j;
+
+  for(i = 0; i < sizeof context; ++i)
+    context[i] = i * 13 + 1;
+
+  init_root(&root, SALSA20_20, shared);
+
+  /* The batch has the same result as one by one. */
+  for(i = 0; i < COUNT; ++i)
+    {
+      requests[i].context = context + i;
+      requests[i].ctx_len = lengths[i];
+      requests[i].out_key = keys[i];
+    }
+  estream_kdf_batch(&root, requests, COUNT);
+
+  for(i = 0; i < COUNT; ++i)
+    {
+      estream_kdf(&root, context + i, lengths[i], key);
+      errors += memcmp(key, keys[i], sizeof key) != 0;
+    }
+
+  /* All different, as the contexts are. */
+  for(i = 0; i < COUNT; ++i)
+    for(j = i + 1; j < COUNT; ++j)
+      errors += !memcmp(keys[i], keys[j], sizeof key);
+
+  /* A context that is the other one zero padded. */
+  memset(context, 'a', 1);
+  memset(context + 1, 0, 15);
+  estream_kdf(&root, context, 1, keys[0]);
+  estream_kdf(&root, context, 16, keys[1]);
+  errors += !memcmp(keys[0], keys[1], sizeof key);
+
+  /* The cascade, as described in kdf.h. */
+  {
+    uint8_t block[16] = {3, 0, 0, 0, 0, 0, 0, 0, 'e', 's', 't', 'r', '-', 'k', 'd', 'f'};
+    salsa20_master_state next;
+
+    salsa20_hsalsa(&root, block, key);
+    init_root(&next, SALSA20_20, key);
+    memset(block, 0, 16);
+    memcpy(block, "abc", 3);
+    salsa20_hsalsa(&next, block, key);
+    estream_kdf(&root, (const uint8_t *)"abc", 3, keys[0]);
+    errors += memcmp(key, keys[0], sizeof key) != 0;
+  }
+
+  /* Nothing to do. */
+  estream_kdf_batch(&root, requests, 0);
+
+  report("KDF", errors);
+}
+
+int main()
+{
+  hsalsa_test();
+  kdf_test();
+
+  if(failed)
+    return 1;
+
+  puts("All tests passed!");
+  return 0;
+}
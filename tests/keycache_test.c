@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "buffered.h"
+#include "umac.h"
+#include "keycache.h"
+
+static int failed = 0;
+
+static void
+report(const char *name, int errors)
+{
+  if(errors)
+    {
+      printf("%s: %d failed!\n", name, errors);
+      failed = 1;
+    }
+  else
+    printf("%s: ok\n", name);
+}
+
+static void
+make_key(uint8_t *key, unsigned seed)
+{
+  int i;
+
+  for(i = 0; i < KEYCACHE_MAX_KEY_SIZE; ++i)
+    key[i] = seed * 31 + i * 7;
+}
+
+/** Checks a cached state against one expanded from scratch. */
+static int
+check_state(keycache_kind kind, const uint8_t *raw, size_t key_len, const void *state)
+{
+  uint32_t key[8];
+  uint32_t iv[4] = {1, 2, 3, 4};
+  uint8_t expected[64], got[64];
+
+  memcpy(key, raw, key_len);
+
+  switch(kind)
+    {
+    case KEYCACHE_SOSEMANUK:
+      {
+	sosemanuk_buffered_state a = sosemanuk_static_initializer;
+	sosemanuk_buffered_state b = sosemanuk_static_initializer;
+	sosemanuk_master_state master;
+
+	sosemanuk_init_key(&master, (uint8_t *)key, key_len * 8);
+	sosemanuk_init_iv(&a.state, &master, (uint8_t *)iv);
+	sosemanuk_init_iv(&b.state, state, (uint8_t *)iv);
+	buffered_action(&a.header, expected, 64, BUFFERED_EXTRACT);
+	buffered_action(&b.header, got, 64, BUFFERED_EXTRACT);
+      }
+      break;
+    case KEYCACHE_RABBIT:
+      {
+	rabbit_buffered_state a = rabbit_static_initializer;
+	rabbit_buffered_state b = rabbit_static_initializer;
+	rabbit_state master;
+
+	rabbit_init_key(&master, (uint8_t *)key);
+	rabbit_init_iv(&a.state, &master, (uint8_t *)iv);
+	rabbit_init_iv(&b.state, state, (uint8_t *)iv);
+	buffered_action(&a.header, expected, 64, BUFFERED_EXTRACT);
+	buffered_action(&b.header, got, 64, BUFFERED_EXTRACT);
+      }
+      break;
+    case KEYCACHE_UHASH_64:
+      {
+	static uhash_64_key fresh;
+	salsa20_buffered_state kdf = salsa20_static_initializer;
+	salsa20_master_state master;
+	uhash_64_state hs;
+
+	salsa20_init_key(&master, SALSA20_12, (uint8_t *)key, SALSA20_256_BITS);
+	memset(iv, 0, 8);
+	salsa20_init_iv(&kdf.state, &master, (uint8_t *)iv);
+	uhash_key_setup(UHASH_64, (uhash_key *)&fresh, &kdf.header);
+
+	uhash_64_init(&hs);
+	uhash_64_update(&fresh, &hs, raw, 32);
+	uhash_64_finish(&fresh, &hs, expected);
+	uhash_64_init(&hs);
+	uhash_64_update(state, &hs, raw, 32);
+	uhash_64_finish(state, &hs, got);
+	memset(expected + 8, 0, 56);
+	memset(got + 8, 0, 56);
+      }
+      break;
+    default:
+      return 1;
+    }
+
+  return memcmp(expected, got, 64) != 0;
+}
+
+static void
+basic_test(void)
+{
+  static const keycache_kind kinds[] = {
+    KEYCACHE_SOSEMANUK, KEYCACHE_RABBIT, KEYCACHE_UHASH_64
+  };
+  keycache cache;
+  keycache_stats stats;
+  uint8_t key[KEYCACHE_MAX_KEY_SIZE];
+  const void *a, *b;
+  int errors = 0;
+  size_t i;
+
+  errors += keycache_init(&cache, 64, 4) != 0;
+  make_key(key, 1);
+
+  for(i = 0; i < sizeof kinds / sizeof kinds[0]; ++i)
+    {
+      const size_t len = kinds[i] == KEYCACHE_RABBIT ? 16 : 32;
+
+      a = keycache_acquire(&cache, kinds[i], key, len);
+      b = keycache_acquire(&cache, kinds[i], key, len);
+      errors += !a || a != b;
+      errors += check_state(kinds[i], key, len, a);
+      keycache_release(&cache, a);
+      keycache_release(&cache, b);
+    }
+
+  /* Same key, different kind or length. */
+  a = keycache_acquire(&cache, KEYCACHE_SOSEMANUK, key, 16);
+  errors += check_state(KEYCACHE_SOSEMANUK, key, 16, a);
+  keycache_release(&cache, a);
+  b = keycache_acquire(&cache, KEYCACHE_UHASH_128, key, 32);
+  errors += a == b;
+  keycache_release(&cache, b);
+
+  /* Invalid arguments are rejected, and not counted. */
+  errors += keycache_acquire(&cache, KEYCACHE_SOSEMANUK, key, 33) != NULL;
+  errors += keycache_acquire(&cache, KEYCACHE_RABBIT, key, 32) != NULL;
+  errors += keycache_acquire(&cache, KEYCACHE_UHASH_32, key, 16) != NULL;
+  errors += keycache_acquire(&cache, KEYCACHE_KIND_COUNT, key, 32) != NULL;
+
+  keycache_get_stats(&cache, &stats);
+  errors += stats.hits != 3 || stats.misses != 5 || stats.evictions || stats.size != 5;
+
+  keycache_destroy(&cache);
+  report("Basic", errors);
+}
+
+static void
+eviction_test(void)
+{
+  keycache cache;
+  keycache_stats stats;
+  uint8_t key[KEYCACHE_MAX_KEY_SIZE];
+  const void *held, *state;
+  unsigned i;
+  int errors = 0;
+
+  /* A single shard, so the order of eviction is exactly LRU. */
+  errors += keycache_init(&cache, 4, 1) != 0;
+
+  make_key(key, 100);
+  held = keycache_acquire(&cache, KEYCACHE_SOSEMANUK, key, 16);
+
+  for(i = 0; i < 4; ++i)
+    {
+      make_key(key, i);
+      keycache_release(&cache, keycache_acquire(&cache, KEYCACHE_SOSEMANUK, key, 16));
+    }
+
+  /* Keys 1 to 3 are in the cache; the held state was evicted, but is valid. */
+  keycache_get_stats(&cache, &stats);
+  errors += stats.evictions != 1 || stats.size != 4;
+  make_key(key, 100);
+  errors += check_state(KEYCACHE_SOSEMANUK, key, 16, held);
+  keycache_release(&cache, held);
+
+  /* Using key 0 makes key 1 the least recently used. */
+  make_key(key, 0);
+  keycache_release(&cache, keycache_acquire(&cache, KEYCACHE_SOSEMANUK, key, 16));
+  make_key(key, 200);
+  keycache_release(&cache, keycache_acquire(&cache, KEYCACHE_SOSEMANUK, key, 16));
+  make_key(key, 0);
+  state = keycache_acquire(&cache, KEYCACHE_SOSEMANUK, key, 16);
+  keycache_release(&cache, state);
+
+  keycache_get_stats(&cache, &stats);
+  errors += stats.hits != 2;
+  make_key(key, 1);
+  keycache_release(&cache, keycache_acquire(&cache, KEYCACHE_SOSEMANUK, key, 16));
+  keycache_get_stats(&cache, &stats);
+  errors += stats.hits != 2;
+
+  keycache_destroy(&cache);
+  report("Eviction", errors);
+}
+
+#define THREADS 4
+#define THREAD_KEYS 24
+
+static keycache shared_cache;
+
+static void *
+thread_main(void *arg)
+{
+  unsigned seed = (unsigned)(size_t)arg;
+  uint8_t key[KEYCACHE_MAX_KEY_SIZE];
+  size_t errors = 0;
+  int i;
+
+  for(i = 0; i < 20000; ++i)
+    {
+      const void *state;
+      unsigned k;
+
+      seed = seed * 1103515245u + 12345u;
+      k = (seed >> 16) % THREAD_KEYS;
+      make_key(key, k);
+
+      state = keycache_acquire(&shared_cache, KEYCACHE_SOSEMANUK, key, 32);
+      if(!(i % 64))
+	errors += check_state(KEYCACHE_SOSEMANUK, key, 32, state);
+      keycache_release(&shared_cache, state);
+    }
+
+  return (void *)errors;
+}
+
+static void
+threads_test(void)
+{
+  pthread_t threads[THREADS];
+  keycache_stats stats;
+  int errors = 0;
+  size_t i;
+
+  /* Smaller than the key set, so that there are evictions too. */
+  errors += keycache_init(&shared_cache, 16, 4) != 0;
+
+  for(i = 0; i < THREADS; ++i)
+    pthread_create(&threads[i], NULL, thread_main, (void *)(i + 1));
+  for(i = 0; i < THREADS; ++i)
+    {
+      void *ret;
+      pthread_join(threads[i], &ret);
+      errors += (size_t)ret != 0;
+    }
+
+  keycache_get_stats(&shared_cache, &stats);
+  errors += stats.hits + stats.misses != THREADS * 20000;
+  errors += stats.size > 16;
+
+  keycache_destroy(&shared_cache);
+  report("Threads", errors);
+}
+
+int main()
+{
+  basic_test();
+  eviction_test();
+  threads_test();
+
+  if(failed)
+    return 1;
+
+  puts("All tests passed!");
+  return 0;
+}
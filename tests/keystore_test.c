@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "buffered.h"
+#include "keystore.h"
+
+static int failed = 0;
+
+static void
+report(const char *name, int errors)
+{
+  if(errors)
+    {
+      printf("%s: %d failed!\n", name, errors);
+      failed = 1;
+    }
+  else
+    printf("%s: ok\n", name);
+}
+
+/* Offsets in the file header, see keystore.c. */
+#define VERSION_OFFSET 4
+#define KEY_SIZES_OFFSET 20
+#define NONCE_OFFSET 64
+#define FIRST_ID_OFFSET 72
+#define DATA_OFFSET 4096
+
+static char path[64];
+
+static sosemanuk_master_state sosemanuk_key;
+static salsa20_master_state salsa20_key;
+static uhash_32_key key_32;
+static uhash_64_key key_64;
+static uhash_96_key key_96;
+static uhash_128_key key_128;
+
+static const uhash_key *const uhash_keys[4] = {
+  &key_32.header, &key_64.header, &key_96.header, &key_128.header
+};
+
+static keystore_item items[6] = {
+  {7, KEYSTORE_UHASH_64, &key_64},
+  {3, KEYSTORE_SOSEMANUK_MASTER, &sosemanuk_key},
+  {7, KEYSTORE_UHASH_128, &key_128},
+  {1, KEYSTORE_SALSA20_MASTER, &salsa20_key},
+  {9, KEYSTORE_UHASH_32, &key_32},
+  {2, KEYSTORE_UHASH_96, &key_96}
+};
+
+static void
+setup_keys(void)
+{
+  uint32_t raw[8];
+  int i;
+
+  for(i = 0; i < 8; ++i)
+    raw[i] = i * 0x01020304u + 5;
+
+  sosemanuk_init_key(&sosemanuk_key, (uint8_t *)raw, 128);
+  salsa20_init_key(&salsa20_key, SALSA20_12, (uint8_t *)raw, SALSA20_256_BITS);
+
+  for(i = 0; i < 4; ++i)
+    {
+      salsa20_buffered_state kdf = salsa20_static_initializer;
+      salsa20_master_state master;
+      const uint32_t iv[2] = {0, 0};
+
+      raw[0] = i;
+      salsa20_init_key(&master, SALSA20_12, (uint8_t *)raw, SALSA20_256_BITS);
+      salsa20_init_iv(&kdf.state, &master, (const uint8_t *)iv);
+      uhash_key_setup(i, (uhash_key *)uhash_keys[i], &kdf.header);
+    }
+}
+
+static void
+tag_of(const uhash_key *key, uint8_t *tag)
+{
+  static const uint8_t msg[3000] = {1, 2, 3};
+  uhash_128_state state;
+
+  uhash_init(uhash_get_type_from_key((uhash_key *)key), (uhash_state *)&state);
+  uhash_update(key, (uhash_state *)&state, msg, sizeof msg);
+  uhash_finish(key, (uhash_state *)&state, tag);
+}
+
+static int
+check_contents(const keystore *ks)
+{
+  const void *key;
+  int errors = 0;
+  size_t i;
+
+  for(i = 0; i < sizeof items / sizeof items[0]; ++i)
+    {
+      if(keystore_find(ks, items[i].id, items[i].kind, &key) != KEYSTORE_OK)
+	{
+	  ++errors;
+	  continue;
+	}
+
+      if(items[i].kind >= KEYSTORE_UHASH_32)
+	{
+	  /* The loaded key must be usable as it is. */
+	  uint8_t expected[16] = {0}, got[16] = {0};
+
+	  tag_of(items[i].key, expected);
+	  tag_of(key, got);
+	  errors += memcmp(expected, got, 16) != 0;
+	}
+      else
+	errors += memcmp(key, items[i].key, items[i].kind == KEYSTORE_SOSEMANUK_MASTER
+			 ? sizeof sosemanuk_key : sizeof salsa20_key) != 0;
+    }
+
+  /* Again, with the pointer already fixed up. */
+  errors += keystore_find(ks, 7, KEYSTORE_UHASH_128, &key) != KEYSTORE_OK;
+
+  errors += keystore_find(ks, 7, KEYSTORE_UHASH_32, &key) != KEYSTORE_NOT_FOUND;
+  errors += keystore_find(ks, 0, KEYSTORE_SOSEMANUK_MASTER, &key) != KEYSTORE_NOT_FOUND;
+  errors += keystore_find(ks, 10, KEYSTORE_UHASH_32, &key) != KEYSTORE_NOT_FOUND;
+
+  return errors;
+}
+
+static void
+roundtrip_test(const uint8_t *seal_key, const uint8_t *nonce)
+{
+  keystore ks;
+  int errors = 0;
+
+  errors += keystore_write(path, items, 6, seal_key, nonce) != 0;
+  if(keystore_open(&ks, path, seal_key) == KEYSTORE_OK)
+    {
+      errors += ks.count != 6;
+      errors += check_contents(&ks);
+      keystore_close(&ks);
+    }
+  else
+    ++errors;
+
+  /* Duplicated id and kind. */
+  items[5].id = 9;
+  items[5].kind = KEYSTORE_UHASH_32;
+  errors += keystore_write(path, items, 6, seal_key, nonce) == 0;
+  items[5].id = 2;
+  items[5].kind = KEYSTORE_UHASH_96;
+
+  report(seal_key ? "Sealed round trip" : "Round trip", errors);
+}
+
+/** Changes one byte of the file, then opens it and looks up the first key. */
+static keystore_status
+open_modified(long offset, const uint8_t *seal_key)
+{
+  const void *key;
+  keystore ks;
+  keystore_status status;
+  FILE *f;
+  int c;
+
+  f = fopen(path, "r+b");
+  fseek(f, offset, SEEK_SET);
+  c = fgetc(f);
+  fseek(f, offset, SEEK_SET);
+  fputc(c ^ 1, f);
+  fclose(f);
+
+  status = keystore_open(&ks, path, seal_key);
+  if(status == KEYSTORE_OK)
+    {
+      status = keystore_find(&ks, 1, KEYSTORE_SALSA20_MASTER, &key);
+      keystore_close(&ks);
+    }
+
+  f = fopen(path, "r+b");
+  fseek(f, offset, SEEK_SET);
+  fputc(c, f);
+  fclose(f);
+
+  return status;
+}
+
+static void
+tamper_test(const uint8_t *seal_key, const uint8_t *nonce)
+{
+  uint8_t other_key[KEYSTORE_SEAL_KEY_SIZE];
+  keystore ks;
+  int errors = 0;
+
+  keystore_write(path, items, 6, NULL, NULL);
+  errors += open_modified(0, NULL) != KEYSTORE_BAD_FORMAT;
+  errors += open_modified(VERSION_OFFSET, NULL) != KEYSTORE_BAD_VERSION;
+  errors += open_modified(KEY_SIZES_OFFSET, NULL) != KEYSTORE_BAD_LAYOUT;
+  errors += open_modified(DATA_OFFSET + 8, NULL) != KEYSTORE_BAD_CHECKSUM;
+  errors += open_modified(FIRST_ID_OFFSET, NULL) != KEYSTORE_BAD_CHECKSUM;
+  errors += keystore_open(&ks, path, seal_key) != KEYSTORE_BAD_SEAL;
+  errors += keystore_open(&ks, "/nonexistent/keystore", NULL) != KEYSTORE_IO_ERROR;
+  errors += truncate(path, DATA_OFFSET + 8) != 0;
+  errors += keystore_open(&ks, path, NULL) != KEYSTORE_BAD_FORMAT;
+
+  memcpy(other_key, seal_key, sizeof other_key);
+  other_key[0] ^= 1;
+  keystore_write(path, items, 6, seal_key, nonce);
+  errors += open_modified(DATA_OFFSET + 8, seal_key) != KEYSTORE_BAD_SEAL;
+  /* The header is authenticated, too. */
+  errors += open_modified(NONCE_OFFSET, seal_key) != KEYSTORE_BAD_SEAL;
+  errors += keystore_open(&ks, path, NULL) != KEYSTORE_BAD_SEAL;
+  errors += keystore_open(&ks, path, other_key) != KEYSTORE_BAD_SEAL;
+
+  report("Tampering", errors);
+}
+
+int main()
+{
+  uint8_t seal_key[KEYSTORE_SEAL_KEY_SIZE];
+  const uint8_t nonce[KEYSTORE_NONCE_SIZE] = {1, 2, 3, 4, 5, 6, 7, 8};
+  size_t i;
+
+  for(i = 0; i < sizeof(seal_key); ++i)
+    seal_key[i] = i * 7 + 3;
+
+  snprintf(path, sizeof path, "/tmp/keystore_test.%d", (int)getpid());
+  setup_keys();
+
+  roundtrip_test(NULL, NULL);
+  roundtrip_test(seal_key, nonce);
+  tamper_test(seal_key, nonce);
+
+  unlink(path);
+
+  if(failed)
+    return 1;
+
+  puts("All tests passed!");
+  return 0;
+}
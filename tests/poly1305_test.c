@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "poly1305.h"
+
+static int failed = 0;
+
+static void
+vector_test(const char *name, const uint8_t *key, const uint8_t *msg, size_t len,
+	    const uint8_t *expected)
+{
+  uint8_t tag[POLY1305_TAG_SIZE];
+
+  poly1305_auth(key, msg, len, tag);
+  if(memcmp(tag, expected, POLY1305_TAG_SIZE))
+    {
+      printf("%s: failed!\n", name);
+      failed = 1;
+    }
+  else
+    printf("%s: ok\n", name);
+}
+
+/* Checks that hashing in random sized pieces gives the same tag as hashing
+ * all at once, as the big updates use the multi-block kernel. */
+static void
+split_test()
+{
+  static uint8_t msg[5000];
+  uint8_t key[POLY1305_KEY_SIZE];
+  size_t len, done, i;
+  int errors = 0;
+
+  for(i = 0; i < sizeof(msg); ++i)
+    msg[i] = rand();
+
+  for(len = 0; len <= sizeof(msg); len += 1 + len / 16)
+    {
+      poly1305_state state;
+      uint8_t whole[POLY1305_TAG_SIZE], split[POLY1305_TAG_SIZE];
+
+      for(i = 0; i < sizeof(key); ++i)
+	key[i] = rand();
+
+      poly1305_auth(key, msg, len, whole);
+
+      poly1305_init(&state, key);
+      for(done = 0; done < len;)
+	{
+	  size_t part = rand() % 40;
+	  if(part > len - done)
+	    part = len - done;
+	  poly1305_update(&state, msg + done, part);
+	  done += part;
+	}
+      poly1305_finish(&state, split);
+
+      errors += memcmp(whole, split, POLY1305_TAG_SIZE) != 0;
+    }
+
+  if(errors)
+    {
+      printf("Split updates: %d failed!\n", errors);
+      failed = 1;
+    }
+  else
+    printf("Split updates: ok\n");
+}
+
+/* With a maximal key and message every limb of the accumulators is as big as
+ * it gets, so the sums of the vector lanes must be carried before the scalar
+ * code takes over. Block by block updates never use the vector kernel. */
+static void
+max_limbs_test()
+{
+  static uint8_t msg[4096 + 64];
+  uint8_t key[POLY1305_KEY_SIZE];
+  size_t len, done;
+  int errors = 0;
+
+  memset(key, 0xff, sizeof(key));
+  memset(msg, 0xff, sizeof(msg));
+
+  for(len = 16 * 16; len <= sizeof(msg); len += 16 + len / 8)
+    {
+      poly1305_state state;
+      uint8_t whole[POLY1305_TAG_SIZE], twice[POLY1305_TAG_SIZE];
+      uint8_t scalar[POLY1305_TAG_SIZE];
+
+      poly1305_auth(key, msg, len, whole);
+
+      /* 16 blocks through the vector kernel, then more blocks after it. */
+      poly1305_init(&state, key);
+      poly1305_update(&state, msg, 16 * 16);
+      poly1305_update(&state, msg + 16 * 16, len - 16 * 16);
+      poly1305_finish(&state, twice);
+
+      poly1305_init(&state, key);
+      for(done = 0; done < len; done += 16)
+	poly1305_update(&state, msg + done, len - done < 16 ? len - done : 16);
+      poly1305_finish(&state, scalar);
+
+      errors += memcmp(whole, scalar, POLY1305_TAG_SIZE) != 0;
+      errors += memcmp(twice, scalar, POLY1305_TAG_SIZE) != 0;
+    }
+
+  if(errors)
+    {
+      printf("Maximal limbs: %d failed!\n", errors);
+      failed = 1;
+    }
+  else
+    printf("Maximal limbs: ok\n");
+}
+
+int main()
+{
+  /* RFC 8439, section 2.5.2. */
+  {
+    static const uint8_t key[] = {
+      0x85, 0xd6, 0xbe, 0x78, 0x57, 0x55, 0x6d, 0x33, 0x7f, 0x44, 0x52, 0xfe, 0x42, 0xd5, 0x06, 0xa8,
+      0x01, 0x03, 0x80, 0x8a, 0xfb, 0x0d, 0xb2, 0xfd, 0x4a, 0xbf, 0xf6, 0xaf, 0x41, 0x49, 0xf5, 0x1b
+    };
+    static const uint8_t tag[] = {
+      0xa8, 0x06, 0x1d, 0xc1, 0x30, 0x51, 0x36, 0xc6, 0xc2, 0x2b, 0x8b, 0xaf, 0x0c, 0x01, 0x27, 0xa9
+    };
+    const char *msg = "Cryptographic Forum Research Group";
+
+    vector_test("RFC 8439 2.5.2", key, (const uint8_t *)msg, strlen(msg), tag);
+  }
+
+  /* RFC 8439, appendix A.3, #5: h reaches p. */
+  {
+    static const uint8_t key[32] = {0x02};
+    static const uint8_t msg[16] = {
+      0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+    };
+    static const uint8_t tag[16] = {0x03};
+
+    vector_test("RFC 8439 A.3 #5", key, msg, sizeof(msg), tag);
+  }
+
+  /* RFC 8439, appendix A.3, #6: h + s overflows 2^128. */
+  {
+    static const uint8_t key[32] = {
+      0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+    };
+    static const uint8_t msg[16] = {0x02};
+    static const uint8_t tag[16] = {0x03};
+
+    vector_test("RFC 8439 A.3 #6", key, msg, sizeof(msg), tag);
+  }
+
+  /* RFC 8439, appendix A.3, #9: h is p - 5 + 3. */
+  {
+    static const uint8_t key[32] = {0x02};
+    static const uint8_t msg[16] = {
+      0xfd, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+    };
+    static const uint8_t tag[16] = {
+      0xfa, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+    };
+
+    vector_test("RFC 8439 A.3 #9", key, msg, sizeof(msg), tag);
+  }
+
+  /* 17 blocks of 0xff with a maximal key, computed with a bignum reference. */
+  {
+    static uint8_t key[32], msg[272];
+    static const uint8_t tag[16] = {
+      0x05, 0x5f, 0x96, 0xd8, 0x61, 0xd5, 0xc7, 0xc8, 0x78, 0xe5, 0x87, 0xcc, 0x25, 0x5a, 0x22, 0xe9
+    };
+
+    memset(key, 0xff, sizeof(key));
+    memset(msg, 0xff, sizeof(msg));
+    vector_test("Maximal key, 17 blocks", key, msg, sizeof(msg), tag);
+  }
+
+  split_test();
+  max_limbs_test();
+
+  if(failed)
+    return 1;
+
+  puts("All tests passed!");
+  return 0;
+}
@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buffered.h"
+#include "protocol.h"
+
+static int failed = 0;
+
+static void
+report(const char *name, int errors)
+{
+  if(errors)
+    {
+      printf("%s: %d failed!\n", name, errors);
+      failed = 1;
+    }
+  else
+    printf("%s: ok\n", name);
+}
+
+/* In memory connection between the peers. Reads past the end get zeros, as
+ * a tampered size may make the receiver ask for more than was sent. */
+typedef struct
+{
+  uint8_t data[16384];
+  size_t len;
+  size_t pos;
+} wire;
+
+static void
+wire_send(wire *w, uint8_t *buffer, uint16_t len)
+{
+  memcpy(w->data + w->len, buffer, len);
+  w->len += len;
+}
+
+static void
+wire_recv(wire *w, uint8_t *buffer, uint16_t len)
+{
+  size_t i;
+
+  for(i = 0; i < len; ++i, ++w->pos)
+    buffer[i] = w->pos < w->len ? w->data[w->pos] : 0;
+}
+
+typedef struct
+{
+  sosemanuk_buffered_state cipher;
+  uhash_64_key uhash_key;
+  uhash_64_state uhash_state;
+  siphash_key sip_key;
+  siphash_state sip_state;
+  poly1305_state poly1305;
+  signer_context signer;
+} peer;
+
+/* Both peers are set up the same way, so their streams are in sync. */
+static void
+peer_setup(peer *p, signer_mode mode, signer_mac_type mac_type, io_callback_func io)
+{
+  static const uint8_t key[16] = {
+    0x6a, 0x1f, 0x3c, 0x92, 0x05, 0xd4, 0x7e, 0xb8, 0x21, 0x4d, 0xe0, 0x59, 0x13, 0xaf, 0xc6, 0x38
+  };
+  static const uint8_t iv[16] = {0x42};
+  sosemanuk_master_state master;
+
+  sosemanuk_init_key(&master, key, 128);
+  buffered_init_header(&p->cipher.header, SOSEMANUK);
+  sosemanuk_init_iv(&p->cipher.state, &master, iv);
+
+  memset(&p->signer, 0, sizeof p->signer);
+  p->signer.cipher_state = &p->cipher.header;
+  p->signer.io_callback = io;
+  p->signer.mode = mode;
+  p->signer.mac_type = mac_type;
+
+  if(mac_type == SIGNER_MAC_POLY1305)
+    p->signer.poly1305 = &p->poly1305;
+  else if(mac_type == SIGNER_MAC_SIPHASH)
+    {
+      p->signer.sip_key = &p->sip_key;
+      p->signer.sip_state = &p->sip_state;
+      siphash_key_setup(SIPHASH_2_4, p->signer.sip_key, p->signer.cipher_state);
+    }
+  else
+    {
+      p->signer.mac_key = (uhash_key *)&p->uhash_key;
+      p->signer.mac_state = (uhash_state *)&p->uhash_state;
+      uhash_key_setup(UHASH_64, p->signer.mac_key, p->signer.cipher_state);
+    }
+}
+
+static const char *const mode_names[] = {"MAC-then-encrypt", "Encrypt-then-MAC"};
+static const char *const mac_names[] = {"UHASH", "Poly1305", "SipHash"};
+
+/* Below, at and above the size that gets its own tag, and spanning several
+ * work buffers. */
+static const uint32_t lengths[] = {0, 1, 5, 1024, 1025, 4095, 4096, 4097, 9000};
+
+static uint8_t message[9000];
+
+/* Sends messages of several lengths over the same contexts and checks that all
+ * arrive intact. */
+static void
+round_trip_test(signer_mode mode, signer_mac_type mac_type)
+{
+  static wire w;
+  peer sender, receiver;
+  char name[64];
+  int errors = 0;
+  size_t i;
+
+  peer_setup(&sender, mode, mac_type, (io_callback_func)wire_send);
+  peer_setup(&receiver, mode, mac_type, (io_callback_func)wire_recv);
+
+  for(i = 0; i < sizeof lengths / sizeof lengths[0]; ++i)
+    {
+      uint8_t *received;
+      uint32_t size;
+
+      w.len = w.pos = 0;
+      signed_send(&sender.signer, &w, message, lengths[i]);
+      if(signed_recv(&receiver.signer, &w, &received, &size) != SIGNER_RECV_SUCCESS)
+	{
+	  ++errors;
+	  break;
+	}
+      errors += size != lengths[i] || memcmp(received, message, size) || w.pos != w.len;
+      free(received);
+    }
+
+  snprintf(name, sizeof name, "%s, %s, round trip", mode_names[mode], mac_names[mac_type]);
+  report(name, errors);
+}
+
+/* Flips one bit of the header, the ciphertext or the tag, that must all be
+ * rejected. */
+static void
+tamper_test(signer_mode mode, signer_mac_type mac_type)
+{
+  static const uint32_t tamper_lengths[] = {100, 5000};
+  static wire w;
+  char name[64];
+  int errors = 0;
+  size_t i, where;
+
+  for(i = 0; i < sizeof tamper_lengths / sizeof tamper_lengths[0]; ++i)
+    for(where = 0; where < 3; ++where)
+      {
+	peer sender, receiver;
+	uint8_t *received;
+	uint32_t size;
+
+	peer_setup(&sender, mode, mac_type, (io_callback_func)wire_send);
+	peer_setup(&receiver, mode, mac_type, (io_callback_func)wire_recv);
+
+	w.len = w.pos = 0;
+	signed_send(&sender.signer, &w, message, tamper_lengths[i]);
+
+	if(where == 0)
+	  w.data[0] ^= 1;
+	else if(where == 1)
+	  w.data[w.len / 2] ^= 0x10;
+	else
+	  w.data[w.len - 1] ^= 0x80;
+
+	if(signed_recv(&receiver.signer, &w, &received, &size) != SIGNER_RECV_VERIFY_FAILED)
+	  {
+	    ++errors;
+	    free(received);
+	  }
+	else
+	  errors += received != NULL;
+      }
+
+  snprintf(name, sizeof name, "%s, %s, tampering", mode_names[mode], mac_names[mac_type]);
+  report(name, errors);
+}
+
+/* Builds the expected Poly1305 frames straight from the cipher stream, to
+ * check the use of the one-time keys: both are taken before the header, the
+ * first signs the header and, for short messages, the body too; the second
+ * signs the body of long messages. */
+static void
+poly1305_layout_test(signer_mode mode)
+{
+  static const uint32_t layout_lengths[] = {100, 5000};
+  static uint8_t stream[16384], expected[16384];
+  static wire w;
+  char name[64];
+  int errors = 0;
+  size_t i;
+
+  for(i = 0; i < sizeof layout_lengths / sizeof layout_lengths[0]; ++i)
+    {
+      const uint32_t len = layout_lengths[i];
+      const int long_msg = len > 1024;
+      const size_t frame = 4 + long_msg * POLY1305_TAG_SIZE + len + POLY1305_TAG_SIZE;
+      const uint8_t *key1 = stream, *key2 = stream + POLY1305_KEY_SIZE;
+      const uint8_t *s = stream + 2 * POLY1305_KEY_SIZE;
+      uint8_t *e = expected;
+      peer sender, reference;
+      poly1305_state mac;
+      size_t j;
+
+      peer_setup(&sender, mode, SIGNER_MAC_POLY1305, (io_callback_func)wire_send);
+      w.len = w.pos = 0;
+      signed_send(&sender.signer, &w, message, len);
+
+      peer_setup(&reference, mode, SIGNER_MAC_POLY1305, NULL);
+      memset(stream, 0, sizeof stream);
+      buffered_action(&reference.cipher.header, stream, 2 * POLY1305_KEY_SIZE + frame,
+		      BUFFERED_EXTRACT);
+
+      e[0] = len; e[1] = len >> 8; e[2] = len >> 16; e[3] = len >> 24;
+
+      if(mode == SIGNER_MAC_THEN_ENCRYPT)
+	{
+	  /* Signs the plaintext, then encrypts all of it. */
+	  poly1305_init(&mac, key1);
+	  poly1305_update(&mac, e, 4);
+	  e += 4;
+	  if(long_msg)
+	    {
+	      poly1305_finish(&mac, e);
+	      e += POLY1305_TAG_SIZE;
+	      poly1305_init(&mac, key2);
+	    }
+	  memcpy(e, message, len);
+	  poly1305_update(&mac, e, len);
+	  poly1305_finish(&mac, e + len);
+
+	  for(j = 0; j < frame; ++j)
+	    expected[j] ^= s[j];
+	}
+      else
+	{
+	  /* Encrypts the header, signs it, then the pads of the tags precede the
+	   * message in the stream. */
+	  for(j = 0; j < 4; ++j)
+	    e[j] ^= *s++;
+	  poly1305_init(&mac, key1);
+	  poly1305_update(&mac, e, 4);
+	  e += 4;
+	  if(long_msg)
+	    {
+	      poly1305_finish(&mac, e);
+	      for(j = 0; j < POLY1305_TAG_SIZE; ++j)
+		e[j] ^= *s++;
+	      e += POLY1305_TAG_SIZE;
+	      poly1305_init(&mac, key2);
+	    }
+	  for(j = 0; j < len; ++j)
+	    e[j] = message[j] ^ s[POLY1305_TAG_SIZE + j];
+	  poly1305_update(&mac, e, len);
+	  poly1305_finish(&mac, e + len);
+	  for(j = 0; j < POLY1305_TAG_SIZE; ++j)
+	    e[len + j] ^= s[j];
+	}
+
+      errors += w.len != frame || memcmp(w.data, expected, frame);
+    }
+
+  snprintf(name, sizeof name, "%s, Poly1305, key order", mode_names[mode]);
+  report(name, errors);
+}
+
+int main()
+{
+  static const signer_mac_type macs[] = {
+    SIGNER_MAC_UHASH, SIGNER_MAC_POLY1305, SIGNER_MAC_SIPHASH
+  };
+  size_t i;
+
+  for(i = 0; i < sizeof message; ++i)
+    message[i] = rand();
+
+  for(i = 0; i < sizeof macs / sizeof macs[0]; ++i)
+    {
+      round_trip_test(SIGNER_MAC_THEN_ENCRYPT, macs[i]);
+      round_trip_test(SIGNER_ENCRYPT_THEN_MAC, macs[i]);
+      tamper_test(SIGNER_MAC_THEN_ENCRYPT, macs[i]);
+      tamper_test(SIGNER_ENCRYPT_THEN_MAC, macs[i]);
+    }
+
+  poly1305_layout_test(SIGNER_MAC_THEN_ENCRYPT);
+  poly1305_layout_test(SIGNER_ENCRYPT_THEN_MAC);
+
+  if(failed)
+    return 1;
+
+  puts("All tests passed!");
+  return 0;
+}
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "random.h"
+
+static int failed = 0;
+
+static void
+report(const char *name, int errors)
+{
+  if(errors)
+    {
+      printf("%s: %d failed!\n", name, errors);
+      failed = 1;
+    }
+  else
+    printf("%s: ok\n", name);
+}
+
+/** Checks that about half of the bits are set, which with this many bits
+ * fails by chance with negligible probability. */
+static int
+balanced(const uint8_t *buf, size_t len)
+{
+  size_t ones = 0, i;
+  long long deviation;
+
+  for(i = 0; i < len; ++i)
+    ones += __builtin_popcount(buf[i]);
+
+  /* Less than 6 standard deviations, of sqrt(len * 8 / 4), away from len * 4,
+   * compared squared. */
+  deviation = (long long)ones - (long long)len * 4;
+  return len < 512 || deviation * deviation < 36 * 2 * (long long)len;
+}
+
+static void
+sizes_test(void)
+{
+  static const size_t sizes[] = {0, 1, 7, 31, 32, 33, 64, 1000, 4063, 4064, 4095,
+				 4096, 4097, 10000, 100000, 1000000};
+  /* Room for the 1 byte offset and the guard byte after the output. */
+  static uint8_t a[1000000 + 2], b[1000000];
+  int errors = 0;
+  size_t i;
+
+  for(i = 0; i < sizeof sizes / sizeof sizes[0]; ++i)
+    {
+      const size_t len = sizes[i];
+
+      /* Unaligned, too. */
+      memset(a, 0, len + 2);
+      errors += estream_random(a + (i & 1), len) != 0;
+      errors += estream_random(b, len) != 0;
+      errors += a[len + (i & 1)] != 0;
+      errors += len >= 16 && !memcmp(a + (i & 1), b, len);
+      errors += !balanced(b, len);
+    }
+
+  report("Sizes", errors);
+}
+
+static void
+reseed_test(void)
+{
+  static uint8_t buf[1 << 20];
+  uint8_t first[32], other[32];
+  int errors = 0;
+  size_t i;
+
+  /* Crosses a few reseeds, with outputs never repeating. */
+  errors += estream_random(first, sizeof first) != 0;
+  for(i = 0; i < 3 * RANDOM_RESEED_INTERVAL / sizeof buf; ++i)
+    {
+      errors += estream_random(buf, sizeof buf) != 0;
+      errors += estream_random(other, sizeof other) != 0;
+      errors += !memcmp(first, other, sizeof first);
+    }
+  errors += !balanced(buf, sizeof buf);
+
+  /* Wiping, then using it again. */
+  estream_random_wipe();
+  errors += estream_random(other, sizeof other) != 0;
+  errors += !memcmp(first, other, sizeof first);
+
+  report("Reseed", errors);
+}
+
+static void
+fork_test(void)
+{
+  uint8_t parent[32], child[32];
+  int fds[2], status;
+  int errors = 0;
+  pid_t pid;
+
+  /* The state is seeded before forking, so both copies start equal. */
+  fflush(stdout);
+  estream_random(parent, 8);
+
+  if(pipe(fds))
+    {
+      report("Fork", 1);
+      return;
+    }
+
+  pid = fork();
+  if(!pid)
+    {
+      estream_random(child, sizeof child);
+      _exit(write(fds[1], child, sizeof child) != sizeof child);
+    }
+
+  estream_random(parent, sizeof parent);
+  errors += pid < 0;
+  errors += read(fds[0], child, sizeof child) != sizeof child;
+  errors += waitpid(pid, &status, 0) != pid || status;
+  errors += !memcmp(parent, child, sizeof parent);
+
+  close(fds[0]);
+  close(fds[1]);
+  report("Fork", errors);
+}
+
+static void *
+thread_main(void *out)
+{
+  estream_random(out, 32);
+  estream_random_wipe();
+  return NULL;
+}
+
+static void
+threads_test(void)
+{
+  uint8_t outs[4][32];
+  pthread_t threads[4];
+  int errors = 0;
+  int i, j;
+
+  for(i = 0; i < 4; ++i)
+    pthread_create(&threads[i], NULL, thread_main, outs[i]);
+  for(i = 0; i < 4; ++i)
+    pthread_join(threads[i], NULL);
+
+  for(i = 0; i < 4; ++i)
+    for(j = i + 1; j < 4; ++j)
+      errors += !memcmp(outs[i], outs[j], 32);
+
+  report("Threads", errors);
+}
+
+int main()
+{
+  sizes_test();
+  reseed_test();
+  fork_test();
+  threads_test();
+
+  if(failed)
+    return 1;
+
+  puts("All tests passed!");
+  return 0;
+}
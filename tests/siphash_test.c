@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "siphash.h"
+
+static int failed = 0;
+
+typedef struct
+{
+  size_t len;
+  uint8_t tag[SIPHASH_TAG_SIZE];
+} vector;
+
+/* Key is 00 01 .. 0f, and message of length len is 00 01 .. len-1, like in
+ * the reference implementation test vectors. */
+static const vector vectors_2_4[] = {
+  {0, {0x31, 0x0e, 0x0e, 0xdd, 0x47, 0xdb, 0x6f, 0x72}},
+  {1, {0xfd, 0x67, 0xdc, 0x93, 0xc5, 0x39, 0xf8, 0x74}},
+  {7, {0x37, 0xd1, 0x01, 0x8b, 0xf5, 0x00, 0x02, 0xab}},
+  {8, {0x62, 0x24, 0x93, 0x9a, 0x79, 0xf5, 0xf5, 0x93}},
+  {15, {0xe5, 0x45, 0xbe, 0x49, 0x61, 0xca, 0x29, 0xa1}},
+  {16, {0xdb, 0x9b, 0xc2, 0x57, 0x7f, 0xcc, 0x2a, 0x3f}},
+  {63, {0x72, 0x45, 0x06, 0xeb, 0x4c, 0x32, 0x8a, 0x95}}
+};
+
+static const vector vectors_1_3[] = {
+  {0, {0xdc, 0xc4, 0x0f, 0x05, 0x58, 0x01, 0xac, 0xab}},
+  {1, {0x93, 0xca, 0x57, 0x7d, 0xf3, 0x9b, 0xf4, 0xc9}},
+  {7, {0x40, 0x11, 0xb1, 0x9b, 0x98, 0x7d, 0x92, 0xd3}},
+  {8, {0x8e, 0x9a, 0x29, 0x8d, 0x11, 0x95, 0x90, 0x36}},
+  {15, {0x56, 0x99, 0x51, 0x2a, 0x6d, 0xd8, 0x20, 0xd3}},
+  {16, {0x66, 0x8b, 0x90, 0x7d, 0x1a, 0xdd, 0x4f, 0xcc}},
+  {63, {0xa8, 0xb3, 0xbb, 0xb7, 0x62, 0x90, 0x19, 0x9d}}
+};
+
+static void
+vectors_test(const char *name, siphash_variant variant, const vector *vecs, size_t count)
+{
+  uint8_t key_bytes[SIPHASH_KEY_SIZE];
+  uint8_t msg[64];
+  siphash_key key;
+  size_t i;
+  int errors = 0;
+
+  for(i = 0; i < sizeof(key_bytes); ++i)
+    key_bytes[i] = i;
+  for(i = 0; i < sizeof(msg); ++i)
+    msg[i] = i;
+
+  siphash_key_init(&key, variant, key_bytes);
+
+  for(i = 0; i < count; ++i)
+    {
+      uint8_t tag[SIPHASH_TAG_SIZE];
+      siphash_state state;
+
+      siphash(&key, msg, vecs[i].len, tag);
+      errors += memcmp(tag, vecs[i].tag, SIPHASH_TAG_SIZE) != 0;
+
+      siphash_init(&key, &state);
+      siphash_update(&state, msg, vecs[i].len);
+      siphash_finish(&state, tag);
+      errors += memcmp(tag, vecs[i].tag, SIPHASH_TAG_SIZE) != 0;
+    }
+
+  if(errors)
+    {
+      printf("%s: %d failed!\n", name, errors);
+      failed = 1;
+    }
+  else
+    printf("%s: ok\n", name);
+}
+
+/* Checks that hashing in random sized pieces gives the same tag as hashing
+ * all at once. */
+static void
+split_test(siphash_variant variant)
+{
+  static uint8_t msg[600];
+  uint8_t key_bytes[SIPHASH_KEY_SIZE];
+  siphash_key key;
+  size_t len, done, i;
+  int errors = 0;
+
+  for(i = 0; i < sizeof(msg); ++i)
+    msg[i] = rand();
+
+  for(len = 0; len <= sizeof(msg); ++len)
+    {
+      siphash_state state;
+      uint8_t whole[SIPHASH_TAG_SIZE], split[SIPHASH_TAG_SIZE];
+
+      for(i = 0; i < sizeof(key_bytes); ++i)
+	key_bytes[i] = rand();
+      siphash_key_init(&key, variant, key_bytes);
+
+      siphash(&key, msg, len, whole);
+
+      siphash_init(&key, &state);
+      for(done = 0; done < len;)
+	{
+	  size_t part = rand() % 20;
+	  if(part > len - done)
+	    part = len - done;
+	  siphash_update(&state, msg + done, part);
+	  done += part;
+	}
+      siphash_finish(&state, split);
+
+      errors += memcmp(whole, split, SIPHASH_TAG_SIZE) != 0;
+    }
+
+  if(errors)
+    {
+      printf("Split updates: %d failed!\n", errors);
+      failed = 1;
+    }
+  else
+    printf("Split updates: ok\n");
+}
+
+int main()
+{
+  vectors_test("SipHash-2-4", SIPHASH_2_4, vectors_2_4,
+	       sizeof(vectors_2_4) / sizeof(vectors_2_4[0]));
+  vectors_test("SipHash-1-3", SIPHASH_1_3, vectors_1_3,
+	       sizeof(vectors_1_3) / sizeof(vectors_1_3[0]));
+
+  split_test(SIPHASH_2_4);
+  split_test(SIPHASH_1_3);
+
+  if(failed)
+    return 1;
+
+  puts("All tests passed!");
+  return 0;
+}
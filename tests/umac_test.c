@@ -2,6 +2,7 @@
  * Source code placed into public domain. */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include "umac_vec_keys.h"
@@ -54,6 +55,440 @@ void run_test(char* name, char *char_msg, size_t len)
   }
 }
 
+/* Checks that hashing in random sized partial updates, from random
+ * alignments, and with uhash_oneshot(), gives the same result as hashing
+ * all at once. Messages cover all sizes from 0 to 3000 bytes. */
+void split_update_test()
+{
+  static uint8_t buf[3000 + 8];
+  union {
+    uhash_32_state s32;
+    uhash_64_state s64;
+    uhash_96_state s96;
+    uhash_128_state s128;
+  } state;
+  uhash_state *state_ptr = (uhash_state *)&state;
+  size_t len, done;
+  int i;
+
+  for(i = 0; i < sizeof(buf); ++i)
+    buf[i] = rand();
+
+  for(len = 0; len <= 3000; ++len)
+    for(i = 0; i < 4; ++i)
+      {
+	const uint8_t *msg = buf + len % 8;
+	uint8_t whole[16], split[16];
+
+	uhash_init((uhash_type)i, state_ptr);
+	uhash_update(keys[i], state_ptr, msg, len);
+	uhash_finish(keys[i], state_ptr, whole);
+
+	uhash_init((uhash_type)i, state_ptr);
+	for(done = 0; done < len;)
+	  {
+	    size_t part = rand() % 100;
+	    if(part > len - done)
+	      part = len - done;
+	    uhash_update(keys[i], state_ptr, msg + done, part);
+	    done += part;
+	  }
+	uhash_finish(keys[i], state_ptr, split);
+
+	if(memcmp(whole, split, (i+1)*4))
+	  {
+	    fprintf(stderr, "Split update mismatch on length %zu, %d bits!\n", len, (i+1)*32);
+	    exit(1);
+	  }
+
+	uhash_oneshot(keys[i], msg, len, split);
+	if(memcmp(whole, split, (i+1)*4))
+	  {
+	    fprintf(stderr, "One-shot mismatch on length %zu, %d bits!\n", len, (i+1)*32);
+	    exit(1);
+	  }
+      }
+}
+
+/* Checks that hashing with uhash_update_parallel(), after a sequential
+ * prefix, gives the same result as hashing sequentially. The messages are
+ * big enough to cross the switch from POLY-64 to POLY-128. */
+void parallel_update_test()
+{
+  static const struct {
+    size_t prefix;
+    size_t len;
+    unsigned threads;
+  } cases[] = {
+    {0, (1 << 20) + 77, 4},
+    {1000, (1 << 24) + 300000, 3},
+    {(1 << 24) - 5000, 400000, 2},
+    {(1 << 24) + 3 * 1024 + 100, 300000, 5},
+    {(1 << 24) + 2048, 262144 + 1024, 8},
+  };
+  size_t size = 0;
+  uint8_t *buf;
+  union {
+    uhash_32_state s32;
+    uhash_64_state s64;
+    uhash_96_state s96;
+    uhash_128_state s128;
+  } state;
+  uhash_state *state_ptr = (uhash_state *)&state;
+  size_t j;
+  int c, i;
+
+  /* Odd cases start 1 byte into the buffer, to test unaligned input. */
+  for(c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c)
+    if(size < cases[c].prefix + cases[c].len + 1)
+      size = cases[c].prefix + cases[c].len + 1;
+
+  buf = malloc(size);
+  for(j = 0; j < size; ++j)
+    buf[j] = rand();
+
+  for(c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c)
+    for(i = 0; i < 4; ++i)
+      {
+	const uint8_t *msg = buf + c % 2;
+	uint8_t seq[16], par[16];
+
+	uhash_init((uhash_type)i, state_ptr);
+	uhash_update(keys[i], state_ptr, msg, cases[c].prefix + cases[c].len);
+	uhash_finish(keys[i], state_ptr, seq);
+
+	if(cases[c].prefix)
+	  {
+	    uhash_init((uhash_type)i, state_ptr);
+	    uhash_update(keys[i], state_ptr, msg, cases[c].prefix);
+	    uhash_update_parallel(keys[i], state_ptr, msg + cases[c].prefix,
+				  cases[c].len, cases[c].threads);
+	    uhash_finish(keys[i], state_ptr, par);
+	  }
+	else
+	  uhash_digest_parallel(keys[i], msg, cases[c].len, par, cases[c].threads);
+
+	if(memcmp(seq, par, (i+1)*4))
+	  {
+	    fprintf(stderr, "Parallel update mismatch on case %d, %d bits!\n", c, (i+1)*32);
+	    exit(1);
+	  }
+      }
+
+  free(buf);
+}
+
+/* Checks that full UMAC tags are the same with and without the cached pad,
+ * and are different for each nonce. */
+void umac_nonce_test()
+{
+  static const uint8_t msg[] = "The quick brown fox jumps over the lazy dog";
+  union {
+    umac_32_ctx c32;
+    umac_64_ctx c64;
+    umac_96_ctx c96;
+    umac_128_ctx c128;
+  } warm, cold;
+  uint8_t key[UMAC_KEY_SIZE];
+  uint8_t nonce[UMAC_NONCE_SIZE] = {0};
+  uint8_t tags[40][16];
+  int i, n, m;
+
+  for(i = 0; i < UMAC_KEY_SIZE; ++i)
+    key[i] = i;
+
+  for(i = 0; i < 4; ++i)
+    {
+      const int tag_size = (i+1) * 4;
+
+      umac_init(&warm.c32.header, (uhash_type)i, key);
+      for(n = 0; n < 40; ++n)
+	{
+	  uint8_t cold_tag[16];
+
+	  /* Sequential nonces, crossing a byte boundary. */
+	  nonce[14] = (250 + n) >> 8;
+	  nonce[15] = 250 + n;
+
+	  umac_update(&warm.c32.header, msg, 10);
+	  umac_update(&warm.c32.header, msg + 10, sizeof(msg) - 10);
+	  umac_final(&warm.c32.header, nonce, tags[n]);
+
+	  umac_init(&cold.c32.header, (uhash_type)i, key);
+	  umac_digest(&cold.c32.header, msg, sizeof(msg), nonce, cold_tag);
+
+	  if(memcmp(tags[n], cold_tag, tag_size))
+	    {
+	      fprintf(stderr, "UMAC cached pad mismatch on nonce %d, %d bits!\n", n, (i+1)*32);
+	      exit(1);
+	    }
+
+	  for(m = 0; m < n; ++m)
+	    if(!memcmp(tags[n], tags[m], tag_size))
+	      {
+		fprintf(stderr, "UMAC repeated tag on nonces %d and %d, %d bits!\n", m, n, (i+1)*32);
+		exit(1);
+	      }
+	}
+    }
+}
+
+/* Checks that uhash_many() gives the same tags as hashing each message,
+ * for short messages of all sizes and alignments, mixed with longer ones. */
+void many_test()
+{
+  enum { COUNT = 3000 };
+  static uint8_t buf[2048 + 8];
+  static const uint8_t *msgs[COUNT];
+  static size_t lens[COUNT];
+  static uint8_t tags[COUNT * 16];
+  union {
+    uhash_32_state s32;
+    uhash_64_state s64;
+    uhash_96_state s96;
+    uhash_128_state s128;
+  } state;
+  uhash_state *state_ptr = (uhash_state *)&state;
+  int i, j;
+
+  for(j = 0; j < sizeof(buf); ++j)
+    buf[j] = rand();
+
+  for(j = 0; j < COUNT; ++j)
+    {
+      lens[j] = j < 1100 ? j : rand() % 2049;
+      msgs[j] = buf + rand() % 8;
+    }
+
+  for(i = 0; i < 4; ++i)
+    {
+      uhash_many(keys[i], msgs, lens, COUNT, tags);
+
+      for(j = 0; j < COUNT; ++j)
+	{
+	  uint8_t out[16];
+
+	  uhash_init((uhash_type)i, state_ptr);
+	  uhash_update(keys[i], state_ptr, msgs[j], lens[j]);
+	  uhash_finish(keys[i], state_ptr, out);
+
+	  if(memcmp(out, tags + j * (i+1) * 4, (i+1)*4))
+	    {
+	      fprintf(stderr, "Many messages mismatch on length %zu, %d bits!\n", lens[j], (i+1)*32);
+	      exit(1);
+	    }
+	}
+    }
+}
+
+/* Checks that messages hashed from a cloned prefix template give the same
+ * result as hashing them from the start. */
+void prefix_template_test()
+{
+  static const size_t prefix_lens[] = {0, 5, 32, 1000, 1024, 1500, 33000};
+  static uint8_t buf[40000];
+  union {
+    uhash_32_state s32;
+    uhash_64_state s64;
+    uhash_96_state s96;
+    uhash_128_state s128;
+  } tmpl, state;
+  uhash_state *tmpl_ptr = (uhash_state *)&tmpl;
+  uhash_state *state_ptr = (uhash_state *)&state;
+  size_t j;
+  int i, p;
+
+  for(j = 0; j < sizeof(buf); ++j)
+    buf[j] = rand();
+
+  for(i = 0; i < 4; ++i)
+    for(p = 0; p < sizeof(prefix_lens) / sizeof(prefix_lens[0]); ++p)
+      {
+	const size_t prefix_len = prefix_lens[p];
+	int m;
+
+	uhash_prefix_template(keys[i], tmpl_ptr, buf, prefix_len);
+
+	for(m = 0; m < 10; ++m)
+	  {
+	    const size_t body_len = rand() % 3000;
+	    uint8_t direct[16], cloned[16];
+
+	    /* Each message has a different body after the prefix. */
+	    buf[prefix_len] = m;
+
+	    uhash_init((uhash_type)i, state_ptr);
+	    uhash_update(keys[i], state_ptr, buf, prefix_len + body_len);
+	    uhash_finish(keys[i], state_ptr, direct);
+
+	    uhash_clone(state_ptr, tmpl_ptr);
+	    uhash_update(keys[i], state_ptr, buf + prefix_len, body_len);
+	    uhash_finish(keys[i], state_ptr, cloned);
+
+	    if(memcmp(direct, cloned, (i+1)*4))
+	      {
+		fprintf(stderr, "Prefix template mismatch on prefix %zu, %d bits!\n", prefix_len, (i+1)*32);
+		exit(1);
+	      }
+	  }
+      }
+}
+
+/* Checks that the tag of a tracked record, after random modifications,
+ * is the same as hashing the whole record again. */
+void tracked_test()
+{
+  static const size_t lens[] = {
+    0, 100, 1024, 5000, 1 << 20,
+    (1 << 24) + 1024 * 3 + 77, /* An unpaired POLY-128 block at end. */
+    (1 << 24) + 2048 /* Only the POLY-128 kickstart pair. */
+  };
+  uint8_t *record = malloc(lens[sizeof(lens) / sizeof(lens[0]) - 2]);
+  union {
+    uhash_32_state s32;
+    uhash_64_state s64;
+    uhash_96_state s96;
+    uhash_128_state s128;
+  } state;
+  uhash_state *state_ptr = (uhash_state *)&state;
+  uhash_tracked t;
+  size_t j;
+  int i, l, e;
+
+  for(l = 0; l < sizeof(lens) / sizeof(lens[0]); ++l)
+    {
+      const size_t len = lens[l];
+
+      for(j = 0; j < len; ++j)
+	record[j] = rand();
+
+      for(i = 0; i < 4; ++i)
+	{
+	  if(uhash_tracked_init(&t, keys[i], record, len))
+	    {
+	      fprintf(stderr, "Tracked init failed!\n");
+	      exit(1);
+	    }
+
+	  for(e = 0; e < 4; ++e)
+	    {
+	      uint8_t fresh[16], tracked[16];
+
+	      /* First check is before any modification. */
+	      if(e && len)
+		{
+		  size_t offset = ((size_t)rand() * RAND_MAX + rand()) % len;
+		  size_t edit = rand() % 3000;
+		  if(edit > len - offset)
+		    edit = len - offset;
+
+		  /* Last edit hits the final byte. */
+		  if(e == 3)
+		    offset = len - (edit = 1);
+
+		  for(j = offset; j < offset + edit; ++j)
+		    record[j] = rand();
+		  uhash_tracked_update(&t, offset, edit);
+		}
+
+	      uhash_init((uhash_type)i, state_ptr);
+	      uhash_update(keys[i], state_ptr, record, len);
+	      uhash_finish(keys[i], state_ptr, fresh);
+	      uhash_tracked_finish(&t, tracked);
+
+	      if(memcmp(fresh, tracked, (i+1)*4))
+		{
+		  fprintf(stderr, "Tracked mismatch on length %zu, edit %d, %d bits!\n", len, e, (i+1)*32);
+		  exit(1);
+		}
+	    }
+
+	  uhash_tracked_free(&t);
+	}
+    }
+
+  free(record);
+}
+
+/* Checks that lazily derived keys give the same tags as eagerly derived
+ * ones, for sessions of growing messages, without reading parts of the key
+ * storage not yet derived, and that the stream is left at the same place. */
+void lazy_test()
+{
+  static const size_t session[] = {0, 5, 200, 33, 1000, 1024, 1025, 3000, 70000};
+  static const uint8_t cipher_key[32] = {7};
+  static const uint8_t iv[8] = {1};
+  static uint8_t msg[70000];
+  salsa20_master_state master;
+  union {
+    uhash_32_key k32;
+    uhash_64_key k64;
+    uhash_96_key k96;
+    uhash_128_key k128;
+  } eager, storage;
+  union {
+    uhash_32_state s32;
+    uhash_64_state s64;
+    uhash_96_state s96;
+    uhash_128_state s128;
+  } state;
+  uhash_state *state_ptr = (uhash_state *)&state;
+  size_t j;
+  int i, m;
+
+  for(j = 0; j < sizeof(msg); ++j)
+    msg[j] = rand();
+
+  salsa20_init_key(&master, SALSA20_12, cipher_key, SALSA20_256_BITS);
+
+  for(i = 0; i < 4; ++i)
+    {
+      salsa20_buffered_state eager_stream, lazy_stream;
+      uhash_lazy_key lazy;
+      uint8_t after_eager[16], after_lazy[16];
+
+      /* Start the keys from the middle of a block. */
+      buffered_init_header(&eager_stream.header, SALSA20);
+      salsa20_init_iv(&eager_stream.state, &master, iv);
+      buffered_action(&eager_stream.header, after_eager, 13, BUFFERED_EXTRACT);
+      lazy_stream = eager_stream;
+
+      uhash_key_setup((uhash_type)i, (uhash_key *)&eager, &eager_stream.header);
+
+      /* Parts not derived would give wrong tags if used. */
+      memset(&storage, 0xaa, sizeof(storage));
+      uhash_lazy_key_setup((uhash_type)i, &lazy, (uhash_key *)&storage, &lazy_stream);
+
+      buffered_action(&eager_stream.header, after_eager, 16, BUFFERED_EXTRACT);
+      buffered_action(&lazy_stream.header, after_lazy, 16, BUFFERED_EXTRACT);
+      if(memcmp(after_eager, after_lazy, 16))
+	{
+	  fprintf(stderr, "Lazy key setup left the stream elsewhere, %d bits!\n", (i+1)*32);
+	  exit(1);
+	}
+
+      for(m = 0; m < sizeof(session) / sizeof(session[0]); ++m)
+	{
+	  uint8_t expected[16], tag[16];
+
+	  uhash_init((uhash_type)i, state_ptr);
+	  uhash_update((uhash_key *)&eager, state_ptr, msg, session[m]);
+	  uhash_finish((uhash_key *)&eager, state_ptr, expected);
+
+	  uhash_init((uhash_type)i, state_ptr);
+	  uhash_lazy_update(&lazy, state_ptr, msg, session[m] / 3);
+	  uhash_lazy_update(&lazy, state_ptr, msg + session[m] / 3, session[m] - session[m] / 3);
+	  uhash_lazy_finish(&lazy, state_ptr, tag);
+
+	  if(memcmp(expected, tag, (i+1)*4))
+	    {
+	      fprintf(stderr, "Lazy key mismatch on length %zu, %d bits!\n", session[m], (i+1)*32);
+	      exit(1);
+	    }
+	}
+    }
+}
+
 void std_test()
 {
   run_test("<empty>", "", 0);
@@ -75,6 +510,14 @@ void std_test()
     memcpy(&buf[i*3], "abc", 3);
 
   run_test("'abc' * 500", buf, 1500);
+
+  split_update_test();
+  parallel_update_test();
+  umac_nonce_test();
+  many_test();
+  prefix_template_test();
+  tracked_test();
+  lazy_test();
 }
 
 int main(int argc, char *argv[])
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "salsa20.h"
+#include "vhash.h"
+
+static int failed = 0;
+
+typedef struct
+{
+  size_t len;
+  const char *tag;
+} vector;
+
+/* Keys extracted from Salsa20/20 with key 05 00 .. 00 and zero IV, messages
+ * of bytes i * 7. Checked against an independent big integer model. */
+static const vector vectors_64[] = {
+  {0, "91eb7c57862386ac"},
+  {3, "393c4e15f21fb795"},
+  {1000, "2ca53443cc0de5df"},
+  {2000, "5a7eea35d0e58e26"}
+};
+
+static const vector vectors_128[] = {
+  {0, "1c88d6fcdde57b34314244213a14e469"},
+  {3, "64e35b016ca8139566479fba2543defd"},
+  {1000, "90e3dd239a00cff4cb6a9a791a2eb625"},
+  {2000, "0fc56f4ce822438eb4f03827ba0ff1f4"}
+};
+
+static void
+setup_key(vhash_type type, vhash_key *key)
+{
+  static const uint8_t cipher_key[32] = {5};
+  static const uint8_t iv[8] = {0};
+  salsa20_master_state master;
+  salsa20_buffered_state stream;
+
+  salsa20_init_key(&master, SALSA20_20, cipher_key, SALSA20_256_BITS);
+  buffered_init_header(&stream.header, SALSA20);
+  salsa20_init_iv(&stream.state, &master, iv);
+
+  vhash_key_setup(type, key, (buffered_state *)&stream);
+}
+
+static void
+to_hex(const uint8_t *data, size_t len, char *out)
+{
+  size_t i;
+
+  for(i = 0; i < len; ++i)
+    sprintf(out + i * 2, "%02x", data[i]);
+}
+
+static void
+vectors_test(const char *name, vhash_type type, const vector *vecs, size_t count)
+{
+  const size_t tag_size = ((size_t)type + 1) * 8;
+  static uint8_t msg[2000];
+  vhash_key key;
+  size_t i;
+  int errors = 0;
+
+  for(i = 0; i < sizeof(msg); ++i)
+    msg[i] = i * 7;
+
+  setup_key(type, &key);
+
+  for(i = 0; i < count; ++i)
+    {
+      vhash_state state;
+      uint8_t tag[16];
+      char hex[33];
+
+      vhash_init(&key, &state);
+      vhash_update(&key, &state, msg, vecs[i].len);
+      vhash_finish(&key, &state, tag);
+
+      to_hex(tag, tag_size, hex);
+      errors += strcmp(hex, vecs[i].tag) != 0;
+    }
+
+  if(errors)
+    {
+      printf("%s: %d failed!\n", name, errors);
+      failed = 1;
+    }
+  else
+    printf("%s: ok\n", name);
+}
+
+/* Checks that hashing in random sized pieces gives the same tag as hashing
+ * all at once, and that the zero padding of the last block is not confused
+ * with the message. */
+static void
+split_test(vhash_type type)
+{
+  const size_t tag_size = ((size_t)type + 1) * 8;
+  static uint8_t msg[5000];
+  vhash_key key;
+  size_t len, done, i;
+  int errors = 0;
+
+  for(i = 0; i < sizeof(msg); ++i)
+    msg[i] = rand();
+
+  setup_key(type, &key);
+
+  for(len = 0; len <= sizeof(msg); len += 1 + len / 8)
+    {
+      vhash_state state;
+      uint8_t whole[16], split[16];
+
+      vhash_init(&key, &state);
+      vhash_update(&key, &state, msg, len);
+      vhash_finish(&key, &state, whole);
+
+      vhash_init(&key, &state);
+      for(done = 0; done < len;)
+	{
+	  size_t part = rand() % 300;
+	  if(part > len - done)
+	    part = len - done;
+	  vhash_update(&key, &state, msg + done, part);
+	  done += part;
+	}
+      vhash_finish(&key, &state, split);
+
+      errors += memcmp(whole, split, tag_size) != 0;
+    }
+
+  {
+    static const uint8_t zeros[2] = {0, 0};
+    vhash_state state;
+    uint8_t one[16], two[16];
+
+    vhash_init(&key, &state);
+    vhash_update(&key, &state, zeros, 1);
+    vhash_finish(&key, &state, one);
+
+    vhash_init(&key, &state);
+    vhash_update(&key, &state, zeros, 2);
+    vhash_finish(&key, &state, two);
+
+    errors += memcmp(one, two, tag_size) == 0;
+  }
+
+  if(errors)
+    {
+      printf("Split updates: %d failed!\n", errors);
+      failed = 1;
+    }
+  else
+    printf("Split updates: ok\n");
+}
+
+int main()
+{
+  vectors_test("VHASH-64", VHASH_64, vectors_64,
+	       sizeof(vectors_64) / sizeof(vectors_64[0]));
+  vectors_test("VHASH-128", VHASH_128, vectors_128,
+	       sizeof(vectors_128) / sizeof(vectors_128[0]));
+
+  split_test(VHASH_64);
+  split_test(VHASH_128);
+
+  if(failed)
+    return 1;
+
+  puts("All tests passed!");
+  return 0;
+}
@@ -2,13 +2,17 @@
  * Source code placed into public domain. */
 
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <endian.h>
+#include <errno.h>
+#include <pthread.h>
 #include "util.h"
 #include "buffered.h"
 
 #include "umac.h"
+#include "umac_internal.h"
 
 static void
 unpack_bigendian(uint32_t value, uint8_t *out)
@@ -21,98 +25,330 @@ unpack_bigendian(uint32_t value, uint8_t *out)
   out[3] = value;
 }
 
+/* NH kernels. Each one runs NH over a sequence of consecutive 32 bytes steps,
+ * for all the UHASH iterations at once, so that each message word is loaded
+ * only once. The key for iteration i is the L1 key shifted by 16 bytes. The
+ * vectorized versions depend on little endian byte order, like the SIMD
+ * instruction sets they use. */
+
+#if (defined(__SSE2__) || defined(__AVX2__)) && __BYTE_ORDER == __LITTLE_ENDIAN
+#include <immintrin.h>
+
+/* Message is read with unaligned loads. */
+#define NH_ANY_ALIGNMENT 1
+/* There is a nh_short_pair(). */
+#define NH_PAIR 1
+
+/** NH of one step, in two 64 bits lanes, for one iteration. */
+static inline __m128i
+nh_step_sse2(__m128i m_lo, __m128i m_hi, const uint32_t *key)
+{
+  __m128i a = _mm_add_epi32(m_lo, _mm_loadu_si128((const __m128i *)key));
+  __m128i b = _mm_add_epi32(m_hi, _mm_loadu_si128((const __m128i *)(key + 4)));
+
+  /* Multiply words 0 and 2, then 1 and 3. */
+  return _mm_add_epi64(_mm_mul_epu32(a, b),
+		       _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32)));
+}
+
+#ifdef __AVX2__
+/** NH of two consecutive steps, in four 64 bits lanes, for one iteration. */
+static inline __m256i
+nh_2steps_avx2(__m256i m_lo, __m256i m_hi, const uint32_t *key)
+{
+  __m256i k0 = _mm256_loadu_si256((const __m256i *)key);
+  __m256i k1 = _mm256_loadu_si256((const __m256i *)(key + 8));
+
+  /* Low and high halves of both steps, like the message. */
+  __m256i a = _mm256_add_epi32(m_lo, _mm256_permute2x128_si256(k0, k1, 0x20));
+  __m256i b = _mm256_add_epi32(m_hi, _mm256_permute2x128_si256(k0, k1, 0x31));
+
+  return _mm256_add_epi64(_mm256_mul_epu32(a, b),
+			  _mm256_mul_epu32(_mm256_srli_epi64(a, 32),
+					   _mm256_srli_epi64(b, 32)));
+}
+#endif
+
 /**
- * @param msg When cast from a byte array, must be in native byte-order...
+ * @param key The L1 key at the first step.
+ * @param msg The message steps; may be unaligned.
+ * @param out Where to store the NH sum of each iteration.
  */
-static uint64_t
-nh_iteration(const uint32_t* key, const uint32_t* msg)
+static ALWAYS_INLINE void
+nh_steps(const uint32_t *key, const uint32_t *msg, size_t steps, int iters,
+	 uint64_t *out)
 {
-  uint64_t y = 0;
-  int j;
-  for(j = 0; j < 4; ++j)
-    y += (uint64_t)(htole32(msg[j]) + key[j])
-      * (uint64_t)(htole32(msg[4 + j]) + key[4 + j]);
+  __m128i acc[4];
+  int i;
 
-  return y;
+  for(i = 0; i < iters; ++i)
+    acc[i] = _mm_setzero_si128();
+
+#ifdef __AVX2__
+  if(steps >= 2)
+    {
+      __m256i acc2[4];
+
+      for(i = 0; i < iters; ++i)
+	acc2[i] = _mm256_setzero_si256();
+
+      for(; steps >= 2; steps -= 2, msg += 16, key += 16)
+	{
+	  __m256i s0 = _mm256_loadu_si256((const __m256i *)msg);
+	  __m256i s1 = _mm256_loadu_si256((const __m256i *)(msg + 8));
+	  __m256i m_lo = _mm256_permute2x128_si256(s0, s1, 0x20);
+	  __m256i m_hi = _mm256_permute2x128_si256(s0, s1, 0x31);
+
+	  for(i = 0; i < iters; ++i)
+	    acc2[i] = _mm256_add_epi64(acc2[i], nh_2steps_avx2(m_lo, m_hi, key + 4 * i));
+	}
+
+      for(i = 0; i < iters; ++i)
+	acc[i] = _mm_add_epi64(_mm256_castsi256_si128(acc2[i]),
+			       _mm256_extracti128_si256(acc2[i], 1));
+    }
+#endif
+
+  for(; steps; --steps, msg += 8, key += 8)
+    {
+      __m128i m_lo = _mm_loadu_si128((const __m128i *)msg);
+      __m128i m_hi = _mm_loadu_si128((const __m128i *)(msg + 4));
+
+      for(i = 0; i < iters; ++i)
+	acc[i] = _mm_add_epi64(acc[i], nh_step_sse2(m_lo, m_hi, key + 4 * i));
+    }
+
+  for(i = 0; i < iters; ++i)
+    {
+      uint64_t lanes[2];
+      _mm_storeu_si128((__m128i *)lanes, acc[i]);
+      out[i] = lanes[0] + lanes[1];
+    }
+}
+
+/** Loads the step of a short message, or its zero padded tail. */
+static inline const uint32_t *
+short_msg_step(const uint8_t *msg, size_t full_steps, const uint32_t *tail, size_t step)
+{
+  return step < full_steps ? (const uint32_t *)(msg + step * 32) : tail;
 }
 
+/** NH of two short messages at once, each with its zero padded last step,
+ * sharing the key loads. The steps the messages have in common are hashed
+ * together, with AVX2 in the two halves of the registers, otherwise in two
+ * independent chains; the longer message finishes alone.
+ * @param key The L1 key at the first step.
+ * @param msg_a The first message, of up to 1 KB; may be unaligned.
+ * @param msg_b The second message, of up to 1 KB; may be unaligned.
+ * @param out_a Where to store the NH sum of each iteration of msg_a.
+ * @param out_b Where to store the NH sum of each iteration of msg_b.
+ */
 static void
-mul64(uint64_t a, uint64_t b, uint128 *out)
+nh_short_pair(const uint32_t *key, const uint8_t *msg_a, size_t len_a,
+	      const uint8_t *msg_b, size_t len_b, int iters,
+	      uint64_t *out_a, uint64_t *out_b)
 {
-  static const uint64_t b32_mask = ((uint64_t)1u << 32) - 1;
-  uint64_t x0, x1, y0, y1;
-  uint64_t tmp0, tmp1;
+  const size_t full_a = len_a / 32, full_b = len_b / 32;
+  /* An empty message has one zero padded step. */
+  const size_t steps_a = full_a + (len_a % 32 || !len_a);
+  const size_t steps_b = full_b + (len_b % 32 || !len_b);
+  const size_t common = min(steps_a, steps_b);
+  uint32_t tail_a[8] = {0}, tail_b[8] = {0};
+  __m128i acc_a[4], acc_b[4];
+  size_t step;
+  int i;
+
+  memcpy(tail_a, msg_a + full_a * 32, len_a % 32);
+  memcpy(tail_b, msg_b + full_b * 32, len_b % 32);
+
+#ifdef __AVX2__
+  {
+    __m256i acc[4];
+
+    for(i = 0; i < iters; ++i)
+      acc[i] = _mm256_setzero_si256();
+
+    for(step = 0; step < common; ++step, key += 8)
+      {
+	const uint32_t *a = short_msg_step(msg_a, full_a, tail_a, step);
+	const uint32_t *b = short_msg_step(msg_b, full_b, tail_b, step);
+	__m256i m_lo = _mm256_inserti128_si256(
+	    _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)a)),
+	    _mm_loadu_si128((const __m128i *)b), 1);
+	__m256i m_hi = _mm256_inserti128_si256(
+	    _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(a + 4))),
+	    _mm_loadu_si128((const __m128i *)(b + 4)), 1);
+
+	for(i = 0; i < iters; ++i)
+	  {
+	    __m256i x = _mm256_add_epi32(m_lo, _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *)(key + 4 * i))));
+	    __m256i y = _mm256_add_epi32(m_hi, _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *)(key + 4 * i + 4))));
+
+	    acc[i] = _mm256_add_epi64(acc[i], _mm256_add_epi64(
+		_mm256_mul_epu32(x, y),
+		_mm256_mul_epu32(_mm256_srli_epi64(x, 32), _mm256_srli_epi64(y, 32))));
+	  }
+      }
+
+    for(i = 0; i < iters; ++i)
+      {
+	acc_a[i] = _mm256_castsi256_si128(acc[i]);
+	acc_b[i] = _mm256_extracti128_si256(acc[i], 1);
+      }
+  }
+#else
+  for(i = 0; i < iters; ++i)
+    acc_a[i] = acc_b[i] = _mm_setzero_si128();
+
+  for(step = 0; step < common; ++step, key += 8)
+    {
+      const uint32_t *a = short_msg_step(msg_a, full_a, tail_a, step);
+      const uint32_t *b = short_msg_step(msg_b, full_b, tail_b, step);
+      __m128i a_lo = _mm_loadu_si128((const __m128i *)a);
+      __m128i a_hi = _mm_loadu_si128((const __m128i *)(a + 4));
+      __m128i b_lo = _mm_loadu_si128((const __m128i *)b);
+      __m128i b_hi = _mm_loadu_si128((const __m128i *)(b + 4));
+
+      for(i = 0; i < iters; ++i)
+	{
+	  __m128i k_lo = _mm_loadu_si128((const __m128i *)(key + 4 * i));
+	  __m128i k_hi = _mm_loadu_si128((const __m128i *)(key + 4 * i + 4));
+	  __m128i x = _mm_add_epi32(a_lo, k_lo), y = _mm_add_epi32(a_hi, k_hi);
+	  __m128i z = _mm_add_epi32(b_lo, k_lo), w = _mm_add_epi32(b_hi, k_hi);
+
+	  acc_a[i] = _mm_add_epi64(acc_a[i], _mm_add_epi64(
+	      _mm_mul_epu32(x, y),
+	      _mm_mul_epu32(_mm_srli_epi64(x, 32), _mm_srli_epi64(y, 32))));
+	  acc_b[i] = _mm_add_epi64(acc_b[i], _mm_add_epi64(
+	      _mm_mul_epu32(z, w),
+	      _mm_mul_epu32(_mm_srli_epi64(z, 32), _mm_srli_epi64(w, 32))));
+	}
+    }
+#endif
+
+  /* The rest of the longer message. */
+  for(; step < steps_a; ++step, key += 8)
+    {
+      const uint32_t *a = short_msg_step(msg_a, full_a, tail_a, step);
+      __m128i m_lo = _mm_loadu_si128((const __m128i *)a);
+      __m128i m_hi = _mm_loadu_si128((const __m128i *)(a + 4));
+
+      for(i = 0; i < iters; ++i)
+	acc_a[i] = _mm_add_epi64(acc_a[i], nh_step_sse2(m_lo, m_hi, key + 4 * i));
+    }
+  for(; step < steps_b; ++step, key += 8)
+    {
+      const uint32_t *b = short_msg_step(msg_b, full_b, tail_b, step);
+      __m128i m_lo = _mm_loadu_si128((const __m128i *)b);
+      __m128i m_hi = _mm_loadu_si128((const __m128i *)(b + 4));
+
+      for(i = 0; i < iters; ++i)
+	acc_b[i] = _mm_add_epi64(acc_b[i], nh_step_sse2(m_lo, m_hi, key + 4 * i));
+    }
+
+  for(i = 0; i < iters; ++i)
+    {
+      uint64_t lanes[4];
+      _mm_storeu_si128((__m128i *)lanes, acc_a[i]);
+      _mm_storeu_si128((__m128i *)(lanes + 2), acc_b[i]);
+      out_a[i] = lanes[0] + lanes[1];
+      out_b[i] = lanes[2] + lanes[3];
+    }
+}
+
+#else
 
-  x0 = a & b32_mask;
-  x1 = a >> 32;
-  y0 = b & b32_mask;
-  y1 = b >> 32;
+#define NH_ANY_ALIGNMENT 0
+#define NH_PAIR 0
 
-  /* Final multiplication: out.v[0] * 2^64 + (tmp0 + tmp1) * 2^32 + out.v[1]. */
-  out->v[1] = x0 * y0;
-  out->v[0] = x1 * y1;
-  tmp0 = x1 * y0;
-  tmp1 = x0 * y1;
+/**
+ * @param key The L1 key at the first step.
+ * @param msg When cast from a byte array, must be in native byte-order...
+ * @param out Where to store the NH sum of each iteration.
+ */
+static ALWAYS_INLINE void
+nh_steps(const uint32_t *key, const uint32_t *msg, size_t steps, int iters,
+	 uint64_t *out)
+{
+  int i, j;
 
-  /* Sum tmp0 and tmp1 into a single 64 bits number (may carry). */
-  tmp0 += tmp1;
+  for(i = 0; i < iters; ++i)
+    out[i] = 0;
 
-  /* Add up least significant 32 bit part (may carry). */
-  uint64_t least = tmp0 << 32;
-  out->v[1] += least;
+  for(; steps; --steps, msg += 8, key += 8)
+    {
+      uint32_t m[8];
+      for(j = 0; j < 8; ++j)
+	m[j] = htole32(msg[j]);
 
-  /* Add up most significant 32 bit part and possible carries.
-     This will not overflow, because the result final result can't be
-     bigger than 128 bits. */
-  out->v[0] += (tmp0 >> 32)
-    + (tmp0 < tmp1 ? ((uint64_t)1u << 32) : 0) /* tmp0 + tmp1 carry */
-    + (out->v[1] < least); /* out.v[1] + least carry */
+      for(i = 0; i < iters; ++i)
+	{
+	  const uint32_t *k = key + 4 * i;
+	  for(j = 0; j < 4; ++j)
+	    out[i] += (uint64_t)(m[j] + k[j]) * (uint64_t)(m[4 + j] + k[4 + j]);
+	}
+    }
 }
 
+#endif
+
+/* Modular arithmetic for the polynomial hashes. There are no divisions,
+ * the primes are of the form 2^n - offset, so the high part of a number is
+ * folded into the low part multiplying it by the offset, and the result is
+ * fully reduced by a conditional subtraction. */
+
 static const uint64_t offset_p64 = 59;
 static const uint64_t p64 = (uint64_t)0u - 59;
 
+/**
+ * @param x may be any 64 bits value.
+ * @param y may be any 64 bits value.
+ */
 static uint64_t
 sum_mod_p64(uint64_t x, uint64_t y)
 {
-  uint64_t lower = x + y;
-  if(lower < x)
-    return (lower - p64) % p64;
-  else
-    return lower % p64;
+  uint64_t sum = x + y;
+
+  /* If overflow, 2^64 = offset_p64 (mod p64), that may overflow again,
+   * but then the sum is small. */
+  if(sum < x) {
+    sum += offset_p64;
+    if(sum < offset_p64)
+      sum += offset_p64;
+  }
+
+  if(sum >= p64)
+    sum -= p64;
+
+  return sum;
 }
 
 static uint64_t
 mul_mod_p64(uint64_t x, uint64_t y)
 {
-  uint128 mul;
+  uint128 mul, high;
   mul64(x, y, &mul);
 
-  uint64_t ret;
+  /* Fold the most significant part: mul.v[0] * 2^64 = mul.v[0] * offset_p64,
+   * which is at most 70 bits, so fold it again. */
+  mul64(mul.v[0], offset_p64, &high);
 
-  /* Mod p64 of the most significative nibble, (may recurse).
-     Can't prove right now, but if offset_p64 is small enough,
-     recursion will stop very fast.*/
-  if(mul.v[0] > 312656679215416129)
-    /* If greater than the biggest number that multiplied by offset_p64
-     * still fits in 64 bits, recurse. */
-    ret = mul_mod_p64(mul.v[0], offset_p64);
-  else
-    ret = mul.v[0] * offset_p64;
-
-  ret = sum_mod_p64(ret, mul.v[1]);
-
-  return ret;
+  return sum_mod_p64(sum_mod_p64(mul.v[1], high.v[1]), high.v[0] * offset_p64);
 }
 
+/** Message words (or the most significant word, for POLY-128) from this value
+ * on are hashed in two polynomial iterations. */
+static const uint64_t poly_maxwordrange = 0xffffffff00000000u;
+
 static uint64_t
 poly64_iteration(uint64_t key, uint64_t m, uint64_t y)
 {
   const uint64_t marker = p64 - 1;
-  const uint64_t maxwordrange = 0xffffffff00000000u;
 
   y = mul_mod_p64(key, y);
-  if(m >= maxwordrange)
+  if(m >= poly_maxwordrange)
     {
       y = sum_mod_p64(y, marker);
       y = sum_mod_p64(mul_mod_p64(key, y), m - offset_p64);
@@ -218,37 +454,49 @@ sum_mod_p128(const uint128 *x, const uint128 *y, uint128 *out)
 static void
 mul_mod_p128(const uint128 *x, const uint128 *y, uint128 *out)
 {
-  const uint128 offset = {{0, offset_p128}};
   uint256 mul;
-  mul128(x, y, &mul);
+  uint128 low, high, sum;
+  uint64_t mid, top;
+  int carry;
 
-  uint256 inter; /* Only inter.least is actually used. */
+  mul128(x, y, &mul);
 
-  /* Mod p128 of the most significative nibble, (may recurse).
-     Can't prove right now, but if offset_p64 is small enough,
-     recursion will stop very fast.*/
-  if(mul.most.v[0] < 0x19c2d14ee4a1019u
-     || (mul.most.v[0] == 0x19c2d14ee4a1019u
-	 && mul.most.v[1] <= 0xc2d14ee4a1019c2du))
-    /* If multiplication will fit, do simple multiplication. */
-    /* TODO: could implement mul(u128, u64) -> u128, since we
-       know result will be at most 128 bits. */
-    mul128(&mul.most, &offset, &inter);
-  else {
-    /* Otherwise, recurse. */
-    mul_mod_p128(&mul.most, &offset, &inter.least);
+  /* 2^128 = offset_p128 (mod p128), so fold the most significant half:
+   * mul.most * offset_p128 = top * 2^128 + mid * 2^64 + low.v[1] */
+  mul64(mul.most.v[1], offset_p128, &low);
+  mul64(mul.most.v[0], offset_p128, &high);
+  mid = high.v[1] + low.v[0];
+  top = high.v[0] + (mid < low.v[0]);
+
+  /* Add it to the least significant half. */
+  sum.v[1] = mul.least.v[1] + low.v[1];
+  carry = sum.v[1] < low.v[1];
+  sum.v[0] = mul.least.v[0] + mid;
+  top += (sum.v[0] < mid);
+  sum.v[0] += carry;
+  top += (sum.v[0] < carry);
+
+  /* Fold the few remaining top bits, and the possible overflow of it
+   * (in which case the sum is small enough not to overflow again). */
+  top *= offset_p128;
+  sum.v[1] += top;
+  if(sum.v[1] < top && !++sum.v[0])
+    sum.v[1] += offset_p128;
+
+  /* Fully reduce. */
+  if(sum.v[0] == p128.v[0] && sum.v[1] >= p128.v[1]) {
+    sum.v[0] = 0;
+    sum.v[1] -= p128.v[1];
   }
 
-  sum_mod_p128(&inter.least, &mul.least, out);
+  *out = sum;
 }
 
 static void
 poly128_iteration(const uint128 *key, const uint128 *m, uint128 *y)
 {
-  const uint64_t maxwordrange_msw = 0xffffffff00000000u;
-
   mul_mod_p128(key, y, y);
-  if(m->v[0] >= maxwordrange_msw)
+  if(m->v[0] >= poly_maxwordrange)
     {
       sum_mod_p128(&marker_p128, y, y);
       mul_mod_p128(key, y, y);
@@ -330,35 +578,114 @@ l3_hash(const uint64_t *k1, uint32_t k2, const uint128 *m)
 	   & 0xffffu); /* Filter selected 16 lower bits. */
   }
 
-  return (uint32_t)(y % p36) ^ k2;
+  /* Reduce mod p36 = 2^36 - 5, by folding twice the bits above 36. */
+  y = (y & 0xFFFFFFFFFu) + (y >> 36) * 5;
+  y = (y & 0xFFFFFFFFFu) + (y >> 36) * 5;
+  if(y >= p36)
+    y -= p36;
+
+  return (uint32_t)y ^ k2;
+}
+
+void
+umac_poly128_iteration(const uint128 *key, const uint128 *m, uint128 *y)
+{
+  poly128_iteration(key, m, y);
+}
+
+uint32_t
+umac_l3_hash(const uint64_t *k1, uint32_t k2, const uint128 *m)
+{
+  return l3_hash(k1, k2, m);
+}
+
+void
+umac_l3_keys_setup(buffered_state *full_state, uint64_t *k1, uint32_t *k2, size_t count)
+{
+  size_t i;
+
+  buffered_action(full_state, (uint8_t*)k1, count * 64, BUFFERED_EXTRACT);
+  for(i = 0; i < count * 8; ++i)
+    k1[i] %= p36;
+
+  buffered_action(full_state, (uint8_t*)k2, count * 4, BUFFERED_EXTRACT);
 }
 
-static inline void
-uhash_step(const uint32_t *buffer, uint64_t step_count,
-    const uint32_t *l1key, const l2_key *l2key,
-    uhash_iteration_state *partial)
+/** Layout of the key and state of an UHASH type. The functions specialized
+ * for each type use it with compile time constants, so that the loops over
+ * the iterations can be unrolled and the key addresses are fixed. */
+typedef struct
 {
-  int substep = step_count % 32;
-  if(step_count && substep == 0) {
-    l2_hash_iteration(l2key, &partial->l2, partial->l1 + 8192u, step_count);
+  int iters;
+  size_t l2key_offset;
+  size_t l3key1_offset;
+  size_t l3key2_offset;
+} uhash_layout;
+
+#define UHASH_LAYOUT(bits)						\
+  ((uhash_layout){(bits)/32, offsetof(uhash_##bits##_key, l2key),	\
+      offsetof(uhash_##bits##_key, l3key1), offsetof(uhash_##bits##_key, l3key2)})
+
+/** Layout of a key only known at run time. */
+static ALWAYS_INLINE uhash_layout
+key_layout(const uhash_key *key)
+{
+  uhash_layout layout = {key->attribs->iters, key->attribs->l2key_offset,
+			 key->attribs->l3key1_offset, key->attribs->l3key2_offset};
+  return layout;
+}
+
+static ALWAYS_INLINE void
+l2_block_body(const uhash_key *key, uhash_state *state, const uhash_layout layout)
+{
+  const uint8_t *key_base = (const uint8_t *)key;
+  int i;
+
+  for(i = 0; i < layout.iters; ++i) {
+    uhash_iteration_state *partial = &state->partial[i];
+    l2_hash_iteration((const l2_key *)(key_base + layout.l2key_offset) + i,
+	&partial->l2, partial->l1 + 8192u, state->common.step_count);
     partial->l1 = 0;
   }
+}
 
-  partial->l1 += nh_iteration(l1key + substep * 8, buffer);
+/** L2 hashes the L1 output of the last completed block. */
+static void
+uhash_l2_block(const uhash_key *key, uhash_state *state)
+{
+  l2_block_body(key, state, key_layout(key));
 }
 
-static inline void
-uhash_step_iterations(const uhash_key *key, uhash_state *state, const uint32_t *buffer)
+/** Hashes a sequence of whole 32 bytes steps.
+ *
+ * The steps are given to NH a whole L1 block at a time, and L2 runs once
+ * between the blocks. The L2 hash of a block is delayed until the next step
+ * is known to exist, because the last one is handled by uhash_finish().
+ */
+static ALWAYS_INLINE void
+uhash_steps(const uhash_key *key, uhash_state *state, const uint32_t *msg, size_t steps,
+	    const uhash_layout layout)
 {
-  const uint8_t *key_base = (const uint8_t *)key;
+  const uint32_t *l1key = (const uint32_t *)((const uint8_t *)key + sizeof(uhash_key));
+  uint64_t sums[4];
   int i;
-  for(i = 0; i < state->common.iters; ++i) {
-    uhash_step(buffer, state->common.step_count,
-	(const uint32_t *)(key_base + sizeof(uhash_key) + (i * 16)),
-	(const l2_key *)(key_base + key->attribs->l2key_offset + (i * 24)),
-        &state->partial[i]);
+
+  while(steps) {
+    int substep = state->common.step_count % 32;
+    size_t count = min(32 - substep, steps);
+
+    /* A full L1 block was completed, hash it with L2. */
+    if(state->common.step_count && substep == 0)
+      l2_block_body(key, state, layout);
+
+    nh_steps(l1key + substep * 8, msg, count, layout.iters, sums);
+    for(i = 0; i < layout.iters; ++i)
+      state->partial[i].l1 += sums[i];
+
+    state->common.step_count += count;
+    msg += count * 8;
+    steps -= count;
   }
-  ++state->common.step_count;
 }
 
 #define UHASH_SPECIFICS_DEF(bits)					\
@@ -383,50 +710,57 @@ const uhash_key_attributes *const uhash_attributes_array[4] = {
     &uhash_128_attributes
 };
 
-void
-uhash_key_setup(uhash_type type, uhash_key *key, buffered_state *full_state)
+/** Size of the L1 key, at the start of the key material in the stream. */
+static size_t
+l1_key_size(int iters)
+{
+  return 1024 + (iters - 1) * 16;
+}
+
+/** Extracts and processes the L2 keys, that follow the L1 key in the stream. */
+static void
+l2_keys_setup(uhash_key *key, buffered_state *full_state)
 {
-  const size_t iter_idx = (size_t)type;
-  const size_t iters = iter_idx + 1;
   uint8_t *key_base = (uint8_t *)key;
-  const uhash_key_attributes *attribs;
+  const int iters = key->attribs->iters;
+  int i;
 
-  key->attribs = attribs = uhash_attributes_array[iter_idx];
+  /** Room for biggest possible L2 key. */
+  uint64_t l2_keydata[12];
 
-  /* Extract L1 key. */
-  buffered_action(full_state, key_base + sizeof(uhash_key), 1024 + iter_idx * 16, BUFFERED_EXTRACT);
+  buffered_action(full_state, (uint8_t*)l2_keydata, iters * 24, BUFFERED_EXTRACT);
 
-  /* Extract and process L2 key. */
+  for(i = 0; i < iters; ++i)
   {
-    int i;
-
-    /** Room for biggest possible L2 key. */
-    uint64_t l2_keydata[12];
+    l2_key *l2key = (l2_key *)(key_base + key->attribs->l2key_offset) + i;
 
-    buffered_action(full_state, (uint8_t*)l2_keydata, iters * 24, BUFFERED_EXTRACT);
+    l2key->k64 = l2_keydata[i*3] & UMAC_POLY_KEY_MASK;
+    l2key->k128.v[1] = l2_keydata[i*3 + 1] & UMAC_POLY_KEY_MASK;
+    l2key->k128.v[0] = l2_keydata[i*3 + 2] & UMAC_POLY_KEY_MASK;
+  }
+}
 
-    for(i = 0; i < iters; ++i)
-    {
-      static const uint64_t keymask = 0x01ffffff01ffffffu;
-      l2_key *l2key = (l2_key *)(key_base + attribs->l2key_offset) + i;
+/** Extracts and processes the L3 keys, that follow the L2 keys. */
+static void
+l3_keys_setup(uhash_key *key, buffered_state *full_state)
+{
+  uint8_t *key_base = (uint8_t *)key;
 
-      l2key->k64 = l2_keydata[i*3] & keymask;
-      l2key->k128.v[1] = l2_keydata[i*3 + 1] & keymask;
-      l2key->k128.v[0] = l2_keydata[i*3 + 2] & keymask;
-    }
-  }
+  umac_l3_keys_setup(full_state, (uint64_t *)(key_base + key->attribs->l3key1_offset),
+		     (uint32_t *)(key_base + key->attribs->l3key2_offset), key->attribs->iters);
+}
 
-  /* Extract and process L3 keys. */
-  {
-    int i;
-    uint64_t *l3key1 = (uint64_t *)(key_base + attribs->l3key1_offset);
+void
+uhash_key_setup(uhash_type type, uhash_key *key, buffered_state *full_state)
+{
+  const size_t iter_idx = (size_t)type;
 
-    buffered_action(full_state, (uint8_t*)l3key1, iters * 64, BUFFERED_EXTRACT);
-    for(i = 0; i < iters * 8; ++i)
-      l3key1[i] %= p36;
+  key->attribs = uhash_attributes_array[iter_idx];
 
-    buffered_action(full_state, key_base + attribs->l3key2_offset, iters * 4, BUFFERED_EXTRACT);
-  }
+  buffered_action(full_state, (uint8_t *)key + sizeof(uhash_key),
+		  l1_key_size(iter_idx + 1), BUFFERED_EXTRACT);
+  l2_keys_setup(key, full_state);
+  l3_keys_setup(key, full_state);
 }
 
 uhash_type
@@ -435,13 +769,12 @@ uhash_get_type_from_key(uhash_key *key)
   return (uhash_type)(key->attribs->iters - 1);
 }
 
-void
-uhash_init(uhash_type type, uhash_state *state)
+static ALWAYS_INLINE void
+init_body(uhash_state *state, const int iters)
 {
   int i;
-  int iters;
 
-  state->common.iters = iters = (size_t)type + 1;
+  state->common.iters = iters;
   state->common.buffer_len = 0;
   state->common.step_count = 0;
 
@@ -452,8 +785,9 @@ uhash_init(uhash_type type, uhash_state *state)
   }
 }
 
-void
-uhash_update(const uhash_key *key, uhash_state *state, const uint8_t *input, size_t len)
+static ALWAYS_INLINE void
+update_body(const uhash_key *key, uhash_state *state, const uint8_t *input, size_t len,
+	    const uhash_layout layout)
 {
   size_t processed = 0;
 
@@ -469,24 +803,25 @@ uhash_update(const uhash_key *key, uhash_state *state, const uint8_t *input, siz
 
     /* If full, process it. */
     if(state->common.buffer_len == 32) {
-      uhash_step_iterations(key, state, state->common.buffer);
+      uhash_steps(key, state, state->common.buffer, 1, layout);
       state->common.buffer_len = 0;
     }
   }
 
   /* For the rest of the input, process in 32 bytes chunks. */
-  if(UNALIGNED_ACCESS || is_aligned(input + processed)) {
+  if(UNALIGNED_ACCESS || NH_ANY_ALIGNMENT || is_aligned(input + processed)) {
     /* If the machine supports unaligned memory access, or the memory happens to be aligned,
-     * use the input pointer directly. */
-    for(; processed + 32 <= len; processed += 32)
-      uhash_step_iterations(key, state, (const uint32_t *)(input + processed));
+     * use the input pointer directly, as many steps at once as possible. */
+    size_t steps = (len - processed) / 32;
+    uhash_steps(key, state, (const uint32_t *)(input + processed), steps, layout);
+    processed += steps * 32;
   } else {
     /* Memory must be aligned before casting to 32 bits, so copy it to the aligned buffer
      * before using. */
     assert(!(processed + 32 <= len) || (state->common.buffer_len == 0));
     for(; processed + 32 <= len; processed += 32) {
       memcpy(state->common.buffer, input + processed, 32);
-      uhash_step_iterations(key, state, state->common.buffer);
+      uhash_steps(key, state, state->common.buffer, 1, layout);
     }
   }
 
@@ -500,11 +835,13 @@ uhash_update(const uhash_key *key, uhash_state *state, const uint8_t *input, siz
   }
 }
 
-void uhash_finish(const uhash_key *key, uhash_state *state, uint8_t *output)
+static ALWAYS_INLINE void
+finish_body(const uhash_key *key, uhash_state *state, uint8_t *output,
+	    const uhash_layout layout)
 {
-  /* TODO: move all "for iters" to outer loop. It doesn't pay to have them inner. */
   const uint8_t *key_base = (const uint8_t *)key;
   uint64_t to_add_l1;
+  uint64_t sums[4] = {0};
   int has_leftover, must_run_l2;
   int substep = state->common.step_count % 32;
   int i;
@@ -522,16 +859,18 @@ void uhash_finish(const uhash_key *key, uhash_state *state, uint8_t *output)
   if(has_leftover) {
     memset((uint8_t *)state->common.buffer + state->common.buffer_len,
 	0, 32 - state->common.buffer_len);
+    nh_steps((const uint32_t *)(key_base + sizeof(uhash_key)) + substep * 8,
+	state->common.buffer, 1, layout.iters, sums);
   }
 
   must_run_l2 = (state->common.step_count > 32 && substep == 0)
 		    || (state->common.step_count == 32 && state->common.buffer_len);
 
   /* For each algorithm iteration... */
-  for(i = 0; i < state->common.iters; ++i) {
+  for(i = 0; i < layout.iters; ++i) {
     uhash_iteration_state *partial = &state->partial[i];
     size_t step_count = state->common.step_count;
-    const l2_key *l2key = (const l2_key *)(key_base + key->attribs->l2key_offset + (i * 24));
+    const l2_key *l2key = (const l2_key *)(key_base + layout.l2key_offset) + i;
 
     /* If there is a full L1 completed, and more than 1024 bytes, then L2 hash it. */
     if(must_run_l2) {
@@ -541,8 +880,7 @@ void uhash_finish(const uhash_key *key, uhash_state *state, uint8_t *output)
 
     /* Process the leftover on buffer. */
     if(has_leftover) {
-      partial->l1 += nh_iteration((const uint32_t *)(key_base + sizeof(uhash_key)) + 4 * i + substep * 8,
-	  (const uint32_t *)state->common.buffer);
+      partial->l1 += sums[i];
       ++step_count;
     }
 
@@ -561,11 +899,1058 @@ void uhash_finish(const uhash_key *key, uhash_state *state, uint8_t *output)
     }
 
     /* Finally, run L3 hash and calculates output. */
+    unpack_bigendian(
+	l3_hash((const uint64_t *)(key_base + layout.l3key1_offset + (i * 64)),
+	    *(const uint32_t *)(key_base + layout.l3key2_offset + (i * 4)),
+	    &state->partial[i].l2.y),
+	&output[i*4]);
+  }
+}
+
+#define UHASH_SPECIALIZED_DEF(bits)					\
+  void									\
+  uhash_##bits##_init(uhash_##bits##_state *state)			\
+  {									\
+    init_body((uhash_state *)state, (bits)/32);				\
+  }									\
+									\
+  void									\
+  uhash_##bits##_update(const uhash_##bits##_key *key,			\
+			uhash_##bits##_state *state,			\
+			const uint8_t *input, size_t len)		\
+  {									\
+    update_body(&key->header, (uhash_state *)state, input, len,	\
+		UHASH_LAYOUT(bits));					\
+  }									\
+									\
+  void									\
+  uhash_##bits##_finish(const uhash_##bits##_key *key,			\
+			uhash_##bits##_state *state, uint8_t *output)	\
+  {									\
+    finish_body(&key->header, (uhash_state *)state, output,		\
+		UHASH_LAYOUT(bits));					\
+  }
+
+UHASH_SPECIALIZED_DEF(32)
+UHASH_SPECIALIZED_DEF(64)
+UHASH_SPECIALIZED_DEF(96)
+UHASH_SPECIALIZED_DEF(128)
+
+#undef UHASH_SPECIALIZED_DEF
+
+/* The generic interface dispatches to the specialized functions. */
+
+void
+uhash_init(uhash_type type, uhash_state *state)
+{
+  switch(type) {
+  case UHASH_32:
+    uhash_32_init((uhash_32_state *)state);
+    break;
+  case UHASH_64:
+    uhash_64_init((uhash_64_state *)state);
+    break;
+  case UHASH_96:
+    uhash_96_init((uhash_96_state *)state);
+    break;
+  case UHASH_128:
+    uhash_128_init((uhash_128_state *)state);
+    break;
+  }
+}
+
+void
+uhash_update(const uhash_key *key, uhash_state *state, const uint8_t *input, size_t len)
+{
+  switch(state->common.iters) {
+  case 1:
+    uhash_32_update((const uhash_32_key *)key, (uhash_32_state *)state, input, len);
+    break;
+  case 2:
+    uhash_64_update((const uhash_64_key *)key, (uhash_64_state *)state, input, len);
+    break;
+  case 3:
+    uhash_96_update((const uhash_96_key *)key, (uhash_96_state *)state, input, len);
+    break;
+  case 4:
+    uhash_128_update((const uhash_128_key *)key, (uhash_128_state *)state, input, len);
+    break;
+  }
+}
+
+void
+uhash_finish(const uhash_key *key, uhash_state *state, uint8_t *output)
+{
+  switch(state->common.iters) {
+  case 1:
+    uhash_32_finish((const uhash_32_key *)key, (uhash_32_state *)state, output);
+    break;
+  case 2:
+    uhash_64_finish((const uhash_64_key *)key, (uhash_64_state *)state, output);
+    break;
+  case 3:
+    uhash_96_finish((const uhash_96_key *)key, (uhash_96_state *)state, output);
+    break;
+  case 4:
+    uhash_128_finish((const uhash_128_key *)key, (uhash_128_state *)state, output);
+    break;
+  }
+}
+
+
+/* Parallel UHASH.
+ *
+ * NH of each block is independent, and so is the polynomial hash of a run of
+ * blocks: hashing n words with key k from an initial y gives y * k^n + H,
+ * where H is the hash of the same words starting from zero. So the threads
+ * hash runs of blocks from zero, and the results are combined in order with
+ * the key powers. The few blocks around the POLY-64 to POLY-128 switch, or
+ * not aligned to POLY-128 pairs, have only the NH done in parallel. */
+
+/** Minimum number of whole L1 blocks for the input to be split. */
+#define PARALLEL_MIN_BLOCKS 256
+
+/** Minimum number of L1 blocks in each task. */
+#define PARALLEL_MIN_TASK 64
+
+/** Index of the first L1 block hashed with POLY-128. */
+#define POLY128_FIRST_BLOCK (l2_limit / 32)
+
+typedef enum
+{
+  TASK_POLY64, /**< POLY-64 hash of a run of blocks. */
+  TASK_POLY128, /**< POLY-128 hash of a run of whole pairs of blocks. */
+  TASK_SINGLE /**< L1 output of a single block. */
+} parallel_task_kind;
+
+typedef struct
+{
+  parallel_task_kind kind;
+  uint64_t first_block;
+  uint64_t block_count;
+
+  /** Per iteration, hash of the run from zero, or L1 output if single. */
+  uint128 hash[4];
+  /** Per iteration, number of polynomial iterations done in the run. */
+  uint64_t mults[4];
+} parallel_task;
+
+typedef struct
+{
+  const uhash_key *key;
+  int iters;
+  /** Where the block of index first_block starts. */
+  const uint8_t *input;
+  uint64_t first_block;
+
+  parallel_task *tasks;
+  size_t task_count;
+  size_t next_task;
+} parallel_job;
+
+static uint64_t
+pow_mod_p64(uint64_t base, uint64_t exp)
+{
+  uint64_t ret = 1;
+
+  for(; exp; exp >>= 1) {
+    if(exp & 1)
+      ret = mul_mod_p64(ret, base);
+    base = mul_mod_p64(base, base);
+  }
+
+  return ret;
+}
+
+static void
+pow_mod_p128(const uint128 *base, uint64_t exp, uint128 *out)
+{
+  uint128 sq = *base;
+
+  out->v[0] = 0;
+  out->v[1] = 1;
+  for(; exp; exp >>= 1) {
+    if(exp & 1)
+      mul_mod_p128(out, &sq, out);
+    mul_mod_p128(&sq, &sq, &sq);
+  }
+}
+
+static void
+run_task(const parallel_job *job, parallel_task *task)
+{
+  const uint8_t *key_base = (const uint8_t *)job->key;
+  const uint32_t *l1key = (const uint32_t *)(key_base + sizeof(uhash_key));
+  const l2_key *l2key = (const l2_key *)(key_base + job->key->attribs->l2key_offset);
+  const uint8_t *msg = job->input + (task->first_block - job->first_block) * 1024;
+  uint32_t aligned[256];
+  uint64_t sums[4], even[4];
+  uint64_t b;
+  int i;
+
+  for(i = 0; i < job->iters; ++i) {
+    task->hash[i].v[0] = task->hash[i].v[1] = 0;
+    task->mults[i] = 0;
+  }
+
+  for(b = 0; b < task->block_count; ++b, msg += 1024) {
+    const uint32_t *words = (const uint32_t *)msg;
+
+    if(!(UNALIGNED_ACCESS || NH_ANY_ALIGNMENT) && !is_aligned(msg)) {
+      memcpy(aligned, msg, 1024);
+      words = aligned;
+    }
+    nh_steps(l1key, words, 32, job->iters, sums);
+
+    for(i = 0; i < job->iters; ++i) {
+      uint64_t l1 = sums[i] + 8192u;
+
+      switch(task->kind) {
+      case TASK_POLY64:
+	task->hash[i].v[1] = poly64_iteration(l2key[i].k64, l1, task->hash[i].v[1]);
+	task->mults[i] += 1 + (l1 >= poly_maxwordrange);
+	break;
+      case TASK_POLY128:
+	if(!(b & 1)) {
+	  even[i] = l1;
+	} else {
+	  uint128 m = {{even[i], l1}};
+	  poly128_iteration(&l2key[i].k128, &m, &task->hash[i]);
+	  task->mults[i] += 1 + (even[i] >= poly_maxwordrange);
+	}
+	break;
+      case TASK_SINGLE:
+	task->hash[i].v[1] = l1;
+	break;
+      }
+    }
+  }
+}
+
+static void *
+parallel_worker(parallel_job *job)
+{
+  size_t t;
+
+  while((t = __atomic_fetch_add(&job->next_task, 1, __ATOMIC_RELAXED)) < job->task_count)
+    run_task(job, &job->tasks[t]);
+
+  return NULL;
+}
+
+/** Splits blocks [first, end) in tasks of at most task_size blocks. */
+static size_t
+add_tasks(parallel_task *tasks, size_t count, parallel_task_kind kind,
+	  uint64_t first, uint64_t end, uint64_t task_size)
+{
+  while(first < end) {
+    parallel_task *task = &tasks[count++];
+    task->kind = kind;
+    task->first_block = first;
+    task->block_count = min(task_size, end - first);
+    first += task->block_count;
+  }
+
+  return count;
+}
+
+/** Plans the tasks to L2 hash blocks [first, end), returns how many. */
+static size_t
+plan_tasks(parallel_task *tasks, uint64_t first, uint64_t end, uint64_t task_size)
+{
+  size_t count;
+  uint64_t b;
+
+  count = add_tasks(tasks, 0, TASK_POLY64, first, min(end, POLY128_FIRST_BLOCK), task_size);
+
+  /* The first two POLY-128 blocks are special, and the pairs are aligned to
+   * even blocks, so one block may be left at each end. */
+  for(b = first > POLY128_FIRST_BLOCK ? first : POLY128_FIRST_BLOCK;
+      b < end && (b < POLY128_FIRST_BLOCK + 2 || (b & 1)); ++b)
+    count = add_tasks(tasks, count, TASK_SINGLE, b, b + 1, 1);
+
+  if(b < end) {
+    uint64_t pairs_end = end - ((end - b) & 1);
+    count = add_tasks(tasks, count, TASK_POLY128, b, pairs_end, task_size);
+    count = add_tasks(tasks, count, TASK_SINGLE, pairs_end, end, 1);
+  }
+
+  return count;
+}
+
+/** Adds in order the result of a task to the L2 states. */
+static void
+combine_task(const uhash_key *key, uhash_state *state, const parallel_task *task)
+{
+  const l2_key *l2key = (const l2_key *)((const uint8_t *)key + key->attribs->l2key_offset);
+  int i;
+
+  for(i = 0; i < state->common.iters; ++i) {
+    l2_state *l2 = &state->partial[i].l2;
+
+    switch(task->kind) {
+    case TASK_POLY64:
+      l2->y.v[1] = sum_mod_p64(
+	  mul_mod_p64(l2->y.v[1], pow_mod_p64(l2key[i].k64, task->mults[i])),
+	  task->hash[i].v[1]);
+      break;
+    case TASK_POLY128: {
+      uint128 kn;
+      pow_mod_p128(&l2key[i].k128, task->mults[i], &kn);
+      mul_mod_p128(&l2->y, &kn, &l2->y);
+      sum_mod_p128(&task->hash[i], &l2->y, &l2->y);
+      break;
+    }
+    case TASK_SINGLE:
+      l2_hash_iteration(&l2key[i], l2, task->hash[i].v[1],
+	  (task->first_block + 1) * 32);
+      break;
+    }
+  }
+}
+
+void
+uhash_update_parallel(const uhash_key *key, uhash_state *state,
+		      const uint8_t *input, size_t len, unsigned threads)
+{
+  const uint8_t *key_base = (const uint8_t *)key;
+  size_t head, blocks, task_count, t;
+  uint64_t first, task_size;
+  parallel_job job;
+  pthread_t *workers;
+  unsigned started = 0;
+  const uint8_t *last;
+  uint32_t aligned[256];
+  uint64_t sums[4];
+  int i;
+
+  /* Sequentially complete the current L1 block. */
+  head = (state->common.step_count % 32) * 32 + state->common.buffer_len;
+  if(head) {
+    head = min(1024 - head, len);
+    uhash_update(key, state, input, head);
+    input += head;
+    len -= head;
+  }
+
+  blocks = len / 1024;
+  if(threads < 2 || blocks < PARALLEL_MIN_BLOCKS) {
+    uhash_update(key, state, input, len);
+    return;
+  }
+
+  /* All but the last block are L2 hashed by the tasks. The last one is only
+   * L1 hashed, and left pending in the state, as uhash_update() does. */
+  first = state->common.step_count / 32;
+  task_size = (blocks - 1) / (threads * 4);
+  if(task_size < PARALLEL_MIN_TASK)
+    task_size = PARALLEL_MIN_TASK;
+  task_size += task_size & 1;
+
+  job.key = key;
+  job.iters = state->common.iters;
+  job.input = input;
+  job.first_block = first;
+  job.tasks = malloc(((blocks - 1) / task_size + 8) * sizeof(parallel_task));
+  job.next_task = 0;
+  workers = malloc((threads - 1) * sizeof(pthread_t));
+  if(!job.tasks || !workers) {
+    free(job.tasks);
+    free(workers);
+    uhash_update(key, state, input, len);
+    return;
+  }
+  job.task_count = task_count = plan_tasks(job.tasks, first, first + blocks - 1, task_size);
+
+  /* If a thread can't be created, the others do its share. */
+  for(; started < threads - 1; ++started)
+    if(pthread_create(&workers[started], NULL,
+		      (void *(*)(void *))parallel_worker, &job))
+      break;
+
+  /* Meanwhile, L2 hash the block pending from before, and L1 hash the last. */
+  if(first)
+    uhash_l2_block(key, state);
+  last = input + (blocks - 1) * 1024;
+  if(!(UNALIGNED_ACCESS || NH_ANY_ALIGNMENT) && !is_aligned(last)) {
+    memcpy(aligned, last, 1024);
+    last = (const uint8_t *)aligned;
+  }
+  nh_steps((const uint32_t *)(key_base + sizeof(uhash_key)),
+	   (const uint32_t *)last, 32, job.iters, sums);
+
+  parallel_worker(&job);
+  while(started)
+    pthread_join(workers[--started], NULL);
+  free(workers);
+
+  for(t = 0; t < task_count; ++t)
+    combine_task(key, state, &job.tasks[t]);
+  free(job.tasks);
+
+  for(i = 0; i < job.iters; ++i)
+    state->partial[i].l1 = sums[i];
+  state->common.step_count += blocks * 32;
+
+  uhash_update(key, state, input + blocks * 1024, len - blocks * 1024);
+}
+
+void
+uhash_digest_parallel(const uhash_key *key, const uint8_t *input, size_t len,
+		      uint8_t *output, unsigned threads)
+{
+  uhash_128_state state;
+
+  uhash_init((uhash_type)(key->attribs->iters - 1), (uhash_state *)&state);
+  uhash_update_parallel(key, (uhash_state *)&state, input, len, threads);
+  uhash_finish(key, (uhash_state *)&state, output);
+}
+
+void
+uhash_clone(uhash_state *dst, const uhash_state *src)
+{
+  /* The state has no pointers, only the used iterations need copying. */
+  memcpy(dst, src, offsetof(uhash_state, partial)
+	 + src->common.iters * sizeof(uhash_iteration_state));
+}
+
+void
+uhash_prefix_template(const uhash_key *key, uhash_state *tmpl,
+		      const uint8_t *prefix, size_t len)
+{
+  uhash_init((uhash_type)(key->attribs->iters - 1), tmpl);
+  uhash_update(key, tmpl, prefix, len);
+}
+
+/* Short messages, alone or in batches.
+ *
+ * A message of up to one L1 block has no L2: its UHASH is the NH of the
+ * zero padded message, plus the length in bits, given to L3. So these are
+ * hashed directly, without going through the state and its buffer. */
+
+/** Biggest message hashed directly by uhash_many() and uhash_oneshot(). */
+#define SHORT_MSG_MAX 1024
+
+static int
+is_short_msg(const uint8_t *msg, size_t len)
+{
+  return len <= SHORT_MSG_MAX
+    && (UNALIGNED_ACCESS || NH_ANY_ALIGNMENT || is_aligned(msg));
+}
+
+/** Computes the tag of a short message from the L1 output of its block. */
+static void
+short_msg_tag(const uhash_key *key, size_t len, const uint64_t *sums, uint8_t *tag)
+{
+  const uint8_t *key_base = (const uint8_t *)key;
+  int i;
+
+  for(i = 0; i < key->attribs->iters; ++i) {
+    uint128 y = {{0, sums[i] + len * 8}};
     unpack_bigendian(
 	l3_hash((const uint64_t *)(key_base + key->attribs->l3key1_offset + (i * 64)),
 	    *(const uint32_t *)(key_base + key->attribs->l3key2_offset + (i * 4)),
-	    &state->partial[i].l2.y),
+	    &y),
+	&tag[i*4]);
+  }
+}
+
+#if NH_PAIR
+/** Computes the tags of two short messages together. Short messages have no
+ * L2, so the high word given to L3 is zero, and its first half is skipped; the
+ * second half of both messages is interleaved. */
+static void
+short_msg_tag_pair(const uhash_key *key, size_t len_a, const uint64_t *sums_a,
+		   uint8_t *tag_a, size_t len_b, const uint64_t *sums_b, uint8_t *tag_b)
+{
+  const uint8_t *key_base = (const uint8_t *)key;
+  int i, j;
+
+  for(i = 0; i < key->attribs->iters; ++i) {
+    const uint64_t *k1 = (const uint64_t *)(key_base + key->attribs->l3key1_offset + (i * 64)) + 4;
+    const uint32_t k2 = *(const uint32_t *)(key_base + key->attribs->l3key2_offset + (i * 4));
+    const uint64_t m_a = sums_a[i] + len_a * 8, m_b = sums_b[i] + len_b * 8;
+    uint64_t y_a = 0, y_b = 0;
+
+    for(j = 0; j < 4; ++j) {
+      y_a += k1[j] * ((m_a >> (16 * (3 - j))) & 0xffffu);
+      y_b += k1[j] * ((m_b >> (16 * (3 - j))) & 0xffffu);
+    }
+
+    /* Reduce mod p36, as l3_hash(). */
+    y_a = (y_a & 0xFFFFFFFFFu) + (y_a >> 36) * 5;
+    y_b = (y_b & 0xFFFFFFFFFu) + (y_b >> 36) * 5;
+    y_a = (y_a & 0xFFFFFFFFFu) + (y_a >> 36) * 5;
+    y_b = (y_b & 0xFFFFFFFFFu) + (y_b >> 36) * 5;
+    if(y_a >= p36)
+      y_a -= p36;
+    if(y_b >= p36)
+      y_b -= p36;
+
+    unpack_bigendian((uint32_t)y_a ^ k2, &tag_a[i*4]);
+    unpack_bigendian((uint32_t)y_b ^ k2, &tag_b[i*4]);
+  }
+}
+#endif
+
+/** Completes the L1 hash of a short message, whose first done_steps whole
+ * steps are already summed in sums. */
+static void
+short_msg_l1(const uhash_key *key, const uint8_t *msg, size_t len,
+	     size_t done_steps, uint64_t *sums)
+{
+  const uint8_t *key_base = (const uint8_t *)key;
+  const uint32_t *l1key = (const uint32_t *)(key_base + sizeof(uhash_key));
+  const int iters = key->attribs->iters;
+  const size_t steps = len / 32;
+  uint64_t more[4];
+  int i;
+
+  if(steps > done_steps) {
+    nh_steps(l1key + done_steps * 8, (const uint32_t *)(msg + done_steps * 32),
+	steps - done_steps, iters, more);
+    for(i = 0; i < iters; ++i)
+      sums[i] += more[i];
+  }
+
+  /* The last step is zero padded, and an empty message has one such step. */
+  if(len % 32 || !len) {
+    uint32_t last[8] = {0};
+    memcpy(last, msg + steps * 32, len % 32);
+    nh_steps(l1key + steps * 8, last, 1, iters, more);
+    for(i = 0; i < iters; ++i)
+      sums[i] += more[i];
+  }
+}
+
+/** Completes the L1 hash of a short message, and computes its tag. */
+static void
+short_msg_finish(const uhash_key *key, const uint8_t *msg, size_t len,
+		 size_t done_steps, uint64_t *sums, uint8_t *tag)
+{
+  short_msg_l1(key, msg, len, done_steps, sums);
+  short_msg_tag(key, len, sums, tag);
+}
+
+void
+uhash_many(const uhash_key *key, const uint8_t *const msgs[], const size_t lens[],
+	   size_t count, uint8_t *tags)
+{
+  const int iters = key->attribs->iters;
+  const size_t tag_size = iters * 4;
+  size_t j = 0;
+
+  while(j < count) {
+    uint64_t sums[4] = {0};
+
+    if(!is_short_msg(msgs[j], lens[j])) {
+      uhash_128_state state;
+
+      uhash_init((uhash_type)(iters - 1), (uhash_state *)&state);
+      uhash_update(key, (uhash_state *)&state, msgs[j], lens[j]);
+      uhash_finish(key, (uhash_state *)&state, tags + j * tag_size);
+      ++j;
+      continue;
+    }
+
+#if NH_PAIR
+    /* Two short messages are hashed together, up to their tags. */
+    if(j + 1 < count && is_short_msg(msgs[j + 1], lens[j + 1])) {
+      uint64_t sums_b[4];
+
+      nh_short_pair((const uint32_t *)((const uint8_t *)key + sizeof(uhash_key)),
+	  msgs[j], lens[j], msgs[j + 1], lens[j + 1], iters, sums, sums_b);
+      short_msg_tag_pair(key, lens[j], sums, tags + j * tag_size,
+	  lens[j + 1], sums_b, tags + (j + 1) * tag_size);
+      j += 2;
+      continue;
+    }
+#endif
+
+    short_msg_finish(key, msgs[j], lens[j], 0, sums, tags + j * tag_size);
+    ++j;
+  }
+}
+
+void
+uhash_oneshot(const uhash_key *key, const uint8_t *msg, size_t len, uint8_t *output)
+{
+  uint64_t sums[4] = {0};
+
+  if(len <= 32) {
+    /* A single, zero padded, step. */
+    uint32_t step[8] = {0};
+    memcpy(step, msg, len);
+    nh_steps((const uint32_t *)((const uint8_t *)key + sizeof(uhash_key)), step, 1,
+	key->attribs->iters, sums);
+    short_msg_tag(key, len, sums, output);
+  } else if(is_short_msg(msg, len)) {
+    short_msg_finish(key, msg, len, 0, sums, output);
+  } else {
+    uhash_128_state state;
+
+    uhash_init((uhash_type)(key->attribs->iters - 1), (uhash_state *)&state);
+    uhash_update(key, (uhash_state *)&state, msg, len);
+    uhash_finish(key, (uhash_state *)&state, output);
+  }
+}
+
+/* Tracked UHASH.
+ *
+ * Each polynomial iteration of L2 is an affine map of y, y -> K * y + H,
+ * where K is the L2 key, or its square for the words hashed twice. The maps
+ * of consecutive words compose into another affine map, so the maps of the
+ * words are kept in a segment tree, one for POLY-64 and other for POLY-128,
+ * whose root is the composition of all of them. Changing a block only needs
+ * its NH and the nodes above its word to be recomputed. */
+
+/** Node of the POLY-64 tree: H and K. */
+#define TREE64_NODE(t, n, i) (&(t)->poly64_tree[((n) * (t)->iters + (i)) * 2])
+/** Node of the POLY-128 tree: H and K. */
+#define TREE128_NODE(t, n, i) (&(t)->poly128_tree[((n) * (t)->iters + (i)) * 2])
+
+static size_t
+tree_capacity(size_t leaves)
+{
+  size_t cap = 1;
+  while(cap < leaves)
+    cap *= 2;
+  return cap;
+}
+
+static void
+tracked_block_l1(uhash_tracked *t, size_t b)
+{
+  const size_t len = min(1024, t->len - b * 1024);
+  const uint8_t *msg = t->record + b * 1024;
+  uint32_t aligned[256];
+  uint64_t sums[4] = {0};
+  int i;
+
+  if(!(UNALIGNED_ACCESS || NH_ANY_ALIGNMENT) && !is_aligned(msg)) {
+    memcpy(aligned, msg, len);
+    msg = (const uint8_t *)aligned;
+  }
+  short_msg_l1(t->key, msg, len, 0, sums);
+
+  for(i = 0; i < t->iters; ++i)
+    t->l1[b * t->iters + i] = sums[i] + len * 8;
+}
+
+/** Recomputes the leaves [first, last] of the POLY-64 tree, and their parents. */
+static void
+tree64_refresh(uhash_tracked *t, size_t first, size_t last)
+{
+  const l2_key *l2key = (const l2_key *)((const uint8_t *)t->key + t->key->attribs->l2key_offset);
+  size_t n;
+  int i;
+
+  for(n = first; n <= last; ++n)
+    for(i = 0; i < t->iters; ++i) {
+      uint64_t *node = TREE64_NODE(t, t->poly64_cap + n, i);
+      const uint64_t m = t->l1[n * t->iters + i];
+
+      node[0] = poly64_iteration(l2key[i].k64, m, 0);
+      node[1] = m >= poly_maxwordrange ? mul_mod_p64(l2key[i].k64, l2key[i].k64) : l2key[i].k64;
+    }
+
+  for(first += t->poly64_cap, last += t->poly64_cap; first > 1;) {
+    first /= 2;
+    last /= 2;
+    for(n = first; n <= last; ++n)
+      for(i = 0; i < t->iters; ++i) {
+	const uint64_t *left = TREE64_NODE(t, 2 * n, i);
+	const uint64_t *right = TREE64_NODE(t, 2 * n + 1, i);
+	uint64_t *node = TREE64_NODE(t, n, i);
+
+	node[0] = sum_mod_p64(mul_mod_p64(left[0], right[1]), right[0]);
+	node[1] = mul_mod_p64(left[1], right[1]);
+      }
+  }
+}
+
+/** Recomputes the leaves [first, last] of the POLY-128 tree, and their parents. */
+static void
+tree128_refresh(uhash_tracked *t, size_t first, size_t last)
+{
+  const l2_key *l2key = (const l2_key *)((const uint8_t *)t->key + t->key->attribs->l2key_offset);
+  size_t n;
+  int i;
+
+  for(n = first; n <= last; ++n)
+    for(i = 0; i < t->iters; ++i) {
+      uint128 *node = TREE128_NODE(t, t->poly128_cap + n, i);
+      const size_t b = POLY128_FIRST_BLOCK + 2 * n;
+      const uint128 m = {{t->l1[b * t->iters + i], t->l1[(b + 1) * t->iters + i]}};
+
+      node[0].v[0] = node[0].v[1] = 0;
+      poly128_iteration(&l2key[i].k128, &m, &node[0]);
+      node[1] = l2key[i].k128;
+      if(m.v[0] >= poly_maxwordrange)
+	mul_mod_p128(&node[1], &node[1], &node[1]);
+    }
+
+  for(first += t->poly128_cap, last += t->poly128_cap; first > 1;) {
+    first /= 2;
+    last /= 2;
+    for(n = first; n <= last; ++n)
+      for(i = 0; i < t->iters; ++i) {
+	const uint128 *left = TREE128_NODE(t, 2 * n, i);
+	const uint128 *right = TREE128_NODE(t, 2 * n + 1, i);
+	uint128 *node = TREE128_NODE(t, n, i);
+
+	mul_mod_p128(&left[0], &right[1], &node[0]);
+	sum_mod_p128(&right[0], &node[0], &node[0]);
+	mul_mod_p128(&left[1], &right[1], &node[1]);
+      }
+  }
+}
+
+/** Recomputes the blocks [first, last] and everything depending on them. */
+static void
+tracked_refresh(uhash_tracked *t, size_t first, size_t last)
+{
+  size_t b;
+
+  for(b = first; b <= last; ++b)
+    tracked_block_l1(t, b);
+
+  if(first < POLY128_FIRST_BLOCK)
+    tree64_refresh(t, first, min(last, POLY128_FIRST_BLOCK - 1));
+
+  /* Only whole pairs are in the POLY-128 tree. */
+  if(t->poly128_leaves && last >= POLY128_FIRST_BLOCK) {
+    first = first > POLY128_FIRST_BLOCK ? first - POLY128_FIRST_BLOCK : 0;
+    last = min((last - POLY128_FIRST_BLOCK) / 2, t->poly128_leaves - 1);
+    if(first / 2 <= last)
+      tree128_refresh(t, first / 2, last);
+  }
+}
+
+int
+uhash_tracked_init(uhash_tracked *t, const uhash_key *key, const uint8_t *record, size_t len)
+{
+  const int iters = key->attribs->iters;
+  size_t n;
+  int i;
+
+  t->key = key;
+  t->iters = iters;
+  t->record = record;
+  t->len = len;
+  t->block_count = len ? (len + 1023) / 1024 : 1;
+  t->poly64_leaves = min(t->block_count, POLY128_FIRST_BLOCK);
+  t->poly64_cap = tree_capacity(t->poly64_leaves);
+  t->poly128_leaves = t->block_count > POLY128_FIRST_BLOCK
+    ? (t->block_count - POLY128_FIRST_BLOCK) / 2 : 0;
+  t->poly128_cap = tree_capacity(t->poly128_leaves);
+
+  t->l1 = malloc(t->block_count * iters * sizeof(uint64_t));
+  t->poly64_tree = malloc(2 * t->poly64_cap * iters * 2 * sizeof(uint64_t));
+  t->poly128_tree = malloc(2 * t->poly128_cap * iters * 2 * sizeof(uint128));
+  if(!t->l1 || !t->poly64_tree || !t->poly128_tree) {
+    uhash_tracked_free(t);
+    return ENOMEM;
+  }
+
+  /* Start with the identity map everywhere, which is what remains in the
+   * nodes past the end of the leaves. */
+  for(n = 1; n < 2 * t->poly64_cap; ++n)
+    for(i = 0; i < iters; ++i) {
+      TREE64_NODE(t, n, i)[0] = 0;
+      TREE64_NODE(t, n, i)[1] = 1;
+    }
+  for(n = 1; n < 2 * t->poly128_cap; ++n)
+    for(i = 0; i < iters; ++i) {
+      uint128 *node = TREE128_NODE(t, n, i);
+      node[0].v[0] = node[0].v[1] = node[1].v[0] = 0;
+      node[1].v[1] = 1;
+    }
+
+  tracked_refresh(t, 0, t->block_count - 1);
+
+  return 0;
+}
+
+void
+uhash_tracked_update(uhash_tracked *t, size_t offset, size_t len)
+{
+  if(len)
+    tracked_refresh(t, offset / 1024, (offset + len - 1) / 1024);
+}
+
+void
+uhash_tracked_finish(const uhash_tracked *t, uint8_t *output)
+{
+  const uint8_t *key_base = (const uint8_t *)t->key;
+  const l2_key *l2key = (const l2_key *)(key_base + t->key->attribs->l2key_offset);
+  int i;
+
+  for(i = 0; i < t->iters; ++i) {
+    uint128 y = {{0, t->l1[i]}};
+
+    if(t->block_count > 1) {
+      const uint64_t *root64 = TREE64_NODE(t, 1, i);
+
+      /* POLY-64 starts from 1. */
+      y.v[1] = sum_mod_p64(root64[1], root64[0]);
+
+      if(t->block_count > POLY128_FIRST_BLOCK) {
+	const uint128 *root128 = TREE128_NODE(t, 1, i);
+	uint128 m = {{0, y.v[1]}};
+
+	/* Kickstart POLY-128 with the POLY-64 result, then the pairs. */
+	y.v[1] = 1;
+	poly128_iteration(&l2key[i].k128, &m, &y);
+	mul_mod_p128(&root128[1], &y, &y);
+	sum_mod_p128(&root128[0], &y, &y);
+
+	/* The padding, together with the last block, if not paired. */
+	if((t->block_count - POLY128_FIRST_BLOCK) % 2) {
+	  m.v[0] = t->l1[(t->block_count - 1) * t->iters + i];
+	  m.v[1] = 0x8000000000000000u;
+	} else {
+	  m.v[0] = 0x8000000000000000u;
+	  m.v[1] = 0;
+	}
+	poly128_iteration(&l2key[i].k128, &m, &y);
+      }
+    }
+
+    unpack_bigendian(
+	l3_hash((const uint64_t *)(key_base + t->key->attribs->l3key1_offset + (i * 64)),
+	    *(const uint32_t *)(key_base + t->key->attribs->l3key2_offset + (i * 4)),
+	    &y),
 	&output[i*4]);
   }
 }
 
+void
+uhash_tracked_free(uhash_tracked *t)
+{
+  free(t->l1);
+  free(t->poly64_tree);
+  free(t->poly128_tree);
+  t->l1 = NULL;
+  t->poly64_tree = NULL;
+  t->poly128_tree = NULL;
+}
+
+/* Lazy key derivation.
+ *
+ * The key material is at the same offsets of the stream as in
+ * uhash_key_setup(), and Salsa20 can seek to any of them, so each part is
+ * derived only when a message first needs it: the L1 key up to the length of
+ * the longest message so far, the L2 keys once a message exceeds 1 KB, and
+ * the L3 keys on the first finish. */
+
+/** Granularity of the L1 key derivation, in bytes. */
+#define LAZY_L1_CHUNK 256
+
+static size_t
+key_material_size(int iters)
+{
+  return l1_key_size(iters) + iters * (24 + 64 + 4);
+}
+
+/** Positions a temporary stream at offset of the key material. */
+static void
+lazy_seek(const uhash_lazy_key *lazy, salsa20_buffered_state *stream, size_t offset)
+{
+  buffered_init_header(&stream->header, SALSA20);
+  stream->state = lazy->stream;
+  salsa20_buffered_seek(stream, lazy->base + offset);
+}
+
+/** Derives the key parts needed to hash total_len bytes. */
+static void
+lazy_require(uhash_lazy_key *lazy, uint64_t total_len)
+{
+  const int iters = lazy->key->attribs->iters;
+  const size_t l1_size = l1_key_size(iters);
+  salsa20_buffered_state stream;
+  size_t l1_needed;
+
+  /* NH reads the key of whole 32 bytes steps, at least one, and each
+   * iteration is 16 bytes further in the key. */
+  if(total_len > 1024)
+    l1_needed = l1_size;
+  else
+    l1_needed = (total_len ? (total_len + 31) / 32 * 32 : 32) + (iters - 1) * 16;
+
+  if(l1_needed > lazy->l1_ready) {
+    l1_needed = min((l1_needed + LAZY_L1_CHUNK - 1) / LAZY_L1_CHUNK * LAZY_L1_CHUNK, l1_size);
+
+    lazy_seek(lazy, &stream, lazy->l1_ready);
+    buffered_action(&stream.header, (uint8_t *)lazy->key + sizeof(uhash_key) + lazy->l1_ready,
+		    l1_needed - lazy->l1_ready, BUFFERED_EXTRACT);
+    lazy->l1_ready = l1_needed;
+  }
+
+  if(total_len > 1024 && !lazy->l2_ready) {
+    lazy_seek(lazy, &stream, l1_size);
+    l2_keys_setup(lazy->key, &stream.header);
+    lazy->l2_ready = 1;
+  }
+}
+
+void
+uhash_lazy_key_setup(uhash_type type, uhash_lazy_key *lazy, uhash_key *storage,
+		     salsa20_buffered_state *full_state)
+{
+  storage->attribs = uhash_attributes_array[type];
+
+  lazy->key = storage;
+  lazy->stream = full_state->state;
+  lazy->base = salsa20_buffered_tell(full_state);
+  lazy->l1_ready = 0;
+  lazy->l2_ready = 0;
+  lazy->l3_ready = 0;
+
+  /* Leave the stream where uhash_key_setup() would. */
+  salsa20_buffered_seek(full_state, lazy->base + key_material_size(type + 1));
+}
+
+void
+uhash_lazy_update(uhash_lazy_key *lazy, uhash_state *state, const uint8_t *input, size_t len)
+{
+  lazy_require(lazy, state->common.step_count * 32 + state->common.buffer_len + len);
+  uhash_update(lazy->key, state, input, len);
+}
+
+void
+uhash_lazy_finish(uhash_lazy_key *lazy, uhash_state *state, uint8_t *output)
+{
+  lazy_require(lazy, state->common.step_count * 32 + state->common.buffer_len);
+
+  if(!lazy->l3_ready) {
+    salsa20_buffered_state stream;
+
+    lazy_seek(lazy, &stream, l1_key_size(lazy->key->attribs->iters)
+	      + lazy->key->attribs->iters * 24);
+    l3_keys_setup(lazy->key, &stream.header);
+    lazy->l3_ready = 1;
+  }
+
+  uhash_finish(lazy->key, state, output);
+}
+
+/* Full UMAC. */
+
+#define UMAC_SPECIFICS_DEF(bits)					\
+  const umac_attributes umac_##bits##_attributes = {			\
+    .uhash_key_offset = offsetof(umac_##bits##_ctx, key),		\
+    .uhash_state_offset = offsetof(umac_##bits##_ctx, state)		\
+  };
+
+UMAC_SPECIFICS_DEF(32)
+UMAC_SPECIFICS_DEF(64)
+UMAC_SPECIFICS_DEF(96)
+UMAC_SPECIFICS_DEF(128)
+
+#undef UMAC_SPECIFICS_DEF
+
+static const umac_attributes *const umac_attributes_array[4] = {
+    &umac_32_attributes,
+    &umac_64_attributes,
+    &umac_96_attributes,
+    &umac_128_attributes
+};
+
+static uhash_key *
+umac_key(umac_ctx *ctx)
+{
+  return (uhash_key *)((uint8_t *)ctx + ctx->attribs->uhash_key_offset);
+}
+
+static uhash_state *
+umac_state(umac_ctx *ctx)
+{
+  return (uhash_state *)((uint8_t *)ctx + ctx->attribs->uhash_state_offset);
+}
+
+void
+umac_init(umac_ctx *ctx, uhash_type type, const uint8_t *key)
+{
+  salsa20_buffered_state kdf = salsa20_static_initializer;
+  salsa20_master_state master;
+  /* Copies, so that the caller's buffers need no alignment. */
+  uint32_t key_copy[UMAC_KEY_SIZE / 4];
+  uint32_t pdf_key[UMAC_KEY_SIZE / 4];
+  const uint32_t kdf_iv[2] = {0, 0};
+
+  memcpy(key_copy, key, UMAC_KEY_SIZE);
+  salsa20_init_key(&master, SALSA20_12, (uint8_t *)key_copy, SALSA20_256_BITS);
+  salsa20_init_iv(&kdf.state, &master, (const uint8_t *)kdf_iv);
+
+  /* The PDF key comes first in the expanded key, then the UHASH key. */
+  buffered_action(&kdf.header, (uint8_t *)pdf_key, UMAC_KEY_SIZE, BUFFERED_EXTRACT);
+  salsa20_init_key(&ctx->pdf_key, SALSA20_12, (uint8_t *)pdf_key, SALSA20_256_BITS);
+
+  ctx->attribs = umac_attributes_array[type];
+  ctx->pad_valid = 0;
+  uhash_key_setup(type, umac_key(ctx), &kdf.header);
+  uhash_init(type, umac_state(ctx));
+}
+
+void
+umac_update(umac_ctx *ctx, const uint8_t *input, size_t len)
+{
+  uhash_update(umac_key(ctx), umac_state(ctx), input, len);
+}
+
+/** Gets the cached pad block of the nonce, generating it if needed. */
+static const uint8_t *
+umac_pad_block(umac_ctx *ctx, const uint8_t *nonce, int slice_bits)
+{
+  uint8_t block_nonce[UMAC_NONCE_SIZE];
+
+  memcpy(block_nonce, nonce, UMAC_NONCE_SIZE);
+  block_nonce[UMAC_NONCE_SIZE - 1] &= ~((1u << slice_bits) - 1);
+
+  if(!ctx->pad_valid || memcmp(block_nonce, ctx->pad_nonce, UMAC_NONCE_SIZE)) {
+    salsa20_state pdf;
+    uint32_t iv[2];
+    uint64_t counter = 0;
+    int i;
+
+    /* First half of the nonce is the IV, and the other half, without the
+     * slice bits, is the Salsa20 block counter. */
+    memcpy(iv, block_nonce, 8);
+    for(i = 8; i < UMAC_NONCE_SIZE; ++i)
+      counter = (counter << 8) | block_nonce[i];
+
+    salsa20_init_iv(&pdf, &ctx->pdf_key, (const uint8_t *)iv);
+    salsa20_set_counter(&pdf, counter >> slice_bits);
+    salsa20_extract(&pdf, (uint8_t *)ctx->pad);
+
+    memcpy(ctx->pad_nonce, block_nonce, UMAC_NONCE_SIZE);
+    ctx->pad_valid = 1;
+  }
+
+  return (const uint8_t *)ctx->pad;
+}
+
+void
+umac_final(umac_ctx *ctx, const uint8_t *nonce, uint8_t *tag)
+{
+  uhash_key *key = umac_key(ctx);
+  const int tag_size = key->attribs->iters * 4;
+  /* Slices per pad block: 16, 8, 4 and 4, for each tag size. */
+  const int slice_bits = tag_size <= 4 ? 4 : (tag_size <= 8 ? 3 : 2);
+  const int slice = nonce[UMAC_NONCE_SIZE - 1] & ((1u << slice_bits) - 1);
+  const uint8_t *pad = umac_pad_block(ctx, nonce, slice_bits);
+
+  uhash_finish(key, umac_state(ctx), tag);
+  memxor(tag, pad + slice * tag_size, tag_size);
+
+  uhash_init(uhash_get_type_from_key(key), umac_state(ctx));
+}
+
+void
+umac_digest(umac_ctx *ctx, const uint8_t *input, size_t len,
+	    const uint8_t *nonce, uint8_t *tag)
+{
+  umac_update(ctx, input, len);
+  umac_final(ctx, nonce, tag);
+}
@@ -80,6 +80,166 @@ void uhash_update(const uhash_key *key, uhash_state *state, const uint8_t *input
 
 void uhash_finish(const uhash_key *key, uhash_state *state, uint8_t *output);
 
+/** Copies a state, possibly in the middle of a message.
+ *
+ * Both states can then be updated and finished independently, as if the
+ * input given to src so far had been given to each of them. This includes
+ * the partially filled buffer and the pending L1 block, as the state is
+ * plain data, so it is as cheap as copying a few dozen bytes.
+ *
+ * @param dst A state of the same or bigger type than src, like the
+ * uhash_<bits>_state types, or a union of them.
+ * @param src The state to be copied.
+ */
+void uhash_clone(uhash_state *dst, const uhash_state *src);
+
+/** Computes a template state for messages beginning with a fixed prefix.
+ *
+ * Initializes tmpl for the key type and hashes prefix with it. Then, for
+ * each message, instead of uhash_init() and hashing the prefix, start with
+ * uhash_clone() of the template, and update it only with the rest of the
+ * message. The template itself must not be updated.
+ */
+void uhash_prefix_template(const uhash_key *key, uhash_state *tmpl,
+			   const uint8_t *prefix, size_t len);
+
+/** Tracked UHASH of a record that is modified in place.
+ *
+ * Keeps the L1 output of each 1 KB block of the record, and the L2 hash in a
+ * tree of partial results, so that after a change to the record only the
+ * modified blocks need to be hashed again to compute the new tag. Uses
+ * about 8 bytes per KB of record, for each 32 bits of tag, plus the trees.
+ * All fields are internal.
+ */
+typedef struct
+{
+  const uhash_key *key;
+  const uint8_t *record;
+  size_t len;
+  size_t block_count;
+  int iters;
+
+  /** L1 output of each block, for each iteration. */
+  uint64_t *l1;
+
+  size_t poly64_leaves;
+  size_t poly64_cap;
+  uint64_t *poly64_tree;
+
+  size_t poly128_leaves;
+  size_t poly128_cap;
+  uint128 *poly128_tree;
+} uhash_tracked;
+
+/** Hashes a record, keeping the partial results.
+ *
+ * @param t The uninitialized tracked state.
+ * @param key The UHASH key, that must remain valid while t is used.
+ * @param record The record, that must remain valid and with the same length
+ * while t is used.
+ * @param len The length of the record.
+ * @returns 0 on success, or ENOMEM if memory could not be allocated.
+ */
+int uhash_tracked_init(uhash_tracked *t, const uhash_key *key,
+		       const uint8_t *record, size_t len);
+
+/** Rehashes a range of the record that was modified.
+ *
+ * @param offset Where the modification starts in the record.
+ * @param len The length of the modified range.
+ */
+void uhash_tracked_update(uhash_tracked *t, size_t offset, size_t len);
+
+/** Computes the tag of the record in its current contents.
+ *
+ * The output is the same uhash_finish() would give for the whole record.
+ * Can be called any number of times, between updates.
+ */
+void uhash_tracked_finish(const uhash_tracked *t, uint8_t *output);
+
+/** Frees the memory used by the tracked state. */
+void uhash_tracked_free(uhash_tracked *t);
+
+/** UHASH key derived from the stream only as messages need it.
+ *
+ * Gives the same tags as the key from uhash_key_setup() on the same stream,
+ * but a session with only short messages derives only the start of the L1 key
+ * and the L3 keys, instead of the whole 1.1 to 1.4 KB of key material. Once
+ * fully derived, lazy->key can be used with the regular functions. All
+ * fields are internal.
+ */
+typedef struct
+{
+  uhash_key *key;
+  /** Copy of the stream state, to seek to the key parts. */
+  salsa20_state stream;
+  /** Position of the key material in the stream. */
+  uint64_t base;
+  uint16_t l1_ready;
+  uint8_t l2_ready;
+  uint8_t l3_ready;
+} uhash_lazy_key;
+
+/** Sets up a lazily derived key.
+ *
+ * @param lazy The uninitialized lazy key.
+ * @param storage Where the key is derived into, one of the uhash_<bits>_key
+ * types, matching the type, that must remain valid while lazy is used.
+ * @param full_state The Salsa20 stream, left at the same position as
+ * uhash_key_setup() leaves it, so it can be used right away for other
+ * purposes.
+ */
+void uhash_lazy_key_setup(uhash_type type, uhash_lazy_key *lazy, uhash_key *storage,
+			  salsa20_buffered_state *full_state);
+
+/** Same as uhash_update(), deriving the key parts needed before. The state
+ * is initialized with uhash_init(), as usual. */
+void uhash_lazy_update(uhash_lazy_key *lazy, uhash_state *state, const uint8_t *input, size_t len);
+
+/** Same as uhash_finish(), deriving the key parts needed before. */
+void uhash_lazy_finish(uhash_lazy_key *lazy, uhash_state *state, uint8_t *output);
+
+/** Same as uhash_update(), but splits big inputs among threads.
+ *
+ * The whole 1 KB blocks of input are NH and polynomial hashed in parallel by
+ * up to the given number of threads, including the calling one, and the
+ * partial results are combined into the same state uhash_update() would
+ * give. Inputs smaller than 256 KB are hashed in the calling thread.
+ */
+void uhash_update_parallel(const uhash_key *key, uhash_state *state,
+			   const uint8_t *input, size_t len, unsigned threads);
+
+/** Computes the UHASH of a whole message using uhash_update_parallel(). */
+void uhash_digest_parallel(const uhash_key *key, const uint8_t *input, size_t len,
+			   uint8_t *output, unsigned threads);
+
+/** Computes the UHASH of a whole message at once.
+ *
+ * Gives the same output as uhash_init(), uhash_update() and uhash_finish(),
+ * but messages of up to 1 KB, that have no L2 hash, are hashed directly,
+ * without the incremental state.
+ */
+void uhash_oneshot(const uhash_key *key, const uint8_t *msg, size_t len, uint8_t *output);
+
+/** Computes the UHASH of many independent messages with the same key.
+ *
+ * Gives the same tags as hashing each message with uhash_init(),
+ * uhash_update() and uhash_finish(), but consecutive messages of up to 1 KB
+ * are hashed in pairs: their NH steps, including the zero padded last one,
+ * share the key loads, in the two halves of the vector registers with AVX2 or
+ * in two independent chains with SSE2, and their L3 hashes are interleaved.
+ * Meant for big batches of small messages; without SSE2, each message is
+ * hashed as by uhash_oneshot().
+ *
+ * @param msgs The messages.
+ * @param lens The length of each message.
+ * @param count How many messages there are.
+ * @param tags Where to store the tags, one after the other, 4, 8, 12 or 16
+ * bytes each, depending on the key type.
+ */
+void uhash_many(const uhash_key *key, const uint8_t *const msgs[], const size_t lens[],
+		size_t count, uint8_t *tags);
+
 #define UHASH_BITS(bits)						\
   typedef struct							\
   {									\
@@ -89,13 +249,20 @@ void uhash_finish(const uhash_key *key, uhash_state *state, uint8_t *output);
     uint64_t l3key1[(bits)/4];						\
     uint32_t l3key2[(bits)/32];						\
   } uhash_##bits##_key;							\
-  const uhash_key_attributes uhash_##bits##_attributes;			\
+  extern const uhash_key_attributes uhash_##bits##_attributes;			\
 									\
   typedef struct							\
   {									\
     uhash_state_common common;						\
     uhash_iteration_state partial[(bits)/32];				\
-  } uhash_##bits##_state;
+  } uhash_##bits##_state;						\
+									\
+  void uhash_##bits##_init(uhash_##bits##_state *state);		\
+  void uhash_##bits##_update(const uhash_##bits##_key *key,		\
+			     uhash_##bits##_state *state,		\
+			     const uint8_t *input, size_t len);		\
+  void uhash_##bits##_finish(const uhash_##bits##_key *key,		\
+			     uhash_##bits##_state *state, uint8_t *output);
 
 UHASH_BITS(32)
 UHASH_BITS(64)
@@ -104,4 +271,80 @@ UHASH_BITS(128)
 
 #undef UHASH_BITS
 
-const uhash_key_attributes *const uhash_attributes_array[4];
+extern const uhash_key_attributes *const uhash_attributes_array[4];
+
+/* Full UMAC: UHASH, with the output encrypted by a pad derived from a nonce.
+ *
+ * The key is expanded with Salsa20/12 into the UHASH key and the key of the
+ * pseudo-random function of the nonce (PDF), which is Salsa20/12 too. As in
+ * RFC 4418, consecutive nonces share one 64 bytes PDF output block, of which
+ * each takes a slice: with 32 bits tags, 16 nonces share a block; with 64
+ * bits, 8; with 96 and 128 bits, 4. The last block is cached in the context,
+ * so incrementing nonces need a cipher call only once per block. */
+
+/** Size of the UMAC key, in bytes. */
+#define UMAC_KEY_SIZE 32
+
+/** Size of the UMAC nonce, in bytes. */
+#define UMAC_NONCE_SIZE 16
+
+typedef struct
+{
+  uint16_t uhash_key_offset;
+  uint16_t uhash_state_offset;
+} umac_attributes;
+
+/** Header common to all the umac_<bits>_ctx types. All fields are internal. */
+typedef struct
+{
+  const umac_attributes *attribs;
+  salsa20_master_state pdf_key;
+
+  /** Nonce of the cached pad block, with the slice bits cleared. */
+  uint8_t pad_nonce[UMAC_NONCE_SIZE];
+  uint8_t pad_valid;
+  uint32_t pad[16];
+} umac_ctx;
+
+#define UMAC_BITS(bits)							\
+  typedef struct							\
+  {									\
+    umac_ctx header;							\
+    uhash_##bits##_key key;						\
+    uhash_##bits##_state state;						\
+  } umac_##bits##_ctx;							\
+  extern const umac_attributes umac_##bits##_attributes;
+
+UMAC_BITS(32)
+UMAC_BITS(64)
+UMAC_BITS(96)
+UMAC_BITS(128)
+
+#undef UMAC_BITS
+
+/** Initializes an UMAC context with a key.
+ *
+ * @param ctx The header of an umac_<bits>_ctx, matching the type.
+ * @param type The tag size.
+ * @param key UMAC_KEY_SIZE bytes of secret key.
+ */
+void umac_init(umac_ctx *ctx, uhash_type type, const uint8_t *key);
+
+/** Adds data to the message being authenticated. */
+void umac_update(umac_ctx *ctx, const uint8_t *input, size_t len);
+
+/** Finishes the message, and computes its tag.
+ *
+ * The context is left ready for a new message, with the same key.
+ *
+ * @param nonce UMAC_NONCE_SIZE bytes of nonce, that must be different for
+ * every message authenticated with the same key. Taken as a big endian
+ * number, so that sequential nonces share the cached pad.
+ * @param tag Where to store the tag, of 4, 8, 12 or 16 bytes, depending on
+ * the context type.
+ */
+void umac_final(umac_ctx *ctx, const uint8_t *nonce, uint8_t *tag);
+
+/** Computes the tag of a whole message, same as umac_update() and umac_final(). */
+void umac_digest(umac_ctx *ctx, const uint8_t *input, size_t len,
+		 const uint8_t *nonce, uint8_t *tag);
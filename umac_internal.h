@@ -0,0 +1,70 @@
+#pragma once
+
+/* Parts of UHASH shared with the other hashes built on the same layers, like
+ * VHASH. Not part of the public interface. */
+
+#include <inttypes.h>
+#include "buffered.h"
+#include "umac.h"
+
+#ifdef __SIZEOF_INT128__
+
+static inline void
+mul64(uint64_t a, uint64_t b, uint128 *out)
+{
+  unsigned __int128 mul = (unsigned __int128)a * b;
+  out->v[0] = mul >> 64;
+  out->v[1] = mul;
+}
+
+#else
+
+static inline void
+mul64(uint64_t a, uint64_t b, uint128 *out)
+{
+  static const uint64_t b32_mask = ((uint64_t)1u << 32) - 1;
+  uint64_t x0, x1, y0, y1;
+  uint64_t tmp0, tmp1;
+
+  x0 = a & b32_mask;
+  x1 = a >> 32;
+  y0 = b & b32_mask;
+  y1 = b >> 32;
+
+  /* Final multiplication: out.v[0] * 2^64 + (tmp0 + tmp1) * 2^32 + out.v[1]. */
+  out->v[1] = x0 * y0;
+  out->v[0] = x1 * y1;
+  tmp0 = x1 * y0;
+  tmp1 = x0 * y1;
+
+  /* Sum tmp0 and tmp1 into a single 64 bits number (may carry). */
+  tmp0 += tmp1;
+
+  /* Add up least significant 32 bit part (may carry). */
+  uint64_t least = tmp0 << 32;
+  out->v[1] += least;
+
+  /* Add up most significant 32 bit part and possible carries.
+     This will not overflow, because the result final result can't be
+     bigger than 128 bits. */
+  out->v[0] += (tmp0 >> 32)
+    + (tmp0 < tmp1 ? ((uint64_t)1u << 32) : 0) /* tmp0 + tmp1 carry */
+    + (out->v[1] < least); /* out.v[1] + least carry */
+}
+
+#endif
+
+/** POLY-128 step: y = y * key + m, modulo 2^128 - 159. Message words whose
+ * most significant half is above 0xfffffffe are hashed with the marker, as
+ * in UHASH's L2, so any 128 bits value can be given. */
+void umac_poly128_iteration(const uint128 *key, const uint128 *m, uint128 *y);
+
+/** UHASH's L3, hashes a fully reduced POLY-128 result into 32 bits. */
+uint32_t umac_l3_hash(const uint64_t *k1, uint32_t k2, const uint128 *m);
+
+/** Extracts and processes the L3 keys of count 32 bits outputs, in the same
+ * order as UHASH: first all the 8 words keys, then all the 32 bits keys. */
+void umac_l3_keys_setup(buffered_state *full_state, uint64_t *k1, uint32_t *k2, size_t count);
+
+/** Mask applied to the polynomial hash keys. */
+#define UMAC_POLY_KEY_MASK 0x01ffffff01ffffffu
@@ -6,6 +6,12 @@
 #include <inttypes.h>
 #include <stddef.h>
 
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
 #ifdef UNALIGNED_ACCESS_ALLOWED
 #define UNALIGNED_ACCESS 1
 #else
@@ -20,3 +26,24 @@ void unpack_littleendian(uint32_t value, uint8_t *v);
 size_t min(size_t a, size_t b);
 
 int is_aligned(const void *ptr);
+
+/** XORs n bytes of mask into dest. */
+static ALWAYS_INLINE void
+memxor(uint8_t *dest, const uint8_t *mask, size_t n)
+{
+  size_t i;
+  if(UNALIGNED_ACCESS || (is_aligned(dest) && is_aligned(mask)))
+    {
+      uint64_t *d64 = (uint64_t*)dest;
+      uint64_t *m64 = (uint64_t*)mask;
+      size_t wlen = n / 8;
+      for(i = 0; i < wlen; ++i)
+	d64[i] ^= m64[i];
+      dest += wlen * 8;
+      mask += wlen * 8;
+      n %= 8;
+    }
+
+  for(i = 0; i < n; ++i)
+    dest[i] ^= mask[i];
+}
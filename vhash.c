@@ -0,0 +1,186 @@
+#include <string.h>
+#include <endian.h>
+#include "util.h"
+#include "umac_internal.h"
+
+#include "vhash.h"
+
+#define BLOCK_WORDS (VHASH_BLOCK_SIZE / 8)
+
+static ALWAYS_INLINE uint64_t
+load64(const uint8_t *m)
+{
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+  uint64_t w;
+  memcpy(&w, m, 8);
+  return w;
+#else
+  return pack_littleendian(m) | ((uint64_t)pack_littleendian(m + 4) << 32);
+#endif
+}
+
+/** NH of a block with 64 bits words, for one iteration.
+ *
+ * Sums, modulo 2^128, the products of each pair of words added to the key.
+ * With __int128, mul64() is a single instruction, mulx if BMI2 is enabled.
+ * Two sums are kept, so that the additions with carry of consecutive pairs
+ * do not depend on each other; words must be a multiple of 4.
+ */
+static ALWAYS_INLINE void
+nh64(const uint64_t *key, const uint8_t *msg, size_t words, uint128 *out)
+{
+  uint128 sum[2] = {{{0, 0}}, {{0, 0}}};
+  uint128 prod;
+  size_t i;
+  int j;
+
+  for(i = 0; i < words; i += 4)
+    for(j = 0; j < 2; ++j)
+      {
+	const size_t w = i + 2 * j;
+	mul64(load64(msg + w * 8) + key[w], load64(msg + w * 8 + 8) + key[w + 1], &prod);
+	sum[j].v[1] += prod.v[1];
+	sum[j].v[0] += prod.v[0] + (sum[j].v[1] < prod.v[1]);
+      }
+
+  out->v[1] = sum[0].v[1] + sum[1].v[1];
+  out->v[0] = sum[0].v[0] + sum[1].v[0] + (out->v[1] < sum[1].v[1]);
+}
+
+/** Hashes whole blocks, for all the iterations, that are a constant in each
+ * instance below. */
+static ALWAYS_INLINE void
+hash_blocks(const vhash_key *key, vhash_state *state, const uint8_t *msg,
+	    size_t blocks, const int iters)
+{
+  int i;
+
+  for(; blocks; --blocks, msg += VHASH_BLOCK_SIZE)
+    for(i = 0; i < iters; ++i)
+      {
+	uint128 nh;
+	nh64(key->nh + 2 * i, msg, BLOCK_WORDS, &nh);
+	umac_poly128_iteration(&key->poly[i], &nh, &state->y[i]);
+      }
+}
+
+static void
+hash_blocks_any(const vhash_key *key, vhash_state *state, const uint8_t *msg, size_t blocks)
+{
+  if(state->iters == 1)
+    hash_blocks(key, state, msg, blocks, 1);
+  else
+    hash_blocks(key, state, msg, blocks, 2);
+}
+
+void
+vhash_key_setup(vhash_type type, vhash_key *key, buffered_state *full_state)
+{
+  const int iters = (int)type + 1;
+  uint8_t bytes[sizeof(key->nh)];
+  int i;
+
+  key->iters = iters;
+
+  buffered_action(full_state, bytes, (BLOCK_WORDS + 2 * (iters - 1)) * 8, BUFFERED_EXTRACT);
+  for(i = 0; i < BLOCK_WORDS + 2 * (iters - 1); ++i)
+    key->nh[i] = load64(bytes + i * 8);
+
+  buffered_action(full_state, bytes, iters * 16, BUFFERED_EXTRACT);
+  for(i = 0; i < iters; ++i)
+    {
+      key->poly[i].v[1] = load64(bytes + i * 16) & UMAC_POLY_KEY_MASK;
+      key->poly[i].v[0] = load64(bytes + i * 16 + 8) & UMAC_POLY_KEY_MASK;
+    }
+
+  umac_l3_keys_setup(full_state, key->l3key1[0], key->l3key2, 2 * iters);
+}
+
+void
+vhash_init(const vhash_key *key, vhash_state *state)
+{
+  int i;
+
+  state->iters = key->iters;
+  state->buffer_len = 0;
+  state->total_len = 0;
+  for(i = 0; i < key->iters; ++i)
+    {
+      state->y[i].v[0] = 0;
+      state->y[i].v[1] = 1;
+    }
+}
+
+void
+vhash_update(const vhash_key *key, vhash_state *state, const uint8_t *input, size_t len)
+{
+  uint8_t *buffer = (uint8_t *)state->buffer;
+  size_t blocks;
+
+  state->total_len += len;
+
+  if(state->buffer_len)
+    {
+      size_t to_copy = min(len, VHASH_BLOCK_SIZE - state->buffer_len);
+
+      memcpy(buffer + state->buffer_len, input, to_copy);
+      state->buffer_len += to_copy;
+      input += to_copy;
+      len -= to_copy;
+
+      if(state->buffer_len < VHASH_BLOCK_SIZE)
+	return;
+
+      hash_blocks_any(key, state, buffer, 1);
+      state->buffer_len = 0;
+    }
+
+  blocks = len / VHASH_BLOCK_SIZE;
+  hash_blocks_any(key, state, input, blocks);
+  input += blocks * VHASH_BLOCK_SIZE;
+  len -= blocks * VHASH_BLOCK_SIZE;
+
+  memcpy(buffer, input, len);
+  state->buffer_len = len;
+}
+
+void
+vhash_finish(const vhash_key *key, vhash_state *state, uint8_t *output)
+{
+  uint8_t *buffer = (uint8_t *)state->buffer;
+  /* The message bit length closes the polynomial, so that messages differing
+   * only by the zero padding of the last block have different hashes. */
+  const uint128 last = {{0x8000000000000000u, state->total_len * 8}};
+  int i, j;
+
+  /* The last partial block is padded with zeros to a multiple of 32 bytes. */
+  if(state->buffer_len)
+    {
+      const size_t words = (state->buffer_len + 31) / 32 * 4;
+
+      memset(buffer + state->buffer_len, 0, words * 8 - state->buffer_len);
+      for(i = 0; i < state->iters; ++i)
+	{
+	  uint128 nh;
+	  nh64(key->nh + 2 * i, buffer, words, &nh);
+	  umac_poly128_iteration(&key->poly[i], &nh, &state->y[i]);
+	}
+    }
+
+  for(i = 0; i < state->iters; ++i)
+    {
+      umac_poly128_iteration(&key->poly[i], &last, &state->y[i]);
+
+      for(j = 0; j < 2; ++j)
+	{
+	  const uint32_t out = umac_l3_hash(key->l3key1[2 * i + j],
+					    key->l3key2[2 * i + j], &state->y[i]);
+
+	  output[0] = out >> 24;
+	  output[1] = out >> 16;
+	  output[2] = out >> 8;
+	  output[3] = out;
+	  output += 4;
+	}
+    }
+}
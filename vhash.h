@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stddef.h>
+#include <inttypes.h>
+#include "buffered.h"
+#include "umac.h"
+
+/** VHASH-style universal hash, with NH over 64 bits words.
+ *
+ * Like UHASH, but the L1 NH multiplies 64 bits words into 128 bits products,
+ * with half the multiplications per byte, what favours 64 bits cores. The
+ * 128 bits output of each 1 KB block is hashed by UHASH's POLY-128, and the
+ * result is compressed by UHASH's L3. Each iteration gives 64 bits of tag.
+ *
+ * The tags are not compatible with VMAC's, as the keys are extracted from a
+ * cipher stream like the UHASH ones, and the upper layers are those of UHASH.
+ */
+
+/** Size of the NH blocks, in bytes. */
+#define VHASH_BLOCK_SIZE 1024
+
+typedef enum
+{
+  VHASH_64,
+  VHASH_128
+} vhash_type;
+
+#define VHASH_MAX_ITERS 2
+
+typedef struct
+{
+  /** NH key, as native words; iteration i uses it shifted by 2 words. */
+  uint64_t nh[VHASH_BLOCK_SIZE / 8 + 2 * (VHASH_MAX_ITERS - 1)];
+  uint128 poly[VHASH_MAX_ITERS];
+  /** L3 keys, for the two 32 bits halves of each iteration output. */
+  uint64_t l3key1[2 * VHASH_MAX_ITERS][8];
+  uint32_t l3key2[2 * VHASH_MAX_ITERS];
+  uint8_t iters;
+} vhash_key;
+
+/** VHASH state. All fields are internal. */
+typedef struct
+{
+  uint128 y[VHASH_MAX_ITERS];
+  uint64_t buffer[VHASH_BLOCK_SIZE / 8];
+  uint16_t buffer_len;
+  uint8_t iters;
+  uint64_t total_len;
+} vhash_state;
+
+/** Sets up a key with bytes extracted from a cipher stream. */
+void vhash_key_setup(vhash_type type, vhash_key *key, buffered_state *full_state);
+
+void vhash_init(const vhash_key *key, vhash_state *state);
+
+void vhash_update(const vhash_key *key, vhash_state *state, const uint8_t *input, size_t len);
+
+/** Finishes the message.
+ *
+ * @param output Where to store the tag, 8 bytes for VHASH_64 or 16 bytes for
+ * VHASH_128.
+ */
+void vhash_finish(const vhash_key *key, vhash_state *state, uint8_t *output);